@@ -0,0 +1,451 @@
+// account_table.c
+#include "account_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// Function to find the slot for an account number, allocating its page if
+// needed (accountNumber must be in 1..max_account)
+static AccountSlot *table_slot(AccountTable *table, int accountNumber, int allocate) {
+    AccountSlot **page = &table->pages[accountNumber >> ACCOUNT_PAGE_SHIFT];
+    if (!*page) {
+        if (!allocate) {
+            return NULL;
+        }
+        *page = calloc(ACCOUNT_PAGE_SIZE, sizeof(AccountSlot));
+        if (!*page) {
+            return NULL;
+        }
+    }
+    return &(*page)[accountNumber & (ACCOUNT_PAGE_SIZE - 1)];
+}
+
+// Function to empty a table before loading it
+static void table_reset(AccountTable *table) {
+    table->pages = NULL;
+    table->page_count = 0;
+    table->max_account = 0;
+    table->records = NULL;
+    table->record_count = 0;
+    table->count = 0;
+}
+
+// Function to read a whole file into memory (returns NULL on error)
+static void *read_file(const char *filename, size_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    // Read the whole file in one go instead of one record per call
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *data = malloc(size > 0 ? size : 1);
+    if (!data || fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *length = size;
+    return data;
+}
+
+// Function to index the loaded records by account number. Balances come from
+// the records' amounts, or in exact cents from a snapshot if one is given.
+static int index_records(AccountTable *table, int max_account, const SnapshotRecord *snapshot) {
+    if (max_account == 0) {
+        for (int i = 0; i < table->record_count; ++i) {
+            if (table->records[i].accountNumber > max_account) {
+                max_account = table->records[i].accountNumber;
+            }
+        }
+    }
+    table->max_account = max_account;
+    table->page_count = (max_account >> ACCOUNT_PAGE_SHIFT) + 1;
+    table->pages = calloc(table->page_count, sizeof(AccountSlot *));
+    if (!table->pages) {
+        perror("Unable to allocate account table");
+        return -1;
+    }
+
+    for (int i = 0; i < table->record_count; ++i) {
+        int accountNumber = table->records[i].accountNumber;
+
+        if (accountNumber < 1 || accountNumber > max_account) {
+            fprintf(stderr, "Skipping account %d at record %d: outside 1..%d\n",
+                    accountNumber, i, max_account);
+            continue;
+        }
+
+        AccountSlot *slot = table_slot(table, accountNumber, 1);
+        if (!slot) {
+            perror("Unable to allocate account table");
+            return -1;
+        }
+        if (slot->present) {
+            // Keep the first record, as the old linear scan did
+            continue;
+        }
+
+        slot->accountNumber = accountNumber;
+        slot->departmentNumber = table->records[i].departmentNumber;
+        atomic_init(&slot->balance, snapshot ? snapshot[i].balance : amount_to_cents(table->records[i].amount));
+        slot->index = i;
+        slot->present = 1;
+        table->count++;
+    }
+
+    return 0;
+}
+
+// Function to load the data file into the table
+int account_table_load(AccountTable *table, const char *filename, int max_account) {
+    table_reset(table);
+
+    size_t length;
+    table->records = read_file(filename, &length);
+    if (!table->records) {
+        perror("Unable to read account data file");
+        return -1;
+    }
+    table->record_count = length / sizeof(Account);
+
+    return index_records(table, max_account, NULL);
+}
+
+// Function to hash bytes, continuing from hash (FNV-1a)
+static uint64_t hash_update(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#define HASH_START 14695981039346656037ull
+
+// Function to load a snapshot file into the table
+int account_table_load_snapshot(AccountTable *table, const char *filename, int max_account, uint64_t *lsn) {
+    table_reset(table);
+
+    size_t length;
+    char *data = read_file(filename, &length);
+    if (!data) {
+        perror("Unable to read snapshot");
+        return -1;
+    }
+
+    SnapshotHeader header;
+    const SnapshotRecord *records = (const SnapshotRecord *)(data + sizeof(SnapshotHeader));
+    if (length < sizeof(SnapshotHeader)) {
+        header.magic = 0;
+    } else {
+        memcpy(&header, data, sizeof(SnapshotHeader));
+    }
+    if (header.magic != SNAPSHOT_MAGIC || header.count > INT32_MAX
+        || length != sizeof(SnapshotHeader) + header.count * sizeof(SnapshotRecord)
+        || hash_update(HASH_START, records, header.count * sizeof(SnapshotRecord)) != header.hash) {
+        fprintf(stderr, "%s is not a complete snapshot\n", filename);
+        free(data);
+        return -1;
+    }
+
+    // Checkpoints write the table back as a data file in the same order
+    table->record_count = header.count;
+    table->records = malloc((header.count ? header.count : 1) * sizeof(Account));
+    if (!table->records) {
+        perror("Unable to allocate account table");
+        free(data);
+        return -1;
+    }
+    for (int i = 0; i < table->record_count; ++i) {
+        memset(&table->records[i], 0, sizeof(Account));
+        table->records[i].accountNumber = records[i].accountNumber;
+        table->records[i].departmentNumber = (unsigned char)records[i].departmentNumber;
+        table->records[i].amount = (float)cents_to_amount(records[i].balance);
+    }
+
+    int result = index_records(table, max_account, records);
+    free(data);
+    *lsn = header.lsn;
+    return result;
+}
+
+// Function to find an account by number
+AccountSlot *account_table_find(AccountTable *table, int accountNumber) {
+    if (accountNumber < 1 || accountNumber > table->max_account) {
+        return NULL;
+    }
+    AccountSlot *slot = table_slot(table, accountNumber, 0);
+    return slot && slot->present ? slot : NULL;
+}
+
+// Function to find the account loaded from a data file record
+AccountSlot *account_table_record_slot(AccountTable *table, int index) {
+    AccountSlot *slot = account_table_find(table, table->records[index].accountNumber);
+    return slot && slot->index == index ? slot : NULL;
+}
+
+// Function to copy the table into a snapshot image
+SnapshotRecord *account_table_capture(AccountTable *table, int *count) {
+    SnapshotRecord *image = malloc((table->record_count ? table->record_count : 1) * sizeof(SnapshotRecord));
+    if (!image) {
+        return NULL;
+    }
+    *count = 0;
+    for (int i = 0; i < table->record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(table, i);
+        if (slot) {
+            image[(*count)++] = (SnapshotRecord){
+                .accountNumber = slot->accountNumber,
+                .departmentNumber = slot->departmentNumber,
+                .balance = atomic_load(&slot->balance)
+            };
+        }
+    }
+    return image;
+}
+
+// Function to hash a data file image
+static uint64_t image_hash(const void *data, size_t length) {
+    return hash_update(HASH_START, data, length);
+}
+
+// Function to write a whole file and sync it
+static int write_file(const char *filename, const void *data, size_t length) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    if (fsync(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// Function to replace a file atomically with new contents
+static int replace_file(const char *filename, const void *data, size_t length) {
+    char temp_name[256];
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    if (write_file(temp_name, data, length) < 0 || rename(temp_name, filename) < 0) {
+        return -1;
+    }
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// Function to write the control file
+static int write_control(const char *filename, CheckpointMark current, CheckpointMark previous) {
+    char control_name[256];
+    snprintf(control_name, sizeof(control_name), "%s.ckpt", filename);
+    CheckpointControl control = {CHECKPOINT_MAGIC, 0, current, previous};
+    return replace_file(control_name, &control, sizeof(control));
+}
+
+// Function to find the LSN the data file on disk was checkpointed at
+int account_table_checkpoint_lsn(AccountTable *table, const char *filename, uint64_t *lsn) {
+    char control_name[256];
+    snprintf(control_name, sizeof(control_name), "%s.ckpt", filename);
+
+    // The table still holds exactly what the data file contains
+    CheckpointMark disk = {0, image_hash(table->records, table->record_count * sizeof(Account))};
+
+    CheckpointControl control;
+    FILE *file = fopen(control_name, "rb");
+    if (!file) {
+        // Never checkpointed: the data file is the starting state
+        *lsn = 0;
+        return write_control(filename, disk, disk);
+    }
+    size_t read = fread(&control, sizeof(control), 1, file);
+    fclose(file);
+    if (read != 1 || control.magic != CHECKPOINT_MAGIC) {
+        fprintf(stderr, "%s is damaged\n", control_name);
+        return -1;
+    }
+
+    if (control.current.hash == disk.hash) {
+        disk.lsn = control.current.lsn;
+    } else if (control.previous.hash == disk.hash) {
+        // Crashed after writing the control file but before replacing the data file
+        disk.lsn = control.previous.lsn;
+    } else {
+        fprintf(stderr, "%s does not match %s; it was replaced outside the server\n", filename, control_name);
+        return -1;
+    }
+
+    *lsn = disk.lsn;
+    return write_control(filename, disk, disk);
+}
+
+// Function to write bytes at an offset, retrying short writes
+static int write_at(int fd, const void *data, size_t length, off_t offset) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// Function to write the table to a snapshot file
+int account_table_write_snapshot(AccountTable *table, const char *filename, uint64_t lsn) {
+    SnapshotRecord buffer[256];
+    SnapshotHeader header = {SNAPSHOT_MAGIC, 0, lsn, 0, HASH_START};
+    off_t offset = sizeof(SnapshotHeader);
+    int buffered = 0;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Records follow the data file order; the header goes in last, once the
+    // count and hash are known
+    for (int i = 0; i <= table->record_count; ++i) {
+        AccountSlot *slot = i < table->record_count ? account_table_record_slot(table, i) : NULL;
+        if (slot) {
+            buffer[buffered].accountNumber = slot->accountNumber;
+            buffer[buffered].departmentNumber = slot->departmentNumber;
+            buffer[buffered].balance = atomic_load(&slot->balance);
+            buffered++;
+        }
+        if (buffered == 256 || (i == table->record_count && buffered > 0)) {
+            size_t length = buffered * sizeof(SnapshotRecord);
+            if (write_at(fd, buffer, length, offset) < 0) {
+                close(fd);
+                return -1;
+            }
+            header.hash = hash_update(header.hash, buffer, length);
+            header.count += buffered;
+            offset += length;
+            buffered = 0;
+        }
+    }
+
+    if (write_at(fd, &header, sizeof(header), 0) < 0 || fsync(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// Function to replace the snapshot file with a checkpoint image
+int account_table_checkpoint(const char *filename, const SnapshotRecord *image, int count, uint64_t lsn) {
+    size_t length = count * sizeof(SnapshotRecord);
+    SnapshotHeader header = {SNAPSHOT_MAGIC, 0, lsn, count, hash_update(HASH_START, image, length)};
+    char temp_name[256];
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Unable to write checkpoint");
+        return -1;
+    }
+    if (write_at(fd, &header, sizeof(header), 0) < 0 || write_at(fd, image, length, sizeof(header)) < 0
+        || fsync(fd) < 0) {
+        perror("Unable to write checkpoint");
+        close(fd);
+        unlink(temp_name);
+        return -1;
+    }
+    if (close(fd) < 0 || rename(temp_name, filename) < 0) {
+        perror("Unable to write checkpoint");
+        unlink(temp_name);
+        return -1;
+    }
+
+    // The checkpoint replaces the old one for good only once its directory
+    // entry is synced
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) < 0) {
+        perror("Unable to sync checkpoint directory");
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return -1;
+    }
+    close(dir_fd);
+    return 0;
+}
+
+// Function to replace the data file with the balances of a checkpoint image
+int account_table_export(AccountTable *table, const char *filename, const SnapshotRecord *image, uint64_t lsn) {
+    size_t length = table->record_count * sizeof(Account);
+    Account *data = malloc(length ? length : 1);
+    if (!data) {
+        perror("Unable to allocate data file image");
+        return -1;
+    }
+    // The image holds the records the table loaded, in data file order
+    memcpy(data, table->records, length);
+    for (int i = 0, next = 0; i < table->record_count; ++i) {
+        if (account_table_record_slot(table, i)) {
+            data[i].amount = (float)cents_to_amount(image[next++].balance);
+        }
+    }
+    CheckpointMark current = {lsn, image_hash(data, length)};
+
+    // Read the mark of the data file that is on disk right now. A table
+    // loaded from a snapshot may have no control file yet: then the mark is
+    // made from the data file itself, so a crash before it is replaced still
+    // leaves a data file the control file knows.
+    char control_name[256];
+    snprintf(control_name, sizeof(control_name), "%s.ckpt", filename);
+    CheckpointControl control;
+    FILE *file = fopen(control_name, "rb");
+    if (!file && errno == ENOENT) {
+        size_t disk_length = 0;
+        char *disk = read_file(filename, &disk_length);
+        control.current = (CheckpointMark){0, image_hash(disk ? disk : "", disk ? disk_length : 0)};
+        free(disk);
+    } else if (!file || fread(&control, sizeof(control), 1, file) != 1) {
+        if (file) {
+            fclose(file);
+        }
+        perror("Unable to read checkpoint control file");
+        free(data);
+        return -1;
+    } else {
+        fclose(file);
+    }
+
+    int result = write_control(filename, current, control.current) < 0 || replace_file(filename, data, length) < 0 ? -1 : 0;
+    if (result < 0) {
+        perror("Unable to export data file");
+    }
+    free(data);
+    return result;
+}
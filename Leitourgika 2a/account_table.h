@@ -0,0 +1,110 @@
+// account_table.h
+#ifndef ACCOUNT_TABLE_H
+#define ACCOUNT_TABLE_H
+
+#include "bank_system.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+// In-memory copy of one account record
+typedef struct {
+    int accountNumber;
+    unsigned char departmentNumber;
+    _Atomic int64_t balance; // Cents, updated with atomic operations only
+    _Atomic uint64_t version; // Log position of the account's last change
+    _Atomic int claimed;      // Claims of the changes central is applying to it
+    int index;      // Position of the record in the data file
+    int present;    // Non-zero if the account exists in the data file
+} AccountSlot;
+
+// Slots are allocated a page at a time, only for pages holding an account
+#define ACCOUNT_PAGE_SHIFT 12
+#define ACCOUNT_PAGE_SIZE (1 << ACCOUNT_PAGE_SHIFT)
+
+// Account table indexed directly by accountNumber, backed by a data file.
+// Page p holds account numbers p * ACCOUNT_PAGE_SIZE up to the next page.
+typedef struct {
+    AccountSlot **pages;    // NULL for a page with no accounts
+    int page_count;
+    int max_account;        // Highest account number the table holds
+    Account *records;       // Data file as loaded, so checkpoints keep its record order
+    int record_count;
+    int count;
+} AccountTable;
+
+// Which state of the data file a checkpoint control file describes
+typedef struct {
+    uint64_t lsn;       // Last log record included in the data file
+    uint64_t hash;      // Hash of the data file contents
+} CheckpointMark;
+
+// Checkpoint control file, written before the data file is replaced. It keeps
+// the marks of both the new and the previous data file, so after a crash at
+// any point the data file on disk matches one of them.
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    CheckpointMark current;
+    CheckpointMark previous;
+} CheckpointControl;
+
+#define CHECKPOINT_MAGIC 0x54504B43 // "CKPT"
+
+// Snapshot file, written online by /snapshot and as every checkpoint: this
+// header, then one record per account in data file order, with exact
+// balances as of log position lsn
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t lsn;       // Last log record included in the balances
+    uint64_t count;     // Records that follow
+    uint64_t hash;      // Hash of the records
+} SnapshotHeader;
+
+typedef struct {
+    int32_t accountNumber;
+    int32_t departmentNumber;
+    int64_t balance;    // Cents
+} SnapshotRecord;
+
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP"
+
+// Load every record of the data file into the table. Account numbers range
+// from 1 to max_account, or to the highest one in the file if max_account is
+// 0 (returns -1 on error)
+int account_table_load(AccountTable *table, const char *filename, int max_account);
+
+// Load a snapshot file instead of a data file, and the log position its
+// balances match (returns -1 on error)
+int account_table_load_snapshot(AccountTable *table, const char *filename, int max_account, uint64_t *lsn);
+
+// Find an account by number (returns NULL if it does not exist)
+AccountSlot *account_table_find(AccountTable *table, int accountNumber);
+
+// Find the account loaded from data file record index (returns NULL if that
+// record was skipped)
+AccountSlot *account_table_record_slot(AccountTable *table, int index);
+
+// Copy every balance into a snapshot image of count records; the caller must
+// keep writers out (returns NULL on error)
+SnapshotRecord *account_table_capture(AccountTable *table, int *count);
+
+// Write the table to a snapshot file at lsn and sync it; the caller must keep
+// writers out. Only system calls are used and nothing is allocated, so it is
+// safe in a child forked while other threads held locks (returns -1 on error).
+int account_table_write_snapshot(AccountTable *table, const char *filename, uint64_t lsn);
+
+// Find the LSN the data file on disk was checkpointed at (0 for a data file
+// that was never checkpointed; returns -1 if it matches no known checkpoint)
+int account_table_checkpoint_lsn(AccountTable *table, const char *filename, uint64_t *lsn);
+
+// Atomically replace the snapshot file filename with image, in exact cents as
+// of lsn, and sync it
+int account_table_checkpoint(const char *filename, const SnapshotRecord *image, int count, uint64_t lsn);
+
+// Atomically replace the data file with image, recording that it holds lsn.
+// Data file amounts are floats, so balances above about 167,772.16 may lose
+// cents: the data file is only an export once checkpoints exist.
+int account_table_export(AccountTable *table, const char *filename, const SnapshotRecord *image, uint64_t lsn);
+
+#endif // ACCOUNT_TABLE_H
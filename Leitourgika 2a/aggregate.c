@@ -0,0 +1,74 @@
+// aggregate.c
+#include "aggregate.h"
+#include <stdio.h>
+
+// Function to initialize an empty aggregate
+void aggregate_init(DepartmentAggregate *aggregate) {
+    atomic_init(&aggregate->sum, 0);
+    atomic_init(&aggregate->count, 0);
+}
+
+// Function to add a new account
+void aggregate_add_account(DepartmentAggregate *aggregate, int64_t balance) {
+    atomic_fetch_add(&aggregate->sum, balance);
+    atomic_fetch_add(&aggregate->count, 1);
+}
+
+// Function to record a balance change
+void aggregate_change(DepartmentAggregate *aggregate, int64_t delta) {
+    atomic_fetch_add(&aggregate->sum, delta);
+}
+
+// Function to read the current sum and count
+int aggregate_read(DepartmentAggregate *aggregate, int64_t *sum) {
+    *sum = atomic_load(&aggregate->sum);
+    return atomic_load(&aggregate->count);
+}
+
+// Function to compare a live aggregate with a full scan
+int aggregate_verify(DepartmentAggregate *aggregate, DepartmentAggregate *scanned, unsigned char departmentNumber) {
+    int64_t live_sum, scanned_sum;
+    int live_count = aggregate_read(aggregate, &live_sum);
+    int scanned_count = aggregate_read(scanned, &scanned_sum);
+
+    if (live_count != scanned_count || live_sum != scanned_sum) {
+        fprintf(stderr, "Department %d aggregate mismatch: running sum %lld cents over %d accounts, scan %lld cents over %d accounts\n",
+                departmentNumber, (long long)live_sum, live_count, (long long)scanned_sum, scanned_count);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to initialize empty totals
+void aggregate_snapshot_init(AggregateSnapshot *snapshot) {
+    atomic_init(&snapshot->sequence, 0);
+    atomic_init(&snapshot->lsn, 0);
+    for (int i = 0; i < AGGREGATE_DEPARTMENTS; ++i) {
+        aggregate_init(&snapshot->departments[i]);
+    }
+}
+
+// Function to start changing the totals
+void aggregate_snapshot_begin(AggregateSnapshot *snapshot) {
+    atomic_fetch_add(&snapshot->sequence, 1);
+}
+
+// Function to publish the changes made since aggregate_snapshot_begin
+void aggregate_snapshot_publish(AggregateSnapshot *snapshot, uint64_t lsn) {
+    atomic_store(&snapshot->lsn, lsn);
+    atomic_fetch_add(&snapshot->sequence, 1);
+}
+
+// Function to read one department's totals as of a single log position
+uint64_t aggregate_snapshot_read(AggregateSnapshot *snapshot, unsigned char departmentNumber, DepartmentAggregate *totals) {
+    DepartmentAggregate *department = &snapshot->departments[departmentNumber];
+    uint64_t before, after, lsn;
+    do {
+        before = atomic_load(&snapshot->sequence);
+        atomic_store(&totals->sum, atomic_load(&department->sum));
+        atomic_store(&totals->count, atomic_load(&department->count));
+        lsn = atomic_load(&snapshot->lsn);
+        after = atomic_load(&snapshot->sequence);
+    } while (before != after || (before & 1));
+    return lsn;
+}
@@ -0,0 +1,60 @@
+// aggregate.h
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Aggregates are indexed directly by the unsigned char department number
+#define AGGREGATE_DEPARTMENTS 256
+
+// Running sum and count of one department's balances, kept up to date by
+// every mutation so an average costs O(1). The sum is in whole cents, so it
+// is exact and never drifts, and it is updated with atomic adds only.
+typedef struct {
+    _Atomic int64_t sum;
+    _Atomic int count;
+} DepartmentAggregate;
+
+// Every department's totals as of one log position, changed by a single
+// writer thread and read by any number of threads without locks. The writer
+// makes the sequence odd while it applies a group of changes and even again
+// when it publishes them; readers retry if it moved while they read, so they
+// never see half of a transfer, and the writer never waits for readers.
+typedef struct {
+    _Atomic uint64_t sequence;
+    _Atomic uint64_t lsn;       // Last change included
+    DepartmentAggregate departments[AGGREGATE_DEPARTMENTS];
+} AggregateSnapshot;
+
+// Initialize an empty aggregate
+void aggregate_init(DepartmentAggregate *aggregate);
+
+// Add a new account with the given balance in cents
+void aggregate_add_account(DepartmentAggregate *aggregate, int64_t balance);
+
+// Record that one account's balance changed by delta cents
+void aggregate_change(DepartmentAggregate *aggregate, int64_t delta);
+
+// Read the current sum in cents; returns the number of accounts
+int aggregate_read(DepartmentAggregate *aggregate, int64_t *sum);
+
+// Compare a live aggregate with one rebuilt by a full scan and report any
+// difference on stderr (returns -1 on mismatch)
+int aggregate_verify(DepartmentAggregate *aggregate, DepartmentAggregate *scanned, unsigned char departmentNumber);
+
+// Initialize empty totals at log position 0
+void aggregate_snapshot_init(AggregateSnapshot *snapshot);
+
+// Start changing the totals with aggregate_add_account and aggregate_change
+// on snapshot->departments (writer thread only)
+void aggregate_snapshot_begin(AggregateSnapshot *snapshot);
+
+// Let readers see every change since aggregate_snapshot_begin, as of lsn
+void aggregate_snapshot_publish(AggregateSnapshot *snapshot, uint64_t lsn);
+
+// Copy one department's totals out of a consistent view; returns the log
+// position they match
+uint64_t aggregate_snapshot_read(AggregateSnapshot *snapshot, unsigned char departmentNumber, DepartmentAggregate *totals);
+
+#endif // AGGREGATE_H
@@ -3,12 +3,15 @@
 #define BANK_SYSTEM_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
 // Constants
 #define CENTRAL_PORT 9000
 #define BRANCH_PORT_BASE 9100
 #define DEPARTMENT_COUNT 2
+// Account count of the generated data and load files; the servers size their
+// tables from accounts.dat or -n instead
 #define TOTAL_ACCOUNTS 1000
 #define ACCOUNTS_PER_DEPARTMENT (TOTAL_ACCOUNTS / DEPARTMENT_COUNT)
 
@@ -21,6 +24,10 @@
 #define QUERY_UPDATE 2
 #define QUERY_TRANSFER 3
 #define QUERY_AVERAGE 4
+#define QUERY_SUBSCRIBE 5 // Branch to central: push FRAME_INVALIDATE on this connection
+#define QUERY_REPLICATE 6 // Branch to central: push FRAME_CHANGES for departmentNumber on this connection
+#define QUERY_MULTI_TRANSFER 7 // Central only: every TransferLeg of a FRAME_LEGS frame, or none
+#define QUERY_STATS 8     // Count, sum, minimum, maximum and variance of departmentNumber's balances
 
 // Account record structure
 typedef struct {
@@ -29,6 +36,27 @@ typedef struct {
     float amount;
 } Account;
 
+// Balances are kept in memory as whole cents so they can be updated atomically
+#define CENTS_PER_UNIT 100
+
+// Function to convert a wire or file amount to the nearest whole cents
+static inline int64_t amount_to_cents(float amount) {
+    double cents = (double)amount * CENTS_PER_UNIT;
+    return (int64_t)(cents < 0 ? cents - 0.5 : cents + 0.5);
+}
+
+// Function to convert cents back to an amount for replies and the data file
+static inline double cents_to_amount(int64_t cents) {
+    return (double)cents / CENTS_PER_UNIT;
+}
+
+// Function to read the wall clock in microseconds
+static inline int64_t current_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 // Request structure
 typedef struct {
     int queryType;
@@ -44,4 +72,153 @@ typedef struct {
     char message[256];
 } Response;
 
+// Error codes carried by CompactResponse (metrics.h counts METRICS_ERROR_CODES
+// of them, so raise it along with any new code)
+#define ERROR_NONE 0
+#define ERROR_ACCOUNT_NOT_FOUND 1      // accountNumber1 does not exist
+#define ERROR_ACCOUNTS_NOT_FOUND 2     // One or both transfer accounts do not exist
+#define ERROR_SAME_ACCOUNT 3
+#define ERROR_INSUFFICIENT_FUNDS 4     // In accountNumber1
+#define ERROR_NO_ACCOUNTS 5            // Department accountNumber1 has no accounts
+#define ERROR_INVALID_QUERY 6
+#define ERROR_CENTRAL_UNAVAILABLE 7
+#define ERROR_CENTRAL_FAILED 8         // Central rejected a branch's update or transfer
+#define ERROR_DUPLICATE_REQUEST 9      // Request id repeated within a batch
+#define ERROR_OUT_OF_MEMORY 10
+// 11 and 12 are reserved: they reported branch_accounts.dat failures from
+// when branches wrote it per request
+#define ERROR_TOO_MANY_SUBSCRIBERS 13
+#define ERROR_TOO_MANY_REPLICAS 14
+#define ERROR_VERSION_CONFLICT 15      // An account changed since the version the request expected
+#define ERROR_INVALID_LEGS 16          // Multi-transfer without legs, too many, a leg amount out of range, or a balance overflow
+#define ERROR_VERSIONED_LEGS 17        // Multi-transfer sent with FRAME_VERSIONED
+#define ERROR_REQUEST_BUSY 18          // Too many requests in progress to track this one; retry it
+
+// CompactResponse flags
+#define RESULT_LOCAL 0x1   // Also applied to the branch's own copy
+// 0x2 is reserved: it marked an account added to branch_accounts.dat
+
+// Typed response, sent instead of Response to requests framed with
+// FRAME_COMPACT: the numbers behind the message, for clients to format
+// only if they print it
+typedef struct {
+    int32_t status;          // STATUS_SUCCESS or STATUS_ERROR
+    int32_t error;           // ERROR_* code, ERROR_NONE on success
+    int32_t queryType;       // QUERY_* this answers
+    uint32_t flags;          // RESULT_* bits
+    int32_t accountNumber1;  // Account, transfer source, department for Average, or
+                             // the account a multi-transfer failed on
+    int32_t accountNumber2;  // Transfer destination, number of multi-transfer legs,
+                             // or number of accounts in the stats
+    int64_t amount;          // Cents: balance, amount transferred (in total), average,
+                             // or the stats' sum
+    int64_t timestamp;       // Seconds since the epoch when an average or stats were taken
+    uint64_t lsn;            // Central log position of an update or transfer (the
+                             // accounts' new version), the one an average was
+                             // taken at, or on ERROR_VERSION_CONFLICT the newest
+                             // version found; 0 if none
+    int64_t minimum;         // Cents: lowest balance in the stats
+    int64_t maximum;         // Cents: highest balance in the stats
+    double variance;         // Cents squared: population variance of the balances
+} CompactResponse;
+
+// Framed messages start with FRAME_MAGIC where a plain Request has its queryType
+#define FRAME_MAGIC 0x314B4E42 // "BNK1"
+
+// Header sent before every framed Request and Response
+typedef struct {
+    uint32_t magic;      // FRAME_MAGIC
+    uint32_t length;     // Payload bytes following the header
+    uint32_t clientId;   // Sender identity, scopes requestId (0 = no duplicate detection)
+    uint32_t flags;      // FRAME_* bits, 0 for a single Request or Response
+    uint64_t requestId;  // Chosen by the sender, echoed in the response
+} FrameHeader;
+
+// The payload is a batch: complete frames, each holding one Request (or, in
+// the reply, one Response in the same order), processed as one unit
+#define FRAME_BATCH 0x1
+
+// Set on a request to get CompactResponse replies instead of Response; set on
+// those replies too. On a batch, the outer frame's flag applies to all.
+#define FRAME_COMPACT 0x2
+
+// Most requests one batch may carry
+#define MAX_BATCH_REQUESTS 64
+
+// Set on a request whose Request is followed by RequestVersions; set on a
+// batch, every request in it carries them. Central applies an update or
+// transfer only if its accounts are still at the expected versions.
+#define FRAME_VERSIONED 0x10
+
+// Versions an update or transfer expects its accounts to be at. An account's
+// version is the central log position of its last change; 0 skips the check.
+typedef struct {
+    uint64_t version1;   // accountNumber1
+    uint64_t version2;   // accountNumber2
+} RequestVersions;
+
+// Set on a single QUERY_MULTI_TRANSFER frame (never a batch), and only there:
+// other queries with it, or a multi-transfer without it, are malformed. Its
+// Request is followed by 1 to MAX_TRANSFER_LEGS TransferLegs. Central applies all of
+// them or none. Legs carry no versions, so central refuses the frame with
+// ERROR_VERSIONED_LEGS if FRAME_VERSIONED is set too.
+#define FRAME_LEGS 0x20
+
+// Most legs one multi-transfer may carry; both sides of every leg fit in one
+// FRAME_CHANGES frame
+#define MAX_TRANSFER_LEGS 1024
+
+// Largest amount of one leg, in cents: the sum of a full multi-transfer's
+// legs stays far inside int64_t
+#define MAX_LEG_AMOUNT 1000000000000000LL
+
+// One leg of a multi-transfer
+typedef struct {
+    int32_t fromAccount;
+    int32_t toAccount;
+    int64_t amount;      // Cents, more than 0 and at most MAX_LEG_AMOUNT
+} TransferLeg;
+
+// Pushed by central, unasked, to connections that sent QUERY_SUBSCRIBE: the
+// payload is the int32_t numbers of accounts whose balance just changed, and
+// requestId holds the central wall clock (current_time_us) when it was sent.
+// A frame with no accounts is a heartbeat.
+#define FRAME_INVALIDATE 0x4
+
+// Seconds between heartbeats central sends every subscriber, so a branch can
+// tell a quiet subscription from a dead one
+#define SUBSCRIBER_HEARTBEAT 1
+
+// Most accounts one invalidation frame may carry (both sides of a full batch
+// of transfers)
+#define MAX_INVALIDATION_ACCOUNTS (2 * MAX_BATCH_REQUESTS)
+
+// Pushed by central, unasked, to connections that sent QUERY_REPLICATE: the
+// payload is a ChangeBatch and its ChangeRecords, in log order, and requestId
+// holds the central wall clock (current_time_us) when it was sent
+#define FRAME_CHANGES 0x8
+
+// ChangeBatch flags
+#define CHANGE_SYNC 0x1       // Records hold whole balances as of lsn, not deltas
+#define CHANGE_SYNC_DONE 0x2  // Last frame of a sync; deltas follow from here
+
+// Header of a FRAME_CHANGES payload
+typedef struct {
+    uint64_t lsn;        // Every change up to this log position is included
+    uint64_t head_lsn;   // Last position central had logged when sending
+    uint32_t count;      // ChangeRecords that follow
+    uint32_t flags;      // CHANGE_* bits
+} ChangeBatch;
+
+// One changed balance of the replicated department
+typedef struct {
+    int32_t accountNumber;
+    int32_t reserved;
+    int64_t amount;      // Cents: a delta, or the balance in a sync
+    uint64_t version;    // Account's version after the change
+} ChangeRecord;
+
+// Most records one FRAME_CHANGES frame may carry
+#define MAX_CHANGE_RECORDS 4096
+
 #endif // BANK_SYSTEM_H
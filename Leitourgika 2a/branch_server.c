@@ -1,52 +1,124 @@
 // branch_server.c
 #include "bank_system.h"
+#include "protocol.h"
+#include "event_loop.h"
+#include "work_pool.h"
+#include "aggregate.h"
+#include "remote_cache.h"
+#include "ownership.h"
+#include "replica.h"
+#include "logger.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Mutex for each account to handle concurrent access
-pthread_mutex_t account_mutex[TOTAL_ACCOUNTS + 1]; // accountNumber starts from 1
+// Number of long-lived connections each branch keeps open to the central server
+#define CENTRAL_POOL_SIZE 4
 
-unsigned char branch_department;
+// Times a forwarded request is sent before giving up
+#define CENTRAL_MAX_ATTEMPTS 3
 
-// Function to initialize mutexes
-void initialize_mutexes() {
-    for (int i = 0; i <= TOTAL_ACCOUNTS; ++i) {
-        pthread_mutex_init(&account_mutex[i], NULL);
-    }
-}
+// Seconds between reports of the remote cache and replica counters
+#define REPORT_INTERVAL 10
 
-// Function to lock an account
-void lock_account(int accountNumber) {
-    if (accountNumber < 1 || accountNumber > TOTAL_ACCOUNTS) {
-        return;
-    }
-    pthread_mutex_lock(&account_mutex[accountNumber]);
-    printf("Branch %d locked account %d\n", branch_department, accountNumber);
-}
+// Records copied to branch_accounts.dat per write at startup
+#define BRANCH_WRITE_CHUNK 65536
 
-// Function to unlock an account
-void unlock_account(int accountNumber) {
-    if (accountNumber < 1 || accountNumber > TOTAL_ACCOUNTS) {
-        return;
+// Default share of accounts held by the branch whose requests it handles itself
+#define LOCAL_PERCENT 80
+
+// Seconds without a frame from central, heartbeats included, after which the
+// subscription counts as lost and the remote cache is disabled
+#define SUBSCRIBER_TIMEOUT (3 * SUBSCRIBER_HEARTBEAT)
+
+// Conflicts after which an update or transfer is sent without versions, so
+// central applies it as long as the funds are there
+#define BRANCH_MAX_CONFLICTS 8
+
+unsigned char branch_department;
+
+// Accounts held in branch_accounts.dat, for routing without file scans
+OwnershipMap branch_accounts;
+
+// Percentage of held accounts whose requests are handled here rather than
+// forwarded (set with -r)
+int local_percent = LOCAL_PERCENT;
+
+// Recent responses, so retried client requests are applied only once
+RequestCache request_cache;
+
+// Workers that process client requests off the event loop threads
+WorkPool work_pool;
+
+// Balances of accounts displayed through central, kept while central pushes
+// their invalidations
+RemoteCache remote_cache;
+
+// This department's balances, kept in step with central's change stream
+Replica replica;
+
+// A forwarded request waiting for its response
+typedef struct PendingForward {
+    uint64_t requestId;
+    const Request *request;
+    RequestVersions versions;     // Checked by central (0 = any version)
+    CompactResponse *response;
+    int state;                    // 0 = waiting, 1 = answered, -1 = connection lost
+    struct PendingForward *next;
+    struct PendingForward *queue_next;
+} PendingForward;
+
+// One persistent connection to the central server, shared by all threads.
+// Requests are written as frames and a reader thread hands each response
+// to the thread waiting for its requestId, so many requests can be in
+// flight on the same connection and answered in any order. Requests queued
+// while another thread is writing are sent together as one batch.
+typedef struct {
+    int fd;                       // -1 until connected
+    PendingForward *pending;      // Requests queued or sent and not yet answered
+    PendingForward *queue;        // Requests not yet sent, oldest first
+    PendingForward **queue_tail;
+    pthread_mutex_t mutex;        // Guards fd, pending and queue
+    pthread_mutex_t write_mutex;  // Held while writing to fd, and to close it
+    pthread_cond_t cond;
+} CentralConnection;
+
+CentralConnection central_pool[CENTRAL_POOL_SIZE];
+uint32_t branch_client_id;
+uint64_t next_request_id;
+unsigned next_connection;
+
+// Function to initialize the connection pool
+void initialize_central_pool() {
+    branch_client_id = generate_client_id();
+    for (int i = 0; i < CENTRAL_POOL_SIZE; ++i) {
+        central_pool[i].fd = -1;
+        central_pool[i].pending = NULL;
+        central_pool[i].queue = NULL;
+        central_pool[i].queue_tail = &central_pool[i].queue;
+        pthread_mutex_init(&central_pool[i].mutex, NULL);
+        pthread_mutex_init(&central_pool[i].write_mutex, NULL);
+        pthread_cond_init(&central_pool[i].cond, NULL);
     }
-    pthread_mutex_unlock(&account_mutex[accountNumber]);
-    printf("Branch %d unlocked account %d\n", branch_department, accountNumber);
 }
 
-// Function to forward a request to the central server
-void forward_to_central(Request *request, Response *response) {
+// Function to open a new connection to the central server
+int connect_to_central() {
     int central_sock;
     struct sockaddr_in central_address;
 
     if ((central_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("Socket creation failed for central server");
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Central server connection failed.");
-        return;
+        return -1;
     }
 
     memset(&central_address, 0, sizeof(central_address));
@@ -56,42 +128,394 @@ void forward_to_central(Request *request, Response *response) {
 
     if (connect(central_sock, (struct sockaddr *)&central_address, sizeof(central_address)) < 0) {
         perror("Connection to central server failed");
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Central server connection failed.");
         close(central_sock);
-        return;
+        return -1;
     }
 
-    // Send request to central server
-    send(central_sock, request, sizeof(Request), 0);
+    int nodelay = 1;
+    setsockopt(central_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return central_sock;
+}
 
-    // Receive response from central server
-    recv(central_sock, response, sizeof(Response), 0);
+// Function to deliver central responses on one connection to their waiting threads
+void *central_reader(void *conn_ptr) {
+    CentralConnection *conn = conn_ptr;
+
+    pthread_mutex_lock(&conn->mutex);
+    int fd = conn->fd;
+    pthread_mutex_unlock(&conn->mutex);
+
+    FramedResponse responses[MAX_BATCH_REQUESTS];
+    int count;
+    while ((count = read_responses(fd, responses, MAX_BATCH_REQUESTS)) > 0) {
+        pthread_mutex_lock(&conn->mutex);
+        for (int i = 0; i < count; ++i) {
+            for (PendingForward **p = &conn->pending; *p; p = &(*p)->next) {
+                if ((*p)->requestId == responses[i].header.requestId) {
+                    PendingForward *answered = *p;
+                    *p = answered->next;
+                    memcpy(answered->response, &responses[i].response, sizeof(CompactResponse));
+                    answered->state = 1;
+                    break;
+                }
+            }
+        }
+        pthread_cond_broadcast(&conn->cond);
+        pthread_mutex_unlock(&conn->mutex);
+    }
 
-    close(central_sock);
+    // Connection is gone: fail everything still waiting so it can be retried
+    pthread_mutex_lock(&conn->mutex);
+    for (PendingForward *p = conn->pending; p; p = p->next) {
+        p->state = -1;
+    }
+    conn->pending = NULL;
+    conn->queue = NULL;
+    conn->queue_tail = &conn->queue;
+    conn->fd = -1;
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->mutex);
+
+    // Wait for a write in progress, so it never lands on a reused fd
+    pthread_mutex_lock(&conn->write_mutex);
+    close(fd);
+    pthread_mutex_unlock(&conn->write_mutex);
+    return NULL;
 }
 
-// Function to handle Display Query
-void handle_display(int accountNumber, Response *response) {
-    FILE *file = fopen("branch_accounts.dat", "rb");
-    if (!file) {
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open branch_accounts.dat.");
-        return;
+// Function to connect a pool slot and start its reader (caller holds conn->mutex)
+int open_central_connection(CentralConnection *conn) {
+    conn->fd = connect_to_central();
+    if (conn->fd < 0) {
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, central_reader, conn) != 0) {
+        perror("pthread_create failed");
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Function to send every queued request on a connection. Threads that queue
+// while another one is writing wait for write_mutex, and the first of them
+// to get it sends all their requests in one batch frame.
+void send_queued_forwards(CentralConnection *conn) {
+    FramedRequest batch[MAX_BATCH_REQUESTS];
+
+    pthread_mutex_lock(&conn->write_mutex);
+    pthread_mutex_lock(&conn->mutex);
+    while (conn->queue && conn->fd >= 0) {
+        int count = 0;
+        while (conn->queue && count < MAX_BATCH_REQUESTS) {
+            PendingForward *queued = conn->queue;
+            conn->queue = queued->queue_next;
+            batch[count].header = (FrameHeader){
+                .magic = FRAME_MAGIC,
+                .clientId = branch_client_id,
+                .requestId = queued->requestId
+            };
+            batch[count].request = *queued->request;
+            batch[count].versions = queued->versions;
+            count++;
+        }
+        if (!conn->queue) {
+            conn->queue_tail = &conn->queue;
+        }
+        int fd = conn->fd;
+        pthread_mutex_unlock(&conn->mutex);
+
+        int result = count == 1
+            ? write_framed_request(fd, &batch[0], FRAME_COMPACT | FRAME_VERSIONED)
+            : write_batch(fd, batch, count, FRAME_COMPACT | FRAME_VERSIONED);
+        metrics_add(METRIC_CENTRAL_MESSAGES, 1);
+        LOG(LOG_DEBUG, "Forwarded %d requests to central in one message", count);
+        if (result < 0) {
+            // Make the reader fail every request on this connection
+            shutdown(fd, SHUT_RDWR);
+        }
+
+        pthread_mutex_lock(&conn->mutex);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    pthread_mutex_unlock(&conn->write_mutex);
+}
+
+// Function to check whether a request updates or transfers an account held here
+int changes_held_account(const Request *request) {
+    if (request->queryType == QUERY_UPDATE) {
+        return ownership_owns(&branch_accounts, request->accountNumber1);
+    }
+    return request->queryType == QUERY_TRANSFER
+        && (ownership_owns(&branch_accounts, request->accountNumber1) || ownership_owns(&branch_accounts, request->accountNumber2));
+}
+
+// Function to forward requests to the central server, in one batch frame
+// when there are several, each checked against its versions (NULL = none)
+void forward_requests_to_central(Request **requests, const RequestVersions *versions, CompactResponse **responses,
+                                 int count) {
+    PendingForward pending[MAX_BATCH_REQUESTS];
+    unsigned generations[MAX_BATCH_REQUESTS];
+    unsigned first = __atomic_fetch_add(&next_connection, 1, __ATOMIC_RELAXED);
+    int64_t sent_at = current_time_us();
+    int answered = 0;
+
+    metrics_add(METRIC_FORWARDS, 1);
+    metrics_add(METRIC_FORWARDED_REQUESTS, count);
+
+    // Each requestId stays the same across retries, so central applies it once
+    for (int i = 0; i < count; ++i) {
+        if (requests[i]->queryType == QUERY_DISPLAY) {
+            generations[i] = remote_cache_generation(&remote_cache, requests[i]->accountNumber1);
+        }
+        pending[i] = (PendingForward){
+            .requestId = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED),
+            .request = requests[i],
+            .versions = versions ? versions[i] : (RequestVersions){0, 0},
+            .response = responses[i],
+            .state = -1
+        };
     }
 
-    Account account;
-    while (fread(&account, sizeof(Account), 1, file)) {
-        if (account.accountNumber == accountNumber) {
-            snprintf(response->message, sizeof(response->message), "Account %d balance: %.2f", accountNumber, account.amount);
-            response->status = STATUS_SUCCESS;
-            fclose(file);
+    for (int attempt = 0; attempt < CENTRAL_MAX_ATTEMPTS && !answered; ++attempt) {
+        CentralConnection *conn = &central_pool[(first + attempt) % CENTRAL_POOL_SIZE];
+        if (attempt > 0) {
+            metrics_add(METRIC_FORWARD_RETRIES, 1);
+        }
+
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->fd < 0 && open_central_connection(conn) < 0) {
+            pthread_mutex_unlock(&conn->mutex);
+            continue;
+        }
+
+        // Queue everything not answered yet
+        for (int i = 0; i < count; ++i) {
+            if (pending[i].state == 1) {
+                continue;
+            }
+            pending[i].state = 0;
+            pending[i].next = conn->pending;
+            conn->pending = &pending[i];
+            pending[i].queue_next = NULL;
+            *conn->queue_tail = &pending[i];
+            conn->queue_tail = &pending[i].queue_next;
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        send_queued_forwards(conn);
+
+        answered = 1;
+        pthread_mutex_lock(&conn->mutex);
+        for (int i = 0; i < count; ++i) {
+            while (pending[i].state == 0) {
+                pthread_cond_wait(&conn->cond, &conn->mutex);
+            }
+            if (pending[i].state != 1) {
+                answered = 0;
+            }
+        }
+        pthread_mutex_unlock(&conn->mutex);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const Request *request = requests[i];
+        if (pending[i].state == 1 && request->queryType == QUERY_DISPLAY && responses[i]->status == STATUS_SUCCESS) {
+            remote_cache_insert(&remote_cache, request->accountNumber1, responses[i]->amount, generations[i], sent_at);
+        } else if (request->queryType == QUERY_UPDATE || request->queryType == QUERY_TRANSFER) {
+            // Do not wait for central's invalidation to see our own change
+            remote_cache_invalidate(&remote_cache, request->accountNumber1);
+            if (request->queryType == QUERY_TRANSFER) {
+                remote_cache_invalidate(&remote_cache, request->accountNumber2);
+            }
+        }
+
+        if (pending[i].state != 1) {
+            metrics_add(METRIC_FORWARD_FAILURES, 1);
+            *responses[i] = (CompactResponse){
+                .status = STATUS_ERROR,
+                .error = ERROR_CENTRAL_UNAVAILABLE,
+                .queryType = requests[i]->queryType
+            };
+        }
+    }
+
+    // Changes to held accounts are acknowledged once the replica has them,
+    // so a read here right after never misses them
+    uint64_t replica_lsn = 0;
+    for (int i = 0; i < count; ++i) {
+        if (responses[i]->status == STATUS_SUCCESS && changes_held_account(requests[i]) && responses[i]->lsn > replica_lsn) {
+            replica_lsn = responses[i]->lsn;
+        }
+    }
+    if (replica_lsn != 0 && replica_wait(&replica, replica_lsn)) {
+        for (int i = 0; i < count; ++i) {
+            if (responses[i]->status == STATUS_SUCCESS && changes_held_account(requests[i])) {
+                responses[i]->flags |= RESULT_LOCAL;
+            }
+        }
+    }
+}
+
+// Function to forward a request to the central server
+void forward_to_central(Request *request, CompactResponse *response) {
+    forward_requests_to_central(&request, NULL, &response, 1);
+}
+
+// Function to forward an update or transfer that central applies only if its
+// accounts still have the versions the replica holds. Nothing is locked here
+// while central answers: if another change reached an account first, central
+// rejects this one, and it is sent again once the replica has that change.
+void forward_versioned(Request *request, CompactResponse *response) {
+    for (int conflicts = 0;; ++conflicts) {
+        RequestVersions versions = {0, 0};
+        if (conflicts < BRANCH_MAX_CONFLICTS) {
+            versions.version1 = replica_version(&replica, request->accountNumber1);
+            if (request->queryType == QUERY_TRANSFER) {
+                versions.version2 = replica_version(&replica, request->accountNumber2);
+            }
+        }
+        forward_requests_to_central(&request, &versions, &response, 1);
+        if (response->status != STATUS_ERROR || response->error != ERROR_VERSION_CONFLICT) {
             return;
         }
+        metrics_add(METRIC_VERSION_CONFLICTS, 1);
+        LOG(LOG_DEBUG, "Version conflict on account %d, waiting for LSN %llu",
+            request->accountNumber1, (unsigned long long)response->lsn);
+        replica_wait(&replica, response->lsn);
+    }
+}
+
+// Function to answer a display from the replica or, for accounts held by
+// another branch, the remote cache (returns 1 on a hit)
+int display_from_cache(int accountNumber, CompactResponse *response) {
+    int64_t balance;
+    if (!replica_balance(&replica, accountNumber, &balance)
+        && !remote_cache_lookup(&remote_cache, accountNumber, &balance)) {
+        return 0;
     }
+    *response = (CompactResponse){
+        .status = STATUS_SUCCESS,
+        .queryType = QUERY_DISPLAY,
+        .accountNumber1 = accountNumber,
+        .amount = balance
+    };
+    return 1;
+}
 
-    fclose(file);
-    // If not found locally, forward to central server
+// Function to keep the remote cache in step with central: subscribe to its
+// invalidations, and use the cache only while the subscription is up. Central
+// sends a heartbeat every SUBSCRIBER_HEARTBEAT seconds, so a connection that
+// stays silent for SUBSCRIBER_TIMEOUT is taken as lost even if TCP never
+// reports it.
+void *invalidation_listener(void *arg) {
+    (void)arg;
+    int32_t accounts[MAX_INVALIDATION_ACCOUNTS];
+
+    while (1) {
+        int fd = connect_to_central();
+        if (fd >= 0) {
+            struct timeval timeout = {.tv_sec = SUBSCRIBER_TIMEOUT, .tv_usec = 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            Request subscribe = { .queryType = QUERY_SUBSCRIBE };
+            uint64_t requestId = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+            FramedResponse reply;
+
+            if (write_request(fd, branch_client_id, requestId, FRAME_COMPACT, &subscribe) == 0
+                && read_responses(fd, &reply, 1) == 1 && reply.response.status == STATUS_SUCCESS) {
+                // Every change after this point reaches us, so the cache can start
+                remote_cache_set_enabled(&remote_cache, 1);
+                LOG(LOG_INFO, "Subscribed to central balance changes, remote cache enabled");
+
+                int count;
+                int64_t sent_at;
+                while (read_invalidation(fd, accounts, MAX_INVALIDATION_ACCOUNTS, &count, &sent_at) > 0) {
+                    if (count == 0) {
+                        continue;
+                    }
+                    for (int i = 0; i < count; ++i) {
+                        remote_cache_invalidate(&remote_cache, accounts[i]);
+                    }
+                    remote_cache_record_lag(&remote_cache, current_time_us() - sent_at);
+                }
+
+                remote_cache_set_enabled(&remote_cache, 0);
+                LOG(LOG_WARN, "Lost central balance changes, remote cache disabled");
+            }
+            close(fd);
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+// Function to keep the replica in step with central: have it sync the
+// department's balances, then apply its change stream until the stream drops
+void *replication_listener(void *arg) {
+    (void)arg;
+    ChangeRecord records[MAX_CHANGE_RECORDS];
+
+    while (1) {
+        int fd = connect_to_central();
+        if (fd >= 0) {
+            Request replicate = { .queryType = QUERY_REPLICATE, .departmentNumber = branch_department };
+            uint64_t requestId = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+            FramedResponse reply;
+
+            if (write_request(fd, branch_client_id, requestId, FRAME_COMPACT, &replicate) == 0
+                && read_responses(fd, &reply, 1) == 1 && reply.response.status == STATUS_SUCCESS) {
+                replica_start_sync(&replica);
+                LOG(LOG_INFO, "Replicating department %d from central LSN %llu", branch_department,
+                    (unsigned long long)reply.response.lsn);
+
+                ChangeBatch batch;
+                int64_t sent_at;
+                while (read_changes(fd, &batch, records, MAX_CHANGE_RECORDS, &sent_at) > 0
+                       && replica_apply(&replica, &batch, records, sent_at) == 0) {
+                }
+
+                replica_set_offline(&replica);
+                LOG(LOG_WARN, "Lost central change stream, replica offline");
+            }
+            close(fd);
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+// Function to report the remote cache and replica counters while they change
+void *report_thread(void *arg) {
+    (void)arg;
+    uint64_t last_lookups = 0;
+    uint64_t last_frames = 0;
+    while (1) {
+        sleep(REPORT_INTERVAL);
+        uint64_t lookups = atomic_load(&remote_cache.stats.hits) + atomic_load(&remote_cache.stats.misses);
+        if (lookups != last_lookups) {
+            remote_cache_report(&remote_cache);
+            last_lookups = lookups;
+        }
+        uint64_t frames = atomic_load(&replica.stats.frames);
+        if (frames != last_frames) {
+            replica_report(&replica);
+            last_frames = frames;
+        }
+    }
+    return NULL;
+}
+
+// Function to handle Display Query
+void handle_display(int accountNumber, CompactResponse *response) {
+    // Answer from the replica, or the remote cache for accounts held by the
+    // other branch; otherwise forward to central server
+    if (display_from_cache(accountNumber, response)) {
+        return;
+    }
     Request forward_request = {
         .queryType = QUERY_DISPLAY,
         .accountNumber1 = accountNumber,
@@ -103,11 +527,12 @@ void handle_display(int accountNumber, Response *response) {
 }
 
 // Function to handle Update Query
-void handle_update(int accountNumber, float amount, Response *response) {
-    // Lock account locally
-    lock_account(accountNumber);
+void handle_update(int accountNumber, float amount, CompactResponse *response) {
+    response->queryType = QUERY_UPDATE;
+    response->accountNumber1 = accountNumber;
 
-    // Lock account centrally and update
+    // Update centrally if nothing changed the account since the replica's
+    // version; the replica gets the change from central's stream
     Request central_request = {
         .queryType = QUERY_UPDATE,
         .accountNumber1 = accountNumber,
@@ -115,87 +540,28 @@ void handle_update(int accountNumber, float amount, Response *response) {
         .amount = amount,
         .departmentNumber = 0
     };
-    Response central_response;
-    forward_to_central(&central_request, &central_response);
+    CompactResponse central_response;
+    forward_versioned(&central_request, &central_response);
 
     if (central_response.status == STATUS_SUCCESS) {
-        // Update locally
-        FILE *file = fopen("branch_accounts.dat", "r+b");
-        if (!file) {
-            response->status = STATUS_ERROR;
-            snprintf(response->message, sizeof(response->message), "Unable to open branch_accounts.dat.");
-            unlock_account(accountNumber);
-            return;
-        }
-
-        Account account;
-        int found = 0;
-
-        while (fread(&account, sizeof(Account), 1, file)) {
-            if (account.accountNumber == accountNumber) {
-                fseek(file, -sizeof(Account), SEEK_CUR);
-                account.amount += amount;
-                fwrite(&account, sizeof(Account), 1, file);
-                found = 1;
-                snprintf(response->message, sizeof(response->message), "Account %d updated locally. New balance: %.2f", accountNumber, account.amount);
-                break;
-            }
-        }
-
-        fclose(file);
-
-        if (!found) {
-            // Account exists centrally but not locally, add it
-            FILE *f = fopen("branch_accounts.dat", "ab");
-            if (f) {
-                Account new_account = {accountNumber, branch_department, amount};
-                fwrite(&new_account, sizeof(Account), 1, f);
-                fclose(f);
-                snprintf(response->message, sizeof(response->message), "Account %d added locally with balance: %.2f", accountNumber, amount);
-                response->status = STATUS_SUCCESS;
-            } else {
-                snprintf(response->message, sizeof(response->message), "Failed to add account %d locally.", accountNumber);
-                response->status = STATUS_ERROR;
-            }
-        }
+        *response = central_response;
     } else {
         // Central server failed to update
-        snprintf(response->message, sizeof(response->message), "Central server failed to update account %d.", accountNumber);
+        response->error = ERROR_CENTRAL_FAILED;
         response->status = STATUS_ERROR;
     }
-
-    // Unlock account locally
-    unlock_account(accountNumber);
 }
 
 // Function to handle Transfer Query
-void handle_transfer(int fromAccount, int toAccount, float amount, Response *response) {
-    // Determine if both accounts belong to this branch
-    int belongs_to_branch = 0;
-    FILE *file = fopen("branch_accounts.dat", "rb");
-    if (file) {
-        Account account;
-        while (fread(&account, sizeof(Account), 1, file)) {
-            if (account.accountNumber == fromAccount || account.accountNumber == toAccount) {
-                belongs_to_branch = 1;
-                break;
-            }
-        }
-        fclose(file);
-    }
-
-    // Lock accounts locally if they belong to this branch
-    if (belongs_to_branch) {
-        if (fromAccount < toAccount) {
-            lock_account(fromAccount);
-            lock_account(toAccount);
-        } else {
-            lock_account(toAccount);
-            lock_account(fromAccount);
-        }
-    }
-
-    // Forward transfer request to central server
+void handle_transfer(int fromAccount, int toAccount, float amount, CompactResponse *response) {
+    response->queryType = QUERY_TRANSFER;
+    response->accountNumber1 = fromAccount;
+    response->accountNumber2 = toAccount;
+    response->amount = amount_to_cents(amount);
+
+    // Forward transfer request to central server, checked against the
+    // replica's versions of the accounts held here; the replica gets both
+    // sides from central's stream
     Request central_request = {
         .queryType = QUERY_TRANSFER,
         .accountNumber1 = fromAccount,
@@ -203,66 +569,26 @@ void handle_transfer(int fromAccount, int toAccount, float amount, Response *res
         .amount = amount,
         .departmentNumber = 0
     };
-    Response central_response;
-    forward_to_central(&central_request, &central_response);
+    CompactResponse central_response;
+    forward_versioned(&central_request, &central_response);
 
     if (central_response.status == STATUS_SUCCESS) {
-        // Update locally if accounts belong to this branch
-        if (belongs_to_branch) {
-            FILE *file = fopen("branch_accounts.dat", "r+b");
-            if (!file) {
-                response->status = STATUS_ERROR;
-                snprintf(response->message, sizeof(response->message), "Unable to open branch_accounts.dat.");
-                if (belongs_to_branch) {
-                    unlock_account(fromAccount);
-                    unlock_account(toAccount);
-                }
-                return;
-            }
-
-            Account account;
-            int found_from = 0, found_to = 0;
-
-            while (fread(&account, sizeof(Account), 1, file)) {
-                if (account.accountNumber == fromAccount) {
-                    fseek(file, -sizeof(Account), SEEK_CUR);
-                    account.amount -= amount;
-                    fwrite(&account, sizeof(Account), 1, file);
-                    found_from = 1;
-                } else if (account.accountNumber == toAccount) {
-                    fseek(file, -sizeof(Account), SEEK_CUR);
-                    account.amount += amount;
-                    fwrite(&account, sizeof(Account), 1, file);
-                    found_to = 1;
-                }
-            }
-
-            fclose(file);
-
-            snprintf(response->message, sizeof(response->message), "Transferred %.2f from account %d to account %d locally.", amount, fromAccount, toAccount);
-            response->status = STATUS_SUCCESS;
-        } else {
-            // Transfer does not involve this branch's accounts
-            snprintf(response->message, sizeof(response->message), "Transferred %.2f from account %d to account %d.", amount, fromAccount, toAccount);
-            response->status = STATUS_SUCCESS;
-        }
+        *response = central_response;
     } else {
         // Central server failed to process transfer
-        snprintf(response->message, sizeof(response->message), "Central server failed to transfer %.2f from account %d to account %d.", amount, fromAccount, toAccount);
+        response->error = ERROR_CENTRAL_FAILED;
         response->status = STATUS_ERROR;
     }
-
-    // Unlock accounts locally if they belong to this branch
-    if (belongs_to_branch) {
-        unlock_account(fromAccount);
-        unlock_account(toAccount);
-    }
 }
 
 // Function to handle Average Query
-void handle_average(unsigned char departmentNumber, Response *response) {
-    // If the department is not this branch's, forward to central server
-    if (departmentNumber != branch_department) {
+void handle_average(unsigned char departmentNumber, CompactResponse *response) {
+    // Average from the replica's running total instead of scanning; other
+    // departments, and this one while the replica is offline, go to central
+    int64_t totalCents;
+    uint64_t lsn;
+    int count = departmentNumber == branch_department ? replica_totals(&replica, &totalCents, &lsn) : -1;
+    if (count < 0) {
         Request central_request = {
             .queryType = QUERY_AVERAGE,
             .accountNumber1 = 0,
@@ -274,250 +600,486 @@ void handle_average(unsigned char departmentNumber, Response *response) {
         return;
     }
 
-    // Calculate average locally
-    FILE *file = fopen("branch_accounts.dat", "rb");
-    if (!file) {
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open branch_accounts.dat.");
-        return;
-    }
-
-    Account account;
-    float totalAmount = 0;
-    int count = 0;
-
-    while (fread(&account, sizeof(Account), 1, file)) {
-        if (account.departmentNumber == departmentNumber) {
-            totalAmount += account.amount;
-            count++;
+#ifdef DEBUG_AGGREGATES
+    // Check the running total against the full scan it replaces (exact only
+    // while no change is being applied, since the scan is not one snapshot)
+    DepartmentAggregate scanned, totals;
+    aggregate_init(&scanned);
+    for (int i = 0; i < replica.table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&replica.table, i);
+        if (slot) {
+            aggregate_add_account(&scanned, atomic_load(&slot->balance));
         }
     }
+    aggregate_snapshot_read(&replica.totals, departmentNumber, &totals);
+    aggregate_verify(&totals, &scanned, departmentNumber);
+#endif
 
-    fclose(file);
-
+    response->queryType = QUERY_AVERAGE;
+    response->accountNumber1 = departmentNumber;
+    response->lsn = lsn;
     if (count == 0) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "No accounts found for department %d.", departmentNumber);
+        response->error = ERROR_NO_ACCOUNTS;
         return;
     }
 
-    float averageAmount = totalAmount / count;
-    time_t now = time(NULL);
-    struct tm *local = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", local);
-
-    snprintf(response->message, sizeof(response->message), "Average amount for department %d: %.2f\nTimestamp: %s", departmentNumber, averageAmount, timestamp);
+    // Average in whole cents, rounded half away from zero
+    int64_t half = totalCents < 0 ? -(count / 2) : count / 2;
+    response->amount = (totalCents + half) / count;
+    response->timestamp = time(NULL);
     response->status = STATUS_SUCCESS;
 }
 
-// Function to handle each client connection
-void *handle_client(void *client_socket_ptr) {
-    int sock = *((int *)client_socket_ptr);
-    free(client_socket_ptr);
-
-    Request request;
-    Response response;
-    memset(&request, 0, sizeof(Request));
-    memset(&response, 0, sizeof(Response));
-
-    // Receive request
-    if (recv(sock, &request, sizeof(Request), 0) <= 0) {
-        perror("recv failed");
-        close(sock);
-        pthread_exit(NULL);
+// Function to check that a request has a known query type
+int is_known_query(const Request *request) {
+    switch (request->queryType) {
+        case QUERY_DISPLAY:
+        case QUERY_UPDATE:
+        case QUERY_TRANSFER:
+        case QUERY_AVERAGE:
+        case QUERY_STATS:
+            return 1;
+        default:
+            return 0;
     }
+}
 
-    // Determine if the request is for this branch
+// Function to pick the held accounts routed here: a fixed local_percent
+// share of account numbers, so an account is always routed the same way
+int routes_locally(int accountNumber) {
+    uint32_t hash = (uint32_t)accountNumber * 2654435761u; // Knuth's multiplicative hash
+    return (int)((hash >> 16) % 100) < local_percent;
+}
+
+// Function to decide whether this branch handles a request itself
+int is_local_query(const Request *request) {
     int is_local_query = 0;
-    if (request.queryType == QUERY_DISPLAY || request.queryType == QUERY_UPDATE || request.queryType == QUERY_TRANSFER) {
-        // 80% chance to handle locally if the account belongs to this branch
-        int random = rand() % 100;
-        if (random < 80) {
-            // Check if accountNumber1 belongs to this branch
-            FILE *file = fopen("branch_accounts.dat", "rb");
-            if (file) {
-                Account account;
-                while (fread(&account, sizeof(Account), 1, file)) {
-                    if (account.accountNumber == request.accountNumber1) {
-                        is_local_query = 1;
-                        break;
-                    }
-                }
-                fclose(file);
-            }
-        }
-    } else if (request.queryType == QUERY_AVERAGE) {
+    if (request->queryType == QUERY_DISPLAY || request->queryType == QUERY_UPDATE || request->queryType == QUERY_TRANSFER) {
+        // Handle locally if accountNumber1 belongs to this branch and is routed here
+        is_local_query = ownership_owns(&branch_accounts, request->accountNumber1)
+            && routes_locally(request->accountNumber1);
+    } else if (request->queryType == QUERY_AVERAGE) {
         // Always handle average queries locally
-        if (request.departmentNumber == branch_department) {
+        if (request->departmentNumber == branch_department) {
             is_local_query = 1;
         }
     }
+    return is_local_query;
+}
 
-    if (is_local_query) {
-        // Handle query locally
-        switch (request.queryType) {
-            case QUERY_DISPLAY:
-                handle_display(request.accountNumber1, &response);
-                break;
-            case QUERY_UPDATE:
-                handle_update(request.accountNumber1, request.amount, &response);
-                break;
-            case QUERY_TRANSFER:
-                handle_transfer(request.accountNumber1, request.accountNumber2, request.amount, &response);
-                break;
-            case QUERY_AVERAGE:
-                handle_average(request.departmentNumber, &response);
-                break;
-            default:
-                response.status = STATUS_ERROR;
-                snprintf(response.message, sizeof(response.message), "Invalid query type.");
+// Function to process a request this branch handles itself
+void process_local_request(Request *request, CompactResponse *response) {
+    switch (request->queryType) {
+        case QUERY_DISPLAY:
+            handle_display(request->accountNumber1, response);
+            break;
+        case QUERY_UPDATE:
+            handle_update(request->accountNumber1, request->amount, response);
+            break;
+        case QUERY_TRANSFER:
+            handle_transfer(request->accountNumber1, request->accountNumber2, request->amount, response);
+            break;
+        case QUERY_AVERAGE:
+            handle_average(request->departmentNumber, response);
+            break;
+    }
+}
+
+// Function to check whether queued forwards update or transfer an account
+int forwards_change_account(Request **requests, int count, int accountNumber) {
+    for (int i = 0; i < count; ++i) {
+        if ((requests[i]->queryType == QUERY_UPDATE && requests[i]->accountNumber1 == accountNumber)
+            || (requests[i]->queryType == QUERY_TRANSFER
+                && (requests[i]->accountNumber1 == accountNumber || requests[i]->accountNumber2 == accountNumber))) {
+            return 1;
         }
-    } else {
-        // Forward query to central server
-        switch (request.queryType) {
-            case QUERY_DISPLAY:
-            case QUERY_UPDATE:
-            case QUERY_TRANSFER:
-            case QUERY_AVERAGE:
-                // Forward to central server
-                {
-                    // Create a socket to central server
-                    int central_sock;
-                    struct sockaddr_in central_address;
-
-                    if ((central_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-                        perror("Socket creation failed for central server");
-                        response.status = STATUS_ERROR;
-                        snprintf(response.message, sizeof(response.message), "Central server connection failed.");
-                        break;
-                    }
+    }
+    return 0;
+}
 
-                    memset(&central_address, 0, sizeof(central_address));
-                    central_address.sin_family = AF_INET;
-                    central_address.sin_port = htons(CENTRAL_PORT);
-                    central_address.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-                    if (connect(central_sock, (struct sockaddr *)&central_address, sizeof(central_address)) < 0) {
-                        perror("Connection to central server failed");
-                        response.status = STATUS_ERROR;
-                        snprintf(response.message, sizeof(response.message), "Central server connection failed.");
-                        close(central_sock);
-                        break;
-                    }
+// A client request or batch queued for a worker thread
+typedef struct {
+    Connection *conn;
+    FrameHeader message;
+    uint64_t received_at;    // metrics_now_ns when the event loop handed it over
+    int count;
+    FramedRequest requests[];
+} RequestTask;
+
+// Function to count the responses to one message and their latency
+void record_responses(const FramedResponse *responses, int count, uint64_t received_at) {
+    uint64_t latency = metrics_now_ns() - received_at;
+    for (int i = 0; i < count; ++i) {
+        const CompactResponse *response = &responses[i].response;
+        metrics_record_request(response->queryType, response->status, response->error, latency);
+    }
+}
 
-                    // Send request to central server
-                    send(central_sock, &request, sizeof(Request), 0);
+// Function to process one queued request or batch on a worker thread
+void run_request_task(void *task_ptr) {
+    RequestTask *task = task_ptr;
+    FramedResponse responses[MAX_BATCH_REQUESTS];
+    int cached[MAX_BATCH_REQUESTS];
+
+    // Consecutive requests that go to central are forwarded as one batch
+    Request *forward_requests[MAX_BATCH_REQUESTS];
+    CompactResponse *forward_responses[MAX_BATCH_REQUESTS];
+    int forward_count = 0;
+
+    for (int i = 0; i < task->count; ++i) {
+        Request *request = &task->requests[i].request;
+        CompactResponse *response = &responses[i].response;
+        responses[i].header = task->requests[i].header;
+        memset(response, 0, sizeof(CompactResponse));
+
+        if (batch_repeats_request(task->requests, i)) {
+            // Answered like a cache hit: it would otherwise wait for itself
+            cached[i] = REQUEST_CACHE_HIT;
+            response->status = STATUS_ERROR;
+            response->error = ERROR_DUPLICATE_REQUEST;
+            response->queryType = request->queryType;
+            continue;
+        }
 
-                    // Receive response from central server
-                    recv(central_sock, &response, sizeof(Response), 0);
+        // A retried request gets the stored response instead of running again;
+        // workers may block, so one racing its original waits for it here
+        cached[i] = request_cache_begin(&request_cache, &task->requests[i].header, response, 1);
+        if (cached[i] == REQUEST_CACHE_HIT) {
+            continue;
+        }
+        if (cached[i] == REQUEST_CACHE_FULL) {
+            // Running it untracked could apply a later retry twice
+            response->status = STATUS_ERROR;
+            response->error = ERROR_REQUEST_BUSY;
+            response->queryType = request->queryType;
+            continue;
+        }
 
-                    close(central_sock);
-                }
-                break;
-            default:
-                response.status = STATUS_ERROR;
-                snprintf(response.message, sizeof(response.message), "Invalid query type.");
+        if (!is_known_query(request)) {
+            response->status = STATUS_ERROR;
+            response->error = ERROR_INVALID_QUERY;
+            response->queryType = request->queryType;
+        } else if (!is_local_query(request)) {
+            // A cached balance must not skip a change this batch is still forwarding
+            if (request->queryType == QUERY_DISPLAY && !forwards_change_account(forward_requests, forward_count, request->accountNumber1)
+                && display_from_cache(request->accountNumber1, response)) {
+                continue;
+            }
+            forward_requests[forward_count] = request;
+            forward_responses[forward_count] = response;
+            forward_count++;
+        } else {
+            // Requests before this one take effect first
+            if (forward_count > 0) {
+                forward_requests_to_central(forward_requests, NULL, forward_responses, forward_count);
+                forward_count = 0;
+            }
+            process_local_request(request, response);
         }
     }
 
-    // Send response back to client
-    send(sock, &response, sizeof(Response), 0);
-    close(sock);
-    pthread_exit(NULL);
+    if (forward_count > 0) {
+        forward_requests_to_central(forward_requests, NULL, forward_responses, forward_count);
+    }
+
+    for (int i = 0; i < task->count; ++i) {
+        if (cached[i] == REQUEST_CACHE_NEW) {
+            request_cache_finish(&request_cache, &task->requests[i].header, &responses[i].response);
+        }
+    }
+
+    record_responses(responses, task->count, task->received_at);
+    connection_reply(task->conn, &task->message, responses, task->count);
+    connection_release(task->conn);
+    free(task);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <department_number (1 or 2)>\n", argv[0]);
+// Function to hand a request from the event loop to the worker pool, since
+// processing it may block on the central server
+void handle_request(Connection *conn, const FrameHeader *message, const FramedRequest *requests, int count) {
+    uint64_t received_at = metrics_now_ns();
+    RequestTask *task = malloc(sizeof(RequestTask) + count * sizeof(FramedRequest));
+    if (!task) {
+        FramedResponse responses[MAX_BATCH_REQUESTS];
+        for (int i = 0; i < count; ++i) {
+            responses[i].header = requests[i].header;
+            responses[i].response = (CompactResponse){
+                .status = STATUS_ERROR,
+                .error = ERROR_OUT_OF_MEMORY,
+                .queryType = requests[i].request.queryType
+            };
+        }
+        record_responses(responses, count, received_at);
+        connection_reply(conn, message, responses, count);
+        return;
+    }
+    task->conn = conn;
+    task->message = *message;
+    task->received_at = received_at;
+    task->count = count;
+    memcpy(task->requests, requests, count * sizeof(FramedRequest));
+    connection_retain(conn);
+    work_pool_submit(&work_pool, run_request_task, task);
+}
+
+// Function to append the branch's own state to a metrics snapshot
+void write_branch_metrics(FILE *out) {
+    int busy = work_pool.worker_count - __atomic_load_n(&work_pool.idle, __ATOMIC_RELAXED);
+    fprintf(out, "# HELP bank_workers_busy Worker threads processing requests\n# TYPE bank_workers_busy gauge\n");
+    fprintf(out, "bank_workers_busy %d\n", busy < 0 ? 0 : busy);
+    fprintf(out, "# HELP bank_work_queued Messages waiting for a worker\n# TYPE bank_work_queued gauge\n");
+    fprintf(out, "bank_work_queued %ld\n", __atomic_load_n(&work_pool.queued, __ATOMIC_RELAXED));
+
+    RemoteCacheStats *stats = &remote_cache.stats;
+    fprintf(out, "# HELP bank_remote_cache_lookups_total Remote balance cache lookups\n# TYPE bank_remote_cache_lookups_total counter\n");
+    fprintf(out, "bank_remote_cache_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)atomic_load(&stats->hits));
+    fprintf(out, "bank_remote_cache_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)atomic_load(&stats->misses));
+
+    uint64_t applied = atomic_load(&replica.applied_lsn);
+    uint64_t head = atomic_load(&replica.stats.head_lsn);
+    int64_t last_frame_at = atomic_load(&replica.stats.last_frame_at);
+    fprintf(out, "# HELP bank_replica_state Replica state: 0 offline, 1 syncing, 2 streaming\n# TYPE bank_replica_state gauge\n");
+    fprintf(out, "bank_replica_state %d\n", atomic_load(&replica.state));
+    fprintf(out, "# HELP bank_replica_applied_lsn Central log position the replica has applied\n# TYPE bank_replica_applied_lsn gauge\n");
+    fprintf(out, "bank_replica_applied_lsn %llu\n", (unsigned long long)applied);
+    fprintf(out, "# HELP bank_replica_lag_records Log records central had written past the last applied frame\n# TYPE bank_replica_lag_records gauge\n");
+    fprintf(out, "bank_replica_lag_records %llu\n", (unsigned long long)(head > applied ? head - applied : 0));
+    fprintf(out, "# HELP bank_replica_delay_seconds Time the last change frame took to arrive from central\n# TYPE bank_replica_delay_seconds gauge\n");
+    fprintf(out, "bank_replica_delay_seconds %.6f\n", atomic_load(&replica.stats.delay_last) / 1e6);
+    fprintf(out, "# HELP bank_replica_frame_age_seconds Time since the last change frame arrived\n# TYPE bank_replica_frame_age_seconds gauge\n");
+    fprintf(out, "bank_replica_frame_age_seconds %.6f\n", last_frame_at ? (current_time_us() - last_frame_at) / 1e6 : -1.0);
+}
+
+// Function to write a buffer in full (returns -1 on error)
+int write_all(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Function to copy this department's accounts from accounts.dat into
+// branch_accounts.dat and index their ownership. accounts.dat is mapped and scanned in
+// memory, and the copy goes out in BRANCH_WRITE_CHUNK writes to a new file
+// that replaces the old one, so a failed start leaves no half-written copy.
+void load_branch_accounts(int max_account) {
+    int central_fd = open("accounts.dat", O_RDONLY);
+    struct stat status;
+    if (central_fd < 0 || fstat(central_fd, &status) < 0) {
+        perror("Unable to open accounts.dat for loading branch accounts");
         exit(EXIT_FAILURE);
     }
 
-    branch_department = (unsigned char)atoi(argv[1]);
-    if (branch_department < 1 || branch_department > DEPARTMENT_COUNT) {
-        fprintf(stderr, "Invalid department number. Must be 1 or 2.\n");
+    size_t count = status.st_size / sizeof(Account);
+    const Account *accounts = NULL;
+    if (count > 0) {
+        accounts = mmap(NULL, count * sizeof(Account), PROT_READ, MAP_PRIVATE | MAP_POPULATE, central_fd, 0);
+        if (accounts == MAP_FAILED) {
+            perror("Unable to map accounts.dat");
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)accounts, count * sizeof(Account), MADV_SEQUENTIAL);
+    }
+    close(central_fd);
+
+    int branch_fd = open("branch_accounts.dat.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Account *chunk = malloc(BRANCH_WRITE_CHUNK * sizeof(Account));
+    if (branch_fd < 0 || !chunk) {
+        perror("Unable to create branch_accounts.dat");
         exit(EXIT_FAILURE);
     }
 
-    initialize_mutexes();
+    // Size the ownership map for the highest account number unless -n set it
+    if (max_account == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            if (accounts[i].accountNumber > max_account) {
+                max_account = accounts[i].accountNumber;
+            }
+        }
+    }
 
-    // Load local accounts from central accounts.dat
-    FILE *central_file = fopen("accounts.dat", "rb");
-    if (!central_file) {
-        perror("Unable to open accounts.dat for loading branch accounts");
+    if (ownership_init(&branch_accounts, max_account + 1) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    FILE *branch_file = fopen("branch_accounts.dat", "wb");
-    if (!branch_file) {
-        perror("Unable to create branch_accounts.dat");
-        fclose(central_file);
+    size_t buffered = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const Account *account = &accounts[i];
+        if (account->departmentNumber != branch_department) {
+            continue;
+        }
+        chunk[buffered++] = *account;
+        ownership_add(&branch_accounts, account->accountNumber);
+
+        if (buffered == BRANCH_WRITE_CHUNK) {
+            if (write_all(branch_fd, chunk, buffered * sizeof(Account)) < 0) {
+                perror("Unable to write branch_accounts.dat");
+                exit(EXIT_FAILURE);
+            }
+            buffered = 0;
+        }
+    }
+    if (write_all(branch_fd, chunk, buffered * sizeof(Account)) < 0 || close(branch_fd) < 0
+        || rename("branch_accounts.dat.tmp", "branch_accounts.dat") < 0) {
+        perror("Unable to write branch_accounts.dat");
         exit(EXIT_FAILURE);
     }
 
-    Account account;
-    while (fread(&account, sizeof(Account), 1, central_file)) {
-        if (account.departmentNumber == branch_department) {
-            fwrite(&account, sizeof(Account), 1, branch_file);
+    free(chunk);
+    if (count > 0) {
+        munmap((void *)accounts, count * sizeof(Account));
+    }
+}
+
+// Function to print command line usage and exit
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t event_loop_threads] [-w worker_threads] [-c remote_cache_slots] [-r local_percent] [-n max_account_number] [-m admin_port] [-a admin_address] [-l error|warn|info|debug|trace] <department_number (1 or 2)>\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int thread_count = EVENT_LOOP_THREADS;
+    int worker_count = WORK_POOL_THREADS;
+    int cache_slots = REMOTE_CACHE_SLOTS;
+    int max_account = 0;
+    int admin_port = -1;
+    const char *admin_address = ADMIN_ADDRESS;
+    int log_level_option = LOG_INFO;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:w:c:r:n:m:a:l:")) != -1) {
+        switch (option) {
+            case 'l':
+                log_level_option = log_parse_level(optarg);
+                if (log_level_option < 0) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'w':
+                worker_count = atoi(optarg);
+                break;
+            case 'n':
+                max_account = atoi(optarg);
+                if (max_account < 1) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'r':
+                local_percent = atoi(optarg);
+                if (local_percent < 0 || local_percent > 100) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'c':
+                cache_slots = atoi(optarg);
+                if (cache_slots < 0) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'm':
+                admin_port = atoi(optarg);
+                if (admin_port < 0 || admin_port > 65535) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'a':
+                admin_address = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
         }
     }
 
-    fclose(central_file);
-    fclose(branch_file);
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+    }
 
-    int server_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    branch_department = (unsigned char)atoi(argv[optind]);
+    if (branch_department < 1 || branch_department > DEPARTMENT_COUNT) {
+        fprintf(stderr, "Invalid department number. Must be 1 or 2.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
+    if (thread_count < 1 || worker_count < 1) {
+        fprintf(stderr, "Invalid thread count. Must be at least 1.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Bind to BRANCH_PORT_BASE + department_number
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(BRANCH_PORT_BASE + branch_department);
+    if (log_init(log_level_option) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (metrics_init("branch", 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    initialize_central_pool();
+    request_cache_init(&request_cache);
+    if (remote_cache_init(&remote_cache, cache_slots) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        close(server_fd);
+    // Load local accounts from central accounts.dat; the replica starts from
+    // them and is brought up to date by central's sync
+    load_branch_accounts(max_account);
+    if (replica_init(&replica, "branch_accounts.dat", branch_department, max_account) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    // Listen
-    if (listen(server_fd, 10) < 0) {
-        perror("listen failed");
-        close(server_fd);
+    // Bind to BRANCH_PORT_BASE + department_number
+    int server_fd = event_loop_listen(BRANCH_PORT_BASE + branch_department);
+    if (server_fd < 0) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Branch server for department %d listening on port %d\n", branch_department, BRANCH_PORT_BASE + branch_department);
+    if (work_pool_init(&work_pool, worker_count) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    // Accept clients
-    while (1) {
-        int *new_sock = malloc(sizeof(int));
-        if ((*new_sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept failed");
-            free(new_sock);
-            continue;
-        }
+    pthread_t replication_tid, report_tid;
+    if (pthread_create(&replication_tid, NULL, replication_listener, NULL) != 0
+        || pthread_create(&report_tid, NULL, report_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(replication_tid);
+    pthread_detach(report_tid);
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, (void *)new_sock) != 0) {
+    if (cache_slots > 0) {
+        pthread_t listener_tid;
+        if (pthread_create(&listener_tid, NULL, invalidation_listener, NULL) != 0) {
             perror("pthread_create failed");
-            free(new_sock);
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(listener_tid);
+    }
 
-        pthread_detach(tid);
+    // An admin port of 0 turns the metrics endpoint off
+    if (admin_port < 0) {
+        admin_port = BRANCH_PORT_BASE + branch_department + ADMIN_PORT_OFFSET;
+    }
+    if (admin_port > 0 && metrics_start_admin(admin_address, admin_port, write_branch_metrics) < 0) {
+        exit(EXIT_FAILURE);
     }
 
-    // Cleanup (unreachable in this example)
+    LOG(LOG_INFO, "Branch server for department %d listening on port %d with %d event loop threads and %d workers",
+           branch_department, BRANCH_PORT_BASE + branch_department, thread_count, worker_count);
+
+    // Serve clients (only returns on failure)
+    event_loop_run(server_fd, thread_count, handle_request);
+
     close(server_fd);
-    for (int i = 0; i <= TOTAL_ACCOUNTS; ++i) {
-        pthread_mutex_destroy(&account_mutex[i]);
-    }
 
-    return 0;
+    return EXIT_FAILURE;
 }
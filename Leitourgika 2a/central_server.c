@@ -1,314 +1,1584 @@
 // central_server.c
 #include "bank_system.h"
+#include "account_table.h"
+#include "protocol.h"
+#include "event_loop.h"
+#include "wal.h"
+#include "aggregate.h"
+#include "columns.h"
+#include "logger.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
+#include <math.h>
+#include <sys/wait.h>
 
-// Mutex for each account to handle concurrent access
-pthread_mutex_t account_mutex[TOTAL_ACCOUNTS + 1]; // accountNumber starts from 1
+// Seconds between checkpoints of the write-ahead log
+#define CHECKPOINT_INTERVAL 30
 
-// Function to initialize mutexes
-void initialize_mutexes() {
-    for (int i = 0; i <= TOTAL_ACCOUNTS; ++i) {
-        pthread_mutex_init(&account_mutex[i], NULL);
-    }
+// Every checkpoint's balances in exact cents, in the snapshot file format.
+// Once it exists it is the starting state, and accounts.dat only an export.
+#define CHECKPOINT_FILE "accounts.checkpoint"
+
+// All accounts, loaded once at startup
+AccountTable account_table;
+
+// Balance totals per department, for O(1) averages. They follow the log in
+// order, so an average sees every transfer whole and as of one log position.
+AggregateSnapshot department_totals;
+
+// Balances again, stored column by column for department scans. They follow
+// the log together with the totals, and scans never hold the log back.
+AccountColumns account_columns;
+
+// Write-ahead log of every update and transfer since the last checkpoint
+Wal wal;
+uint64_t checkpoint_lsn;
+
+// Held shared by mutations and exclusively while a checkpoint copies the table
+pthread_rwlock_t checkpoint_lock;
+
+// Recent responses, so requests retried by a branch are applied only once
+RequestCache request_cache;
+
+// Most connections that may subscribe to balance changes at once
+#define MAX_SUBSCRIBERS 16
+
+// Branch connections told about every changed balance, for their caches
+Connection *subscribers[MAX_SUBSCRIBERS];
+_Atomic int subscriber_count;
+pthread_mutex_t subscriber_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Most branch replicas changes may be streamed to at once
+#define MAX_REPLICAS 16
+
+// A connection that sent QUERY_REPLICATE: it gets every balance of its
+// department as of start_lsn, and every durable change after that follows.
+// While the sync thread sends those balances the changes wait in pending.
+typedef struct {
+    Connection *conn;
+    unsigned char department;
+    uint64_t start_lsn;
+    int syncing;
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+} ReplicaStream;
+
+ReplicaStream replicas[MAX_REPLICAS];
+_Atomic int replica_count;
+pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Claim attempts before a thread waiting for an account yields the CPU
+#define CLAIM_SPINS 64
+
+// An account's claim word holds CLAIM_EXCLUSIVE while a versioned change or a
+// multi-transfer holds the account or waits for it, plus CLAIM_SHARED for
+// each other change being applied to it
+#define CLAIM_EXCLUSIVE 1
+#define CLAIM_SHARED 2
+
+// Claim waits are reported per stripe of accounts
+#define CLAIM_STRIPES 1024
+
+// Function to find the metrics stripe of an account
+int claim_stripe(int accountNumber) {
+    return ((uint32_t)accountNumber * 2654435761u >> 16) % CLAIM_STRIPES;
 }
 
-// Function to lock an account
-void lock_account(int accountNumber) {
-    if (accountNumber < 1 || accountNumber > TOTAL_ACCOUNTS) {
-        return;
+// Function to wait for a contended claim word, timing the wait from *started
+void claim_backoff(int spins, uint64_t *started) {
+    if (*started == 0) {
+        *started = metrics_now_ns();
+    }
+    if (spins >= CLAIM_SPINS) {
+        sched_yield();
     }
-    pthread_mutex_lock(&account_mutex[accountNumber]);
-    printf("Central server locked account %d\n", accountNumber);
 }
 
-// Function to unlock an account
-void unlock_account(int accountNumber) {
-    if (accountNumber < 1 || accountNumber > TOTAL_ACCOUNTS) {
-        return;
+// Function to claim an account for a change that must see it unchanged
+// between its checks and its apply: new changes are held off, and ones
+// already applying finish first. Claims are held only while a change is
+// applied and logged, never across a network round trip.
+void claim_account(AccountSlot *slot) {
+    uint64_t started = 0;
+    int claim = atomic_load(&slot->claimed);
+    for (int spins = 0;; ++spins) {
+        if (!(claim & CLAIM_EXCLUSIVE)
+            && atomic_compare_exchange_weak(&slot->claimed, &claim, claim | CLAIM_EXCLUSIVE)) {
+            break;
+        }
+        claim = atomic_load(&slot->claimed);
+        claim_backoff(spins, &started);
+    }
+    for (int spins = 0; atomic_load(&slot->claimed) != CLAIM_EXCLUSIVE; ++spins) {
+        claim_backoff(spins, &started);
     }
-    pthread_mutex_unlock(&account_mutex[accountNumber]);
-    printf("Central server unlocked account %d\n", accountNumber);
+    metrics_record_lock(claim_stripe(slot->accountNumber), started ? metrics_now_ns() - started : 0);
 }
 
-// Function to handle Display Query
-void handle_display(int accountNumber, Response *response) {
-    FILE *file = fopen("accounts.dat", "rb");
-    if (!file) {
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open accounts.dat.");
-        return;
-    }
+// Function to release a claimed account
+void release_account(AccountSlot *slot) {
+    atomic_store(&slot->claimed, 0);
+}
 
-    Account account;
-    while (fread(&account, sizeof(Account), 1, file)) {
-        if (account.accountNumber == accountNumber) {
-            snprintf(response->message, sizeof(response->message), "Account %d balance: %.2f", accountNumber, account.amount);
-            response->status = STATUS_SUCCESS;
-            fclose(file);
-            return;
+// Function to enter an account for a change without versions. Such changes
+// apply by compare-and-swap and do not hold each other off; they only wait
+// while the account is claimed.
+void share_account(AccountSlot *slot) {
+    uint64_t started = 0;
+    int claim = atomic_load(&slot->claimed);
+    for (int spins = 0;; ++spins) {
+        if (!(claim & CLAIM_EXCLUSIVE)
+            && atomic_compare_exchange_weak(&slot->claimed, &claim, claim + CLAIM_SHARED)) {
+            break;
         }
+        claim = atomic_load(&slot->claimed);
+        claim_backoff(spins, &started);
+    }
+    metrics_record_lock(claim_stripe(slot->accountNumber), started ? metrics_now_ns() - started : 0);
+}
+
+// Function to leave an account entered with share_account
+void unshare_account(AccountSlot *slot) {
+    atomic_fetch_sub(&slot->claimed, CLAIM_SHARED);
+}
+
+// Function to set an account's version to the LSN of a change, unless a
+// change applied alongside it was logged later
+void raise_version(AccountSlot *slot, uint64_t lsn) {
+    uint64_t version = atomic_load(&slot->version);
+    while (version < lsn && !atomic_compare_exchange_weak(&slot->version, &version, lsn)) {
     }
+}
 
+// Function to check a claimed account against the version a request expects
+// (0 = any); on a conflict the response reports the version found
+int version_matches(AccountSlot *slot, uint64_t expected, CompactResponse *response) {
+    uint64_t version = atomic_load(&slot->version);
+    if (expected == 0 || expected == version) {
+        return 1;
+    }
+    if (version > response->lsn) {
+        response->lsn = version;
+    }
     response->status = STATUS_ERROR;
-    snprintf(response->message, sizeof(response->message), "Account %d not found.", accountNumber);
-    fclose(file);
+    response->error = ERROR_VERSION_CONFLICT;
+    return 0;
 }
 
-// Function to handle Update Query
-void handle_update(int accountNumber, float amount, Response *response) {
-    FILE *file = fopen("accounts.dat", "r+b");
-    if (!file) {
+// Function to handle Display Query
+void handle_display(int accountNumber, CompactResponse *response) {
+    response->queryType = QUERY_DISPLAY;
+    response->accountNumber1 = accountNumber;
+
+    AccountSlot *slot = account_table_find(&account_table, accountNumber);
+    if (!slot) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open accounts.dat.");
+        response->error = ERROR_ACCOUNT_NOT_FOUND;
         return;
     }
 
-    Account account;
-    int found = 0;
+    response->amount = atomic_load(&slot->balance);
+    response->status = STATUS_SUCCESS;
+}
 
-    while (fread(&account, sizeof(Account), 1, file)) {
-        if (account.accountNumber == accountNumber) {
-            fseek(file, -sizeof(Account), SEEK_CUR);
-            account.amount += amount;
-            fwrite(&account, sizeof(Account), 1, file);
-            found = 1;
-            snprintf(response->message, sizeof(response->message), "Account %d updated. New balance: %.2f", accountNumber, account.amount);
-            break;
+// Function to handle Update Query; returns the LSN of the logged change, or 0
+// if nothing changed
+uint64_t handle_update(int accountNumber, float amount, const RequestVersions *versions, CompactResponse *response) {
+    response->queryType = QUERY_UPDATE;
+    response->accountNumber1 = accountNumber;
+
+    AccountSlot *slot = account_table_find(&account_table, accountNumber);
+    if (!slot) {
+        response->status = STATUS_ERROR;
+        response->error = ERROR_ACCOUNT_NOT_FOUND;
+        return 0;
+    }
+
+    // Only a versioned update claims the account
+    int versioned = versions->version1 != 0;
+    if (versioned) {
+        claim_account(slot);
+        if (!version_matches(slot, versions->version1, response)) {
+            release_account(slot);
+            metrics_add(METRIC_VERSION_CONFLICTS, 1);
+            return 0;
         }
+    } else {
+        share_account(slot);
     }
 
-    if (!found) {
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Account %d not found.", accountNumber);
+    int64_t cents = amount_to_cents(amount);
+    int64_t balance = atomic_fetch_add(&slot->balance, cents) + cents;
+
+    WalRecord record = {
+        .type = WAL_UPDATE,
+        .accountNumber1 = accountNumber,
+        .amount = cents
+    };
+    uint64_t lsn = wal_append(&wal, &record);
+    raise_version(slot, lsn);
+    if (versioned) {
+        release_account(slot);
     } else {
-        response->status = STATUS_SUCCESS;
+        unshare_account(slot);
     }
 
-    fclose(file);
+    response->amount = balance;
+    response->lsn = lsn;
+    response->status = STATUS_SUCCESS;
+    return lsn;
 }
 
-// Function to handle Transfer Query
-void handle_transfer(int fromAccount, int toAccount, float amount, Response *response) {
+// Function to handle Transfer Query; returns the LSN of the logged change, or
+// 0 if nothing changed
+uint64_t handle_transfer(int fromAccount, int toAccount, float amount, const RequestVersions *versions,
+                         CompactResponse *response) {
+    int64_t cents = amount_to_cents(amount);
+    response->queryType = QUERY_TRANSFER;
+    response->accountNumber1 = fromAccount;
+    response->accountNumber2 = toAccount;
+    response->amount = cents;
+
     if (fromAccount == toAccount) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Cannot transfer to the same account.");
-        return;
+        response->error = ERROR_SAME_ACCOUNT;
+        return 0;
     }
 
-    FILE *file = fopen("accounts.dat", "r+b");
-    if (!file) {
+    AccountSlot *from_slot = account_table_find(&account_table, fromAccount);
+    AccountSlot *to_slot = account_table_find(&account_table, toAccount);
+    if (!from_slot || !to_slot) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open accounts.dat.");
-        return;
+        response->error = ERROR_ACCOUNTS_NOT_FOUND;
+        return 0;
+    }
+
+    // Enter both accounts in account number order, so two transfers between
+    // the same accounts cannot wait for each other
+    AccountSlot *first = fromAccount < toAccount ? from_slot : to_slot;
+    AccountSlot *second = fromAccount < toAccount ? to_slot : from_slot;
+    int versioned = versions->version1 != 0 || versions->version2 != 0;
+    if (versioned) {
+        // With both claimed, the versions, the funds check and both sides
+        // apply as one step
+        claim_account(first);
+        claim_account(second);
+        int matches = version_matches(from_slot, versions->version1, response);
+        matches = version_matches(to_slot, versions->version2, response) && matches;
+        if (!matches || atomic_load(&from_slot->balance) < cents) {
+            if (matches) {
+                response->status = STATUS_ERROR;
+                response->error = ERROR_INSUFFICIENT_FUNDS;
+            } else {
+                metrics_add(METRIC_VERSION_CONFLICTS, 1);
+            }
+            release_account(second);
+            release_account(first);
+            return 0;
+        }
+        atomic_fetch_sub(&from_slot->balance, cents);
+    } else {
+        share_account(first);
+        share_account(second);
+        // Debit only if the funds are still there at the moment the debit
+        // lands: a failed compare-and-swap reloads the balance and checks it
+        // again
+        int64_t balance = atomic_load(&from_slot->balance);
+        do {
+            if (balance < cents) {
+                unshare_account(second);
+                unshare_account(first);
+                response->status = STATUS_ERROR;
+                response->error = ERROR_INSUFFICIENT_FUNDS;
+                return 0;
+            }
+        } while (!atomic_compare_exchange_weak(&from_slot->balance, &balance, balance - cents));
     }
 
-    Account from, to;
-    int found_from = 0, found_to = 0;
-    long from_offset, to_offset;
+    // The debit is committed, so the credit cannot fail
+    atomic_fetch_add(&to_slot->balance, cents);
 
-    // Find fromAccount
-    while (fread(&from, sizeof(Account), 1, file)) {
-        if (from.accountNumber == fromAccount) {
-            from_offset = ftell(file) - sizeof(Account);
-            found_from = 1;
-            break;
+    // Both sides as one log record, so a crash can never keep one side of
+    // the transfer without the other
+    WalRecord record = {
+        .type = WAL_TRANSFER,
+        .accountNumber1 = fromAccount,
+        .accountNumber2 = toAccount,
+        .amount = cents
+    };
+    uint64_t lsn = wal_append(&wal, &record);
+    raise_version(from_slot, lsn);
+    raise_version(to_slot, lsn);
+    if (versioned) {
+        release_account(second);
+        release_account(first);
+    } else {
+        unshare_account(second);
+        unshare_account(first);
+    }
+
+    response->lsn = lsn;
+    response->status = STATUS_SUCCESS;
+    return lsn;
+}
+
+// One account a multi-transfer changes, with its net change in cents
+typedef struct {
+    int accountNumber;
+    AccountSlot *slot;
+    int64_t delta;
+} LegAccount;
+
+// Function to order leg accounts by account number
+int compare_leg_accounts(const void *a, const void *b) {
+    int x = ((const LegAccount *)a)->accountNumber, y = ((const LegAccount *)b)->accountNumber;
+    return (x > y) - (x < y);
+}
+
+// Function to collect the net change of every account the legs touch, in
+// account number order; returns how many accounts change, or -1 with the
+// error set in response
+int collect_leg_accounts(const void *legs, int count, LegAccount *accounts, CompactResponse *response) {
+    int account_count = 0;
+    int error = count < 1 || count > MAX_TRANSFER_LEGS ? ERROR_INVALID_LEGS : ERROR_NONE;
+
+    for (int i = 0; i < count && error == ERROR_NONE; ++i) {
+        TransferLeg leg;
+        memcpy(&leg, (const char *)legs + i * sizeof(TransferLeg), sizeof(TransferLeg));
+        AccountSlot *from_slot = account_table_find(&account_table, leg.fromAccount);
+        AccountSlot *to_slot = account_table_find(&account_table, leg.toAccount);
+        if (leg.amount <= 0 || leg.amount > MAX_LEG_AMOUNT) {
+            error = ERROR_INVALID_LEGS;
+        } else if (leg.fromAccount == leg.toAccount) {
+            error = ERROR_SAME_ACCOUNT;
+        } else if (!from_slot || !to_slot) {
+            error = ERROR_ACCOUNTS_NOT_FOUND;
+        } else {
+            accounts[account_count++] = (LegAccount){ leg.fromAccount, from_slot, -leg.amount };
+            accounts[account_count++] = (LegAccount){ leg.toAccount, to_slot, leg.amount };
+            if (!__builtin_add_overflow(response->amount, leg.amount, &response->amount)) {
+                continue;
+            }
+            error = ERROR_INVALID_LEGS;
         }
+        response->accountNumber1 = leg.fromAccount;
+    }
+    if (error != ERROR_NONE) {
+        response->status = STATUS_ERROR;
+        response->error = error;
+        response->amount = 0;
+        return -1;
     }
 
-    // Find toAccount
-    fseek(file, 0, SEEK_SET);
-    while (fread(&to, sizeof(Account), 1, file)) {
-        if (to.accountNumber == toAccount) {
-            to_offset = ftell(file) - sizeof(Account);
-            found_to = 1;
-            break;
+    // One entry per account, then drop the ones the legs cancel out on
+    qsort(accounts, account_count, sizeof(LegAccount), compare_leg_accounts);
+    int merged = 0;
+    for (int i = 0; i < account_count; ++i) {
+        if (merged > 0 && accounts[merged - 1].accountNumber == accounts[i].accountNumber) {
+            if (__builtin_add_overflow(accounts[merged - 1].delta, accounts[i].delta, &accounts[merged - 1].delta)) {
+                response->status = STATUS_ERROR;
+                response->error = ERROR_INVALID_LEGS;
+                response->accountNumber1 = accounts[i].accountNumber;
+                response->amount = 0;
+                return -1;
+            }
+        } else {
+            accounts[merged++] = accounts[i];
         }
     }
+    int changed = 0;
+    for (int i = 0; i < merged; ++i) {
+        if (accounts[i].delta != 0) {
+            accounts[changed++] = accounts[i];
+        }
+    }
+    response->status = STATUS_SUCCESS;
+    return changed;
+}
+
+// Function to handle Multi-Transfer Query: every leg is applied, or none;
+// returns the LSN of the logged change, or 0 if nothing changed
+uint64_t handle_multi_transfer(const FramedRequest *framed, CompactResponse *response) {
+    int count = framed->legCount;
+    response->queryType = QUERY_MULTI_TRANSFER;
+    response->accountNumber2 = count;
 
-    if (!found_from || !found_to) {
+    // The legs carry no versions to check, so a versioned one is refused
+    // rather than applied unchecked
+    if (framed->header.flags & FRAME_VERSIONED) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "One or both accounts not found.");
-        fclose(file);
-        return;
+        response->error = ERROR_VERSIONED_LEGS;
+        return 0;
     }
 
-    if (from.amount < amount) {
+    // Sized to the legs: a full multi-transfer's would not fit on the stack
+    LegAccount *accounts = malloc((count > 0 ? 2 * count : 1) * sizeof(LegAccount));
+    WalRecord *records = malloc((count > 0 ? 2 * count : 1) * sizeof(WalRecord));
+    if (!accounts || !records) {
+        free(accounts);
+        free(records);
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Insufficient funds in account %d.", fromAccount);
-        fclose(file);
-        return;
+        response->error = ERROR_OUT_OF_MEMORY;
+        return 0;
+    }
+
+    int account_count = collect_leg_accounts(framed->legs, count, accounts, response);
+    if (account_count <= 0) {
+        free(accounts);
+        free(records);
+        return 0;
     }
 
-    // Deduct from fromAccount
-    fseek(file, from_offset, SEEK_SET);
-    from.amount -= amount;
-    fwrite(&from, sizeof(Account), 1, file);
+    // Each account is claimed once, in account number order like a transfer
+    // claims its two, and the funds check sees the net of all the legs.
+    // Claimed balances cannot change, so a credit checked here cannot
+    // overflow when it is applied.
+    for (int i = 0; i < account_count; ++i) {
+        claim_account(accounts[i].slot);
+    }
+    for (int i = 0; i < account_count; ++i) {
+        int64_t balance = atomic_load(&accounts[i].slot->balance);
+        int64_t result;
+        int error = ERROR_NONE;
+        if (accounts[i].delta < 0 && balance < -accounts[i].delta) {
+            error = ERROR_INSUFFICIENT_FUNDS;
+        } else if (__builtin_add_overflow(balance, accounts[i].delta, &result)) {
+            error = ERROR_INVALID_LEGS;
+        }
+        if (error != ERROR_NONE) {
+            for (int j = 0; j < account_count; ++j) {
+                release_account(accounts[j].slot);
+            }
+            response->status = STATUS_ERROR;
+            response->error = error;
+            response->accountNumber1 = accounts[i].accountNumber;
+            free(accounts);
+            free(records);
+            return 0;
+        }
+    }
 
-    // Add to toAccount
-    fseek(file, to_offset, SEEK_SET);
-    to.amount += amount;
-    fwrite(&to, sizeof(Account), 1, file);
+    // One record per account, appended as one unit: recovery applies them
+    // only once it has read the last one
+    for (int i = 0; i < account_count; ++i) {
+        atomic_fetch_add(&accounts[i].slot->balance, accounts[i].delta);
+        records[i] = (WalRecord){
+            .type = i == 0 ? WAL_MULTI_TRANSFER : WAL_LEG,
+            .accountNumber1 = accounts[i].accountNumber,
+            .accountNumber2 = account_count - 1 - i,
+            .amount = accounts[i].delta
+        };
+    }
+    uint64_t lsn = wal_append_records(&wal, records, account_count);
+    for (int i = 0; i < account_count; ++i) {
+        raise_version(accounts[i].slot, lsn);
+        release_account(accounts[i].slot);
+    }
+    free(accounts);
+    free(records);
 
-    snprintf(response->message, sizeof(response->message), "Transferred %.2f from account %d to account %d.", amount, fromAccount, toAccount);
+    response->lsn = lsn;
     response->status = STATUS_SUCCESS;
-
-    fclose(file);
+    return lsn;
 }
 
 // Function to handle Average Query
-void handle_average(unsigned char departmentNumber, Response *response) {
-    FILE *file = fopen("accounts.dat", "rb");
-    if (!file) {
-        response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "Unable to open accounts.dat.");
-        return;
-    }
+void handle_average(unsigned char departmentNumber, CompactResponse *response) {
+    response->queryType = QUERY_AVERAGE;
+    response->accountNumber1 = departmentNumber;
 
-    Account account;
-    float totalAmount = 0;
-    int count = 0;
+    // No lock is taken: the read retries if the log follower is folding in
+    // a batch at that moment
+    DepartmentAggregate totals;
+    int64_t totalCents;
+    response->lsn = aggregate_snapshot_read(&department_totals, departmentNumber, &totals);
+    int count = aggregate_read(&totals, &totalCents);
 
-    while (fread(&account, sizeof(Account), 1, file)) {
-        if (account.departmentNumber == departmentNumber) {
-            totalAmount += account.amount;
-            count++;
+#ifdef DEBUG_AGGREGATES
+    // Check the totals against the full scan they replace (exact only once
+    // every mutation has been logged and folded in, since the scan is not
+    // one snapshot)
+    DepartmentAggregate scanned;
+    aggregate_init(&scanned);
+    for (int i = 0; i < account_table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&account_table, i);
+        if (slot && slot->departmentNumber == departmentNumber) {
+            aggregate_add_account(&scanned, atomic_load(&slot->balance));
         }
     }
+    aggregate_verify(&totals, &scanned, departmentNumber);
+#endif
 
     if (count == 0) {
         response->status = STATUS_ERROR;
-        snprintf(response->message, sizeof(response->message), "No accounts found for department %d.", departmentNumber);
-        fclose(file);
+        response->error = ERROR_NO_ACCOUNTS;
         return;
     }
 
-    float averageAmount = totalAmount / count;
-    time_t now = time(NULL);
-    struct tm *local = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", local);
-
-    snprintf(response->message, sizeof(response->message), "Average amount for department %d: %.2f\nTimestamp: %s", departmentNumber, averageAmount, timestamp);
+    // Average in whole cents, rounded half away from zero; the timestamp is
+    // formatted only if the client asked for a text reply
+    int64_t half = totalCents < 0 ? -(count / 2) : count / 2;
+    response->amount = (totalCents + half) / count;
+    response->timestamp = time(NULL);
     response->status = STATUS_SUCCESS;
-
-    fclose(file);
 }
 
-// Function to handle each client connection
-void *handle_client(void *client_socket_ptr) {
-    int sock = *((int *)client_socket_ptr);
-    free(client_socket_ptr);
+// Function to handle Stats Query
+void handle_stats(unsigned char departmentNumber, CompactResponse *response) {
+    response->queryType = QUERY_STATS;
+    response->accountNumber1 = departmentNumber;
 
-    Request request;
-    Response response;
-    memset(&request, 0, sizeof(Request));
-    memset(&response, 0, sizeof(Response));
+    // Scanned from the columns, which are changed a whole log batch at a
+    // time, so the statistics see every transfer whole too
+    DepartmentStats stats;
+    response->lsn = account_columns_stats(&account_columns, departmentNumber, &stats);
 
-    // Receive request
-    if (recv(sock, &request, sizeof(Request), 0) <= 0) {
-        perror("recv failed");
-        close(sock);
-        pthread_exit(NULL);
+#ifdef DEBUG_AGGREGATES
+    // Check the vector kernel against the scalar one, if no batch came in
+    // between (the variance may differ in its last bits: it adds up in a
+    // different order)
+    DepartmentStats scalar;
+    if (account_columns_stats_scalar(&account_columns, departmentNumber, &scalar) == response->lsn
+        && (scalar.count != stats.count || scalar.sum != stats.sum || scalar.minimum != stats.minimum
+            || scalar.maximum != stats.maximum || fabs(scalar.variance - stats.variance) > 1e-9 * scalar.variance)) {
+        fprintf(stderr, "Department %d %s stats mismatch: %d accounts, sum %lld, min %lld, max %lld, variance %.6f; "
+                "scalar %d, %lld, %lld, %lld, %.6f\n", departmentNumber, account_columns_kernel(), stats.count,
+                (long long)stats.sum, (long long)stats.minimum, (long long)stats.maximum, stats.variance, scalar.count,
+                (long long)scalar.sum, (long long)scalar.minimum, (long long)scalar.maximum, scalar.variance);
     }
+#endif
+
+    if (stats.count == 0) {
+        response->status = STATUS_ERROR;
+        response->error = ERROR_NO_ACCOUNTS;
+        return;
+    }
+    response->accountNumber2 = stats.count;
+    response->amount = stats.sum;
+    response->minimum = stats.minimum;
+    response->maximum = stats.maximum;
+    response->variance = stats.variance;
+    response->timestamp = time(NULL);
+    response->status = STATUS_SUCCESS;
+}
+
+// Function to check whether a request changes balances
+int is_mutation(const Request *request) {
+    return request->queryType == QUERY_UPDATE || request->queryType == QUERY_TRANSFER
+        || request->queryType == QUERY_MULTI_TRANSFER;
+}
+
+// Function to process one request; returns the LSN the response must wait for
+// (the caller holds checkpoint_lock for reading around mutations)
+uint64_t process_request(const FramedRequest *framed, CompactResponse *response) {
+    const Request *request = &framed->request;
+    uint64_t lsn = 0;
+    memset(response, 0, sizeof(CompactResponse));
 
     // Process request based on query type
-    switch (request.queryType) {
+    switch (request->queryType) {
         case QUERY_DISPLAY:
-            handle_display(request.accountNumber1, &response);
+            handle_display(request->accountNumber1, response);
             break;
         case QUERY_UPDATE:
-            lock_account(request.accountNumber1);
-            handle_update(request.accountNumber1, request.amount, &response);
-            unlock_account(request.accountNumber1);
+            lsn = handle_update(request->accountNumber1, request->amount, &framed->versions, response);
             break;
         case QUERY_TRANSFER:
-            // To prevent deadlocks, always lock in ascending order
-            if (request.accountNumber1 < request.accountNumber2) {
-                lock_account(request.accountNumber1);
-                lock_account(request.accountNumber2);
-            } else {
-                lock_account(request.accountNumber2);
-                lock_account(request.accountNumber1);
-            }
-            handle_transfer(request.accountNumber1, request.accountNumber2, request.amount, &response);
-            unlock_account(request.accountNumber1);
-            unlock_account(request.accountNumber2);
+            lsn = handle_transfer(request->accountNumber1, request->accountNumber2, request->amount, &framed->versions, response);
             break;
         case QUERY_AVERAGE:
-            handle_average(request.departmentNumber, &response);
+            handle_average(request->departmentNumber, response);
+            break;
+        case QUERY_MULTI_TRANSFER:
+            lsn = handle_multi_transfer(framed, response);
+            break;
+        case QUERY_STATS:
+            handle_stats(request->departmentNumber, response);
             break;
         default:
-            response.status = STATUS_ERROR;
-            snprintf(response.message, sizeof(response.message), "Invalid query type.");
+            response->status = STATUS_ERROR;
+            response->error = ERROR_INVALID_QUERY;
+            response->queryType = request->queryType;
     }
 
-    // Send response
-    send(sock, &response, sizeof(Response), 0);
-    close(sock);
-    pthread_exit(NULL);
+    return lsn;
 }
 
-int main() {
-    initialize_mutexes();
+// Responses to one message, held back until its mutations are durable and
+// the originals of its retried requests still in progress have finished
+typedef struct {
+    Connection *conn;
+    FrameHeader message;
+    uint64_t received_at;    // metrics_now_ns when the message was handled
+    int count;
+    _Atomic int waits;       // Sent once the last of these is done
+    unsigned char cached[MAX_BATCH_REQUESTS];
+    RequestCacheWaiter *waiters;   // After the responses, if any retry waits
+    FramedResponse responses[];
+} PendingReply;
 
-    int server_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+// Function to record and send the responses to one message
+void finish_message(Connection *conn, const FrameHeader *message, const FramedResponse *responses,
+                    const unsigned char *cached, int count, uint64_t received_at) {
+    uint64_t latency = metrics_now_ns() - received_at;
+    for (int i = 0; i < count; ++i) {
+        if (cached[i] == REQUEST_CACHE_NEW) {
+            request_cache_finish(&request_cache, &responses[i].header, &responses[i].response);
+        }
+        const CompactResponse *response = &responses[i].response;
+        metrics_record_request(response->queryType, response->status, response->error, latency);
+    }
+    connection_reply(conn, message, responses, count);
+}
 
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+// Function to send held-back responses once nothing else holds them back
+// (runs on the log flusher thread, or wherever a retry's original finished)
+void send_pending_reply(void *reply_ptr) {
+    PendingReply *reply = reply_ptr;
+    if (atomic_fetch_sub(&reply->waits, 1) != 1) {
+        return;
     }
+    finish_message(reply->conn, &reply->message, reply->responses, reply->cached, reply->count, reply->received_at);
+    connection_release(reply->conn);
+    free(reply);
+}
 
-    // Bind to CENTRAL_PORT
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(CENTRAL_PORT);
+// Function to handle Subscribe Query: push an invalidation on this connection
+// after every change from now on
+void handle_subscribe(Connection *conn, const FrameHeader *message, const FramedRequest *request) {
+    uint64_t received_at = metrics_now_ns();
+    FramedResponse response = {
+        .header = request->header,
+        .response = { .queryType = QUERY_SUBSCRIBE }
+    };
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    pthread_mutex_lock(&subscriber_mutex);
+    if (subscriber_count < MAX_SUBSCRIBERS) {
+        connection_retain(conn);
+        subscribers[subscriber_count] = conn;
+        atomic_fetch_add(&subscriber_count, 1);
+        response.response.status = STATUS_SUCCESS;
+        LOG(LOG_INFO, "Subscriber %u added (%d subscribed)", request->header.clientId, subscriber_count);
+    } else {
+        response.response.status = STATUS_ERROR;
+        response.response.error = ERROR_TOO_MANY_SUBSCRIBERS;
     }
+    // Reply before any invalidation can be queued behind it
+    connection_reply(conn, message, &response, 1);
+    pthread_mutex_unlock(&subscriber_mutex);
+    metrics_record_request(QUERY_SUBSCRIBE, response.response.status, response.response.error,
+                           metrics_now_ns() - received_at);
+}
 
-    // Listen
-    if (listen(server_fd, 10) < 0) {
-        perror("listen failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+// Function to send one invalidation frame to every subscriber, dropping the
+// ones that disconnected
+void send_to_subscribers(const char *frame, size_t length) {
+    pthread_mutex_lock(&subscriber_mutex);
+    for (int i = 0; i < subscriber_count;) {
+        if (connection_send(subscribers[i], frame, length) < 0) {
+            connection_release(subscribers[i]);
+            subscribers[i] = subscribers[subscriber_count - 1];
+            atomic_fetch_sub(&subscriber_count, 1);
+            LOG(LOG_INFO, "Subscriber dropped (%d subscribed)", subscriber_count);
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&subscriber_mutex);
+}
+
+// Function to tell every subscriber which accounts changed
+void publish_invalidations(const int32_t *accounts, int count) {
+    if (count == 0 || atomic_load(&subscriber_count) == 0) {
+        return;
+    }
+
+    char frame[sizeof(FrameHeader) + MAX_INVALIDATION_ACCOUNTS * sizeof(int32_t)];
+    send_to_subscribers(frame, encode_invalidation(accounts, count, frame));
+}
+
+// Function run by the heartbeat thread: an invalidation of no accounts every
+// SUBSCRIBER_HEARTBEAT seconds shows subscribers the connection is still up
+void *heartbeat_thread(void *arg) {
+    (void)arg;
+    int32_t no_accounts[1];
+    char frame[sizeof(FrameHeader)];
+    while (1) {
+        sleep(SUBSCRIBER_HEARTBEAT);
+        if (atomic_load(&subscriber_count) > 0) {
+            send_to_subscribers(frame, encode_invalidation(no_accounts, 0, frame));
+        }
+    }
+    return NULL;
+}
+
+// Function to tell every subscriber about the accounts of a multi-transfer,
+// in as many frames as they take
+void invalidate_legs(const void *legs, int count) {
+    int32_t accounts[MAX_INVALIDATION_ACCOUNTS];
+    int account_count = 0;
+    for (int i = 0; i < count; ++i) {
+        TransferLeg leg;
+        memcpy(&leg, (const char *)legs + i * sizeof(TransferLeg), sizeof(TransferLeg));
+        accounts[account_count++] = leg.fromAccount;
+        accounts[account_count++] = leg.toAccount;
+        if (account_count == MAX_INVALIDATION_ACCOUNTS || i == count - 1) {
+            publish_invalidations(accounts, account_count);
+            account_count = 0;
+        }
+    }
+}
+
+// A department's balances captured for a new replica, sent by a sync thread
+typedef struct {
+    Connection *conn;
+    FrameHeader message;
+    FramedResponse response;
+    uint64_t received_at;
+    ChangeRecord *records;
+    int count;
+} ReplicaSync;
+
+// Function to copy every balance of a department (the caller keeps mutations
+// out, so the copy matches an exact log position)
+ChangeRecord *capture_department(unsigned char department, int *count) {
+    ChangeRecord *records = malloc((account_table.record_count ? account_table.record_count : 1) * sizeof(ChangeRecord));
+    if (!records) {
+        return NULL;
+    }
+    *count = 0;
+    for (int i = 0; i < account_table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&account_table, i);
+        if (slot && slot->departmentNumber == department) {
+            records[(*count)++] = (ChangeRecord){
+                .accountNumber = slot->accountNumber,
+                .amount = atomic_load(&slot->balance),
+                .version = atomic_load(&slot->version)
+            };
+        }
+    }
+    return records;
+}
+
+// Function to find the stream a sync thread is filling (caller holds
+// replica_mutex; returns -1 once the stream was dropped)
+int find_syncing_replica(const Connection *conn) {
+    for (int i = 0; i < replica_count; ++i) {
+        if (replicas[i].conn == conn && replicas[i].syncing) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    printf("Central server listening on port %d\n", CENTRAL_PORT);
+// Function to drop a replica and free the changes it was still owed (caller
+// holds replica_mutex)
+void remove_replica(int index) {
+    connection_release(replicas[index].conn);
+    free(replicas[index].pending);
+    replicas[index] = replicas[replica_count - 1];
+    atomic_fetch_sub(&replica_count, 1);
+    LOG(LOG_INFO, "Replica dropped (%d replicas)", replica_count);
+}
+
+// Function to send a replica its captured balances, the last frame flagged
+// CHANGE_SYNC_DONE, waiting on the socket rather than buffering them all
+int send_sync(ReplicaSync *sync) {
+    char *frame = malloc(sizeof(FrameHeader) + sizeof(ChangeBatch) + MAX_CHANGE_RECORDS * sizeof(ChangeRecord));
+    ChangeBatch batch = { .lsn = sync->response.response.lsn, .head_lsn = sync->response.response.lsn };
+    int sent = 0;
+
+    if (!frame) {
+        return -1;
+    }
+    do {
+        int count = sync->count - sent < MAX_CHANGE_RECORDS ? sync->count - sent : MAX_CHANGE_RECORDS;
+        batch.count = count;
+        batch.flags = sent + count == sync->count ? CHANGE_SYNC | CHANGE_SYNC_DONE : CHANGE_SYNC;
+        if (connection_send_wait(sync->conn, frame, encode_changes(&batch, sync->records + sent, frame)) < 0) {
+            free(frame);
+            return -1;
+        }
+        sent += count;
+    } while (sent < sync->count);
+    free(frame);
+    return 0;
+}
 
-    // Accept clients
+// Function to send the changes that piled up during a sync, until none are
+// left and the stream can go straight to the connection
+int send_pending(Connection *conn) {
     while (1) {
-        int *new_sock = malloc(sizeof(int));
-        if ((*new_sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept failed");
-            free(new_sock);
+        pthread_mutex_lock(&replica_mutex);
+        int index = find_syncing_replica(conn);
+        if (index < 0) {
+            pthread_mutex_unlock(&replica_mutex);
+            return -1;
+        }
+        ReplicaStream *replica = &replicas[index];
+        if (replica->pending_len == 0) {
+            free(replica->pending);
+            replica->pending = NULL;
+            replica->pending_cap = 0;
+            replica->syncing = 0;
+            pthread_mutex_unlock(&replica_mutex);
+            return 0;
+        }
+        char *pending = replica->pending;
+        size_t length = replica->pending_len;
+        replica->pending = NULL;
+        replica->pending_len = replica->pending_cap = 0;
+        pthread_mutex_unlock(&replica_mutex);
+
+        // The connection is a byte stream, so the frames may go in pieces
+        for (size_t offset = 0; offset < length; offset += OUTPUT_HIGH_WATER) {
+            size_t piece = length - offset < OUTPUT_HIGH_WATER ? length - offset : OUTPUT_HIGH_WATER;
+            if (connection_send_wait(conn, pending + offset, piece) < 0) {
+                free(pending);
+                return -1;
+            }
+        }
+        free(pending);
+    }
+}
+
+// Function run by a sync thread: answer the replicate query once its LSN is
+// durable, send the balances, then hand the replica to the log stream
+void *sync_thread(void *arg) {
+    ReplicaSync *sync = arg;
+    uint64_t lsn = sync->response.response.lsn;
+
+    // Replicas only ever see durable changes, so the sync waits for them too
+    wal_wait_durable(&wal, lsn);
+    // The reply goes out before the sync frames queued behind it
+    connection_reply(sync->conn, &sync->message, &sync->response, 1);
+    if (send_sync(sync) < 0 || send_pending(sync->conn) < 0) {
+        pthread_mutex_lock(&replica_mutex);
+        int index = find_syncing_replica(sync->conn);
+        if (index >= 0) {
+            remove_replica(index);
+        }
+        pthread_mutex_unlock(&replica_mutex);
+    } else {
+        LOG(LOG_INFO, "Replica of department %d synced at LSN %llu (%d replicas)",
+            sync->response.response.accountNumber1, (unsigned long long)lsn, replica_count);
+    }
+    metrics_record_request(QUERY_REPLICATE, STATUS_SUCCESS, ERROR_NONE, metrics_now_ns() - sync->received_at);
+    connection_release(sync->conn);
+    free(sync->records);
+    free(sync);
+    return NULL;
+}
+
+// Function to handle Replicate Query: capture the department's balances and
+// add the replica to the change stream, then sync it from its own thread
+void handle_replicate(Connection *conn, const FrameHeader *message, const FramedRequest *request) {
+    uint64_t received_at = metrics_now_ns();
+    unsigned char department = request->request.departmentNumber;
+    FramedResponse response = {
+        .header = request->header,
+        .response = { .queryType = QUERY_REPLICATE, .accountNumber1 = department }
+    };
+    ReplicaSync *sync = calloc(1, sizeof(ReplicaSync));
+
+    // Mutations are kept out only while the balances are copied, so the copy
+    // holds exactly the log up to lsn and the stream can pick up right after
+    pthread_rwlock_wrlock(&checkpoint_lock);
+    uint64_t lsn = wal_last_lsn(&wal);
+    pthread_mutex_lock(&replica_mutex);
+    if (replica_count == MAX_REPLICAS) {
+        response.response.error = ERROR_TOO_MANY_REPLICAS;
+    } else if (!sync || !(sync->records = capture_department(department, &sync->count))) {
+        response.response.error = ERROR_OUT_OF_MEMORY;
+    } else {
+        connection_retain(conn);
+        replicas[replica_count] = (ReplicaStream){
+            .conn = conn, .department = department, .start_lsn = lsn, .syncing = 1
+        };
+        atomic_fetch_add(&replica_count, 1);
+    }
+    pthread_mutex_unlock(&replica_mutex);
+    pthread_rwlock_unlock(&checkpoint_lock);
+
+    if (response.response.error == ERROR_NONE) {
+        response.response.status = STATUS_SUCCESS;
+        response.response.lsn = lsn;
+        connection_retain(conn);
+        sync->conn = conn;
+        sync->message = *message;
+        sync->response = response;
+        sync->received_at = received_at;
+        pthread_t sync_tid;
+        if (pthread_create(&sync_tid, NULL, sync_thread, sync) == 0) {
+            pthread_detach(sync_tid);
+            LOG(LOG_INFO, "Replica of department %d added at LSN %llu (%d replicas)", department,
+                (unsigned long long)lsn, replica_count);
+            return;
+        }
+        connection_release(conn);
+        pthread_mutex_lock(&replica_mutex);
+        int index = find_syncing_replica(conn);
+        if (index >= 0) {
+            remove_replica(index);
+        }
+        pthread_mutex_unlock(&replica_mutex);
+        response.response.error = ERROR_OUT_OF_MEMORY;
+    }
+    response.response.status = STATUS_ERROR;
+    connection_reply(conn, message, &response, 1);
+    if (sync) {
+        free(sync->records);
+        free(sync);
+    }
+    metrics_record_request(QUERY_REPLICATE, response.response.status, response.response.error,
+                           metrics_now_ns() - received_at);
+}
+
+// Function to add one changed balance to a replica's frame if the account is
+// in its department
+void add_change(const ReplicaStream *replica, int accountNumber, int64_t amount, uint64_t lsn,
+                ChangeRecord *changes, int *count) {
+    AccountSlot *slot = account_table_find(&account_table, accountNumber);
+    if (slot && slot->departmentNumber == replica->department) {
+        changes[(*count)++] = (ChangeRecord){ .accountNumber = accountNumber, .amount = amount, .version = lsn };
+    }
+}
+
+// Function to send a replica one frame of changes, or keep it in pending
+// while the replica is syncing (up to OUTPUT_LIMIT, like a connection)
+int send_changes(ReplicaStream *replica, const char *frame, size_t length) {
+    if (!replica->syncing) {
+        return connection_send(replica->conn, frame, length);
+    }
+    if (replica->pending_len + length > OUTPUT_LIMIT) {
+        LOG(LOG_WARN, "Replica of department %d fell %zu bytes behind while syncing", replica->department,
+            replica->pending_len);
+        return -1;
+    }
+    if (replica->pending_len + length > replica->pending_cap) {
+        size_t capacity = replica->pending_cap ? replica->pending_cap : length;
+        while (capacity < replica->pending_len + length) {
+            capacity *= 2;
+        }
+        char *pending = realloc(replica->pending, capacity);
+        if (!pending) {
+            return -1;
+        }
+        replica->pending = pending;
+        replica->pending_cap = capacity;
+    }
+    memcpy(replica->pending + replica->pending_len, frame, length);
+    replica->pending_len += length;
+    return 0;
+}
+
+// Function to send one replica its department's changes in a durable batch.
+// A frame goes out even if none of them are its own, so the replica knows
+// how far it is caught up.
+int stream_changes(ReplicaStream *replica, const WalRecord *records, int count, uint64_t head_lsn,
+                   ChangeRecord *changes, char *frame) {
+    ChangeBatch batch = { .head_lsn = head_lsn };
+    int changed = 0;
+
+    // The sync already covered the records up to start_lsn
+    if (records[count - 1].lsn <= replica->start_lsn) {
+        return 0;
+    }
+    for (int i = 0; i < count; ++i) {
+        const WalRecord *record = &records[i];
+        if (record->lsn <= replica->start_lsn) {
             continue;
         }
+        // A transfer adds up to two changes, and a multi-transfer its records
+        // all in the same frame, so the replica applies it whole
+        int needed = 1;
+        if (record->type == WAL_TRANSFER) {
+            needed = 2;
+        } else if (record->type == WAL_MULTI_TRANSFER) {
+            needed = record->accountNumber2 + 1;
+        } else if (record->type == WAL_LEG) {
+            needed = 0;
+        }
+        if (changed + needed > MAX_CHANGE_RECORDS) {
+            batch.lsn = records[i - 1].lsn;
+            batch.count = changed;
+            if (send_changes(replica, frame, encode_changes(&batch, changes, frame)) < 0) {
+                return -1;
+            }
+            changed = 0;
+        }
+        if (record->type == WAL_UPDATE) {
+            add_change(replica, record->accountNumber1, record->amount, record->lsn, changes, &changed);
+        } else if (record->type == WAL_TRANSFER) {
+            add_change(replica, record->accountNumber1, -record->amount, record->lsn, changes, &changed);
+            add_change(replica, record->accountNumber2, record->amount, record->lsn, changes, &changed);
+        } else if (record->type == WAL_MULTI_TRANSFER || record->type == WAL_LEG) {
+            // Its accounts' version is the LSN of its last record
+            add_change(replica, record->accountNumber1, record->amount, record->lsn + record->accountNumber2,
+                       changes, &changed);
+        }
+    }
+    batch.lsn = records[count - 1].lsn;
+    batch.count = changed;
+    return send_changes(replica, frame, encode_changes(&batch, changes, frame));
+}
+
+// Function to stream every durable log batch to the replicas, dropping the
+// ones that disconnected (runs on the log flusher thread)
+void publish_changes(const WalRecord *records, int count, void *arg) {
+    (void)arg;
+    if (atomic_load(&replica_count) == 0) {
+        return;
+    }
+
+    ChangeRecord changes[MAX_CHANGE_RECORDS];
+    char frame[sizeof(FrameHeader) + sizeof(ChangeBatch) + sizeof(changes)];
+    uint64_t head_lsn = wal_last_lsn(&wal);
+
+    pthread_mutex_lock(&replica_mutex);
+    for (int i = 0; i < replica_count;) {
+        if (stream_changes(&replicas[i], records, count, head_lsn, changes, frame) < 0) {
+            remove_replica(i);
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&replica_mutex);
+}
+
+// Function to handle one request or batch from the event loop
+void handle_request(Connection *conn, const FrameHeader *message, const FramedRequest *requests, int count) {
+    FramedResponse responses[MAX_BATCH_REQUESTS];
+    unsigned char cached[MAX_BATCH_REQUESTS];
+    uint64_t received_at = metrics_now_ns();
+    int mutations = 0;
+    int in_progress = 0;
+    uint64_t lsn = 0;
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, (void *)new_sock) != 0) {
-            perror("pthread_create failed");
-            free(new_sock);
+    if (message->magic == FRAME_MAGIC && !(message->flags & FRAME_BATCH)
+        && requests[0].request.queryType == QUERY_SUBSCRIBE) {
+        handle_subscribe(conn, message, &requests[0]);
+        return;
+    }
+    if (message->magic == FRAME_MAGIC && !(message->flags & FRAME_BATCH)
+        && requests[0].request.queryType == QUERY_REPLICATE) {
+        handle_replicate(conn, message, &requests[0]);
+        return;
+    }
+
+    // Claim every request before taking checkpoint_lock. A retried request
+    // gets the stored response instead of running again; one whose original
+    // is still running is answered once it finishes, without blocking here.
+    for (int i = 0; i < count; ++i) {
+        responses[i].header = requests[i].header;
+        memset(&responses[i].response, 0, sizeof(CompactResponse));
+
+        if (batch_repeats_request(requests, i)) {
+            // Answered like a cache hit: it would otherwise wait for itself
+            cached[i] = REQUEST_CACHE_HIT;
+            responses[i].response.status = STATUS_ERROR;
+            responses[i].response.error = ERROR_DUPLICATE_REQUEST;
+            responses[i].response.queryType = requests[i].request.queryType;
+            continue;
         }
 
-        pthread_detach(tid);
+        cached[i] = request_cache_begin(&request_cache, &requests[i].header, &responses[i].response, 0);
+        if (cached[i] == REQUEST_CACHE_IN_PROGRESS) {
+            in_progress++;
+        } else if (cached[i] == REQUEST_CACHE_FULL) {
+            // Running it untracked could apply a later retry twice
+            responses[i].response.status = STATUS_ERROR;
+            responses[i].response.error = ERROR_REQUEST_BUSY;
+            responses[i].response.queryType = requests[i].request.queryType;
+        } else if (cached[i] != REQUEST_CACHE_HIT && is_mutation(&requests[i].request)) {
+            mutations++;
+        }
     }
 
-    // Cleanup (unreachable in this example)
-    close(server_fd);
-    for (int i = 0; i <= TOTAL_ACCOUNTS; ++i) {
-        pthread_mutex_destroy(&account_mutex[i]);
+    // The whole message runs under one hold of checkpoint_lock
+    if (mutations > 0) {
+        pthread_rwlock_rdlock(&checkpoint_lock);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (cached[i] == REQUEST_CACHE_NEW || cached[i] == REQUEST_CACHE_UNTRACKED) {
+            uint64_t request_lsn = process_request(&requests[i], &responses[i].response);
+            if (request_lsn > lsn) {
+                lsn = request_lsn;
+            }
+        }
+    }
+    if (mutations > 0) {
+        pthread_rwlock_unlock(&checkpoint_lock);
+
+        // Branches drop cached copies of the changed balances
+        int32_t changed[MAX_INVALIDATION_ACCOUNTS];
+        int changed_count = 0;
+        for (int i = 0; i < count; ++i) {
+            const CompactResponse *response = &responses[i].response;
+            if ((cached[i] != REQUEST_CACHE_NEW && cached[i] != REQUEST_CACHE_UNTRACKED)
+                || response->status != STATUS_SUCCESS || !is_mutation(&requests[i].request)) {
+                continue;
+            }
+            if (response->queryType == QUERY_MULTI_TRANSFER) {
+                invalidate_legs(requests[i].legs, requests[i].legCount);
+                continue;
+            }
+            changed[changed_count++] = response->accountNumber1;
+            if (response->queryType == QUERY_TRANSFER) {
+                changed[changed_count++] = response->accountNumber2;
+            }
+        }
+        publish_invalidations(changed, changed_count);
+    }
+
+    if (lsn != 0 || in_progress > 0) {
+        // Acknowledge mutations only once their log records are on disk; the
+        // log is durable in order, so waiting for the highest LSN covers all
+        PendingReply *reply = malloc(sizeof(PendingReply) + count * sizeof(FramedResponse)
+                                     + (in_progress > 0 ? count * sizeof(RequestCacheWaiter) : 0));
+        if (reply) {
+            reply->waiters = (RequestCacheWaiter *)(reply->responses + count);
+            reply->conn = conn;
+            reply->message = *message;
+            reply->received_at = received_at;
+            reply->count = count;
+            memcpy(reply->cached, cached, count);
+            memcpy(reply->responses, responses, count * sizeof(FramedResponse));
+            connection_retain(conn);
+
+            // One wait for this setup, so the reply cannot go out before
+            // every waiter is added
+            atomic_store(&reply->waits, 1 + (lsn != 0) + in_progress);
+            for (int i = 0; i < count; ++i) {
+                if (cached[i] != REQUEST_CACHE_IN_PROGRESS) {
+                    continue;
+                }
+                reply->waiters[i] = (RequestCacheWaiter){
+                    .response = &reply->responses[i].response,
+                    .callback = send_pending_reply,
+                    .arg = reply
+                };
+                reply->responses[i].response.queryType = requests[i].request.queryType;
+                if (request_cache_wait(&request_cache, &requests[i].header, &reply->waiters[i]) != REQUEST_CACHE_IN_PROGRESS) {
+                    atomic_fetch_sub(&reply->waits, 1);
+                }
+            }
+            if (lsn != 0) {
+                wal_on_durable(&wal, lsn, send_pending_reply, reply);
+            }
+            send_pending_reply(reply);
+            return;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (cached[i] == REQUEST_CACHE_IN_PROGRESS) {
+                responses[i].response.status = STATUS_ERROR;
+                responses[i].response.error = ERROR_OUT_OF_MEMORY;
+                responses[i].response.queryType = requests[i].request.queryType;
+            }
+        }
+        if (lsn != 0) {
+            wal_wait_durable(&wal, lsn);
+        }
+    }
+
+    finish_message(conn, message, responses, cached, count, received_at);
+}
+
+// Records of a multi-transfer read during recovery, applied once its last
+// one is read
+WalRecord replay_legs[2 * MAX_TRANSFER_LEGS];
+int replay_leg_count;
+
+// Function to re-apply the records of a multi-transfer, all with the version
+// of the last one
+void replay_multi_transfer() {
+    uint64_t version = replay_legs[replay_leg_count - 1].lsn;
+    for (int i = 0; i < replay_leg_count; ++i) {
+        AccountSlot *slot = account_table_find(&account_table, replay_legs[i].accountNumber1);
+        if (slot) {
+            atomic_fetch_add(&slot->balance, replay_legs[i].amount);
+            atomic_store(&slot->version, version);
+        }
+    }
+    replay_leg_count = 0;
+}
+
+// Function to re-apply a logged mutation during recovery
+void replay_record(const WalRecord *record, void *arg) {
+    (void)arg;
+    AccountSlot *slot = account_table_find(&account_table, record->accountNumber1);
+
+    // A multi-transfer cut short by a crash was never acknowledged: drop it
+    if (replay_leg_count > 0 && record->type != WAL_LEG) {
+        LOG(LOG_WARN, "Dropping %d records of an incomplete multi-transfer before LSN %llu", replay_leg_count,
+            (unsigned long long)record->lsn);
+        replay_leg_count = 0;
+    }
+    if (record->type == WAL_MULTI_TRANSFER || record->type == WAL_LEG) {
+        if ((record->type == WAL_LEG && replay_leg_count == 0) || replay_leg_count == 2 * MAX_TRANSFER_LEGS) {
+            return;
+        }
+        replay_legs[replay_leg_count++] = *record;
+        if (record->accountNumber2 == 0) {
+            replay_multi_transfer();
+        }
+        return;
+    }
+
+    if (record->type == WAL_UPDATE && slot) {
+        atomic_fetch_add(&slot->balance, record->amount);
+        atomic_store(&slot->version, record->lsn);
+    } else if (record->type == WAL_TRANSFER) {
+        AccountSlot *to_slot = account_table_find(&account_table, record->accountNumber2);
+        if (slot && to_slot) {
+            atomic_fetch_sub(&slot->balance, record->amount);
+            atomic_fetch_add(&to_slot->balance, record->amount);
+            atomic_store(&slot->version, record->lsn);
+            atomic_store(&to_slot->version, record->lsn);
+        }
+    }
+}
+
+// Function to give every loaded account the version of the data file it came
+// from: all its changes up to lsn are in there
+void initialize_versions(uint64_t lsn) {
+    for (int i = 0; i < account_table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&account_table, i);
+        if (slot) {
+            atomic_store(&slot->version, lsn);
+        }
+    }
+}
+
+// Function to compute every department total from the table as of lsn
+void initialize_department_totals(uint64_t lsn) {
+    aggregate_snapshot_init(&department_totals);
+    aggregate_snapshot_begin(&department_totals);
+    for (int i = 0; i < account_table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&account_table, i);
+        if (slot) {
+            aggregate_add_account(&department_totals.departments[slot->departmentNumber], atomic_load(&slot->balance));
+        }
+    }
+    aggregate_snapshot_publish(&department_totals, lsn);
+}
+
+// Function to add one logged change to its account's department total and
+// balance column
+void fold_change(int accountNumber, int64_t delta) {
+    AccountSlot *slot = account_table_find(&account_table, accountNumber);
+    if (slot) {
+        aggregate_change(&department_totals.departments[slot->departmentNumber], delta);
+        account_columns_change(&account_columns, slot->index, delta);
+    }
+}
+
+// Function to follow every durable log batch, in log order: fold it into the
+// department totals and the columns as one step, then stream it to the
+// replicas (runs on the log flusher thread, the only writer of both)
+void follow_log(const WalRecord *records, int count, void *arg) {
+    aggregate_snapshot_begin(&department_totals);
+    for (int i = 0; i < count; ++i) {
+        const WalRecord *record = &records[i];
+        if (record->type == WAL_UPDATE) {
+            fold_change(record->accountNumber1, record->amount);
+        } else if (record->type == WAL_TRANSFER) {
+            fold_change(record->accountNumber1, -record->amount);
+            fold_change(record->accountNumber2, record->amount);
+        } else if (record->type == WAL_MULTI_TRANSFER || record->type == WAL_LEG) {
+            fold_change(record->accountNumber1, record->amount);
+        }
+    }
+    aggregate_snapshot_publish(&department_totals, records[count - 1].lsn);
+    account_columns_publish(&account_columns, records[count - 1].lsn);
+
+    publish_changes(records, count, arg);
+}
+
+// Function to write all logged changes into the checkpoint file, then export
+// them to accounts.dat (returns -1 if they were not checkpointed)
+int checkpoint() {
+    // Briefly keep mutations out so the copy matches an exact log position
+    int count;
+    pthread_rwlock_wrlock(&checkpoint_lock);
+    SnapshotRecord *image = account_table_capture(&account_table, &count);
+    uint64_t lsn = wal_last_lsn(&wal);
+    unsigned first_kept_segment = wal_rotate(&wal);
+    pthread_rwlock_unlock(&checkpoint_lock);
+
+    if (!image) {
+        perror("Unable to allocate checkpoint image");
+        return -1;
+    }
+
+    wal_wait_durable(&wal, lsn);
+    int result = account_table_checkpoint(CHECKPOINT_FILE, image, count, lsn);
+    if (result == 0) {
+        // Records up to lsn now live in the checkpoint file
+        wal_remove_segments_before(&wal, first_kept_segment);
+        checkpoint_lsn = lsn;
+        LOG(LOG_INFO, "Checkpointed %s at LSN %llu", CHECKPOINT_FILE, (unsigned long long)lsn);
+        // For the programs that read accounts.dat, to the cent a float holds
+        account_table_export(&account_table, "accounts.dat", image, lsn);
+    }
+    free(image);
+    return result;
+}
+
+// Function run by the checkpoint thread
+void *checkpoint_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(CHECKPOINT_INTERVAL);
+        if (wal_last_lsn(&wal) != checkpoint_lsn) {
+            checkpoint();
+        }
+    }
+    return NULL;
+}
+
+// Function to write a point-in-time snapshot of every balance while
+// mutations go on: the table is forked under checkpoint_lock, and the child
+// writes its copy-on-write view of it. Writers only wait for the fork.
+int take_snapshot(char *filename, size_t size, uint64_t *lsn) {
+    char temp_name[96];
+
+    pthread_rwlock_wrlock(&checkpoint_lock);
+    *lsn = wal_last_lsn(&wal);
+    // Named after this server and LSN, so no other snapshot writes to it
+    snprintf(temp_name, sizeof(temp_name), "accounts-%llu.snap.%ld.tmp", (unsigned long long)*lsn, (long)getpid());
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child is a copy of a multithreaded process taken while other
+        // threads may hold locks (the allocator's, the logger's, stdio's), so
+        // it must only make system calls: account_table_write_snapshot uses
+        // nothing else and allocates nothing, and the child leaves with _exit
+        _exit(account_table_write_snapshot(&account_table, temp_name, *lsn) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
     }
+    pthread_rwlock_unlock(&checkpoint_lock);
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid failed");
+            return -1;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        LOG(LOG_ERROR, "Snapshot writer failed");
+        unlink(temp_name);
+        return -1;
+    }
+
+    // The image may hold mutations whose log records are not on disk yet
+    wal_wait_durable(&wal, *lsn);
+    snprintf(filename, size, "accounts-%llu.snap", (unsigned long long)*lsn);
+    if (rename(temp_name, filename) < 0) {
+        perror("Unable to rename snapshot");
+        unlink(temp_name);
+        return -1;
+    }
+
+    // The snapshot exists for good only once its directory entry is synced
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) < 0) {
+        perror("Unable to sync snapshot directory");
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return -1;
+    }
+    close(dir_fd);
+    return 0;
+}
 
+// Function to answer the /snapshot admin command
+int snapshot_command(FILE *out) {
+    char filename[64];
+    uint64_t lsn;
+    if (take_snapshot(filename, sizeof(filename), &lsn) < 0) {
+        fprintf(out, "Snapshot failed\n");
+        return -1;
+    }
+    LOG(LOG_INFO, "Snapshot %s written at LSN %llu", filename, (unsigned long long)lsn);
+    fprintf(out, "Snapshot %s written at LSN %llu\n", filename, (unsigned long long)lsn);
     return 0;
 }
+
+// Function to append central's own state to a metrics snapshot
+void write_central_metrics(FILE *out) {
+    fprintf(out, "# HELP bank_subscribers Branch connections receiving invalidations\n# TYPE bank_subscribers gauge\n");
+    fprintf(out, "bank_subscribers %d\n", atomic_load(&subscriber_count));
+    fprintf(out, "# HELP bank_replicas Branch replicas receiving the change stream\n# TYPE bank_replicas gauge\n");
+    fprintf(out, "bank_replicas %d\n", atomic_load(&replica_count));
+    fprintf(out, "# HELP bank_wal_last_lsn LSN of the last logged mutation\n# TYPE bank_wal_last_lsn counter\n");
+    fprintf(out, "bank_wal_last_lsn %llu\n", (unsigned long long)wal_last_lsn(&wal));
+    fprintf(out, "# HELP bank_checkpoint_lsn LSN accounts.dat was last checkpointed at\n# TYPE bank_checkpoint_lsn gauge\n");
+    fprintf(out, "bank_checkpoint_lsn %llu\n", (unsigned long long)__atomic_load_n(&checkpoint_lsn, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP bank_stats_kernel Kernel department stats are computed with\n# TYPE bank_stats_kernel gauge\n");
+    fprintf(out, "bank_stats_kernel{kernel=\"%s\"} 1\n", account_columns_kernel());
+}
+
+// Function to print command line usage and exit
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t event_loop_threads] [-n max_account_number] [-m admin_port] [-a admin_address] [-s snapshot_file] [-l error|warn|info|debug|trace]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int thread_count = EVENT_LOOP_THREADS;
+    int max_account = 0;
+    int admin_port = CENTRAL_PORT + ADMIN_PORT_OFFSET;
+    const char *admin_address = ADMIN_ADDRESS;
+    const char *snapshot_file = NULL;
+    int log_level_option = LOG_INFO;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:n:m:a:s:l:")) != -1) {
+        switch (option) {
+            case 'l':
+                log_level_option = log_parse_level(optarg);
+                if (log_level_option < 0) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'n':
+                max_account = atoi(optarg);
+                if (max_account < 1) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'm':
+                admin_port = atoi(optarg);
+                if (admin_port < 0 || admin_port > 65535) {
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'a':
+                admin_address = optarg;
+                break;
+            case 's':
+                snapshot_file = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+
+    if (optind != argc) {
+        print_usage(argv[0]);
+    }
+
+    if (thread_count < 1) {
+        fprintf(stderr, "Invalid thread count. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (log_init(log_level_option) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Claim waits are reported per stripe of accounts, like lock waits
+    if (metrics_init("central", CLAIM_STRIPES) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    request_cache_init(&request_cache);
+
+    // The last checkpoint, or a snapshot given with -s, is the starting
+    // state; its balances already include the log up to its LSN. Only a
+    // server that never checkpointed starts from accounts.dat.
+    const char *start_file = snapshot_file;
+    if (!start_file && access(CHECKPOINT_FILE, F_OK) == 0) {
+        start_file = CHECKPOINT_FILE;
+    }
+    if (start_file) {
+        if (account_table_load_snapshot(&account_table, start_file, max_account, &checkpoint_lsn) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (account_table_load(&account_table, "accounts.dat", max_account) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    LOG(LOG_INFO, "Central server loaded %d accounts numbered up to %d from %s",
+        account_table.count, account_table.max_account, start_file ? start_file : "accounts.dat");
+
+    // Prefer writers so a checkpoint is not starved by a steady stream of mutations
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&checkpoint_lock, &lock_attr);
+
+    // Re-apply everything logged since the starting state
+    if (!start_file && account_table_checkpoint_lsn(&account_table, "accounts.dat", &checkpoint_lsn) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    initialize_versions(checkpoint_lsn);
+    if (wal_open(&wal, "accounts.wal", checkpoint_lsn, replay_record, NULL) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    LOG(LOG_INFO, "Central server recovered up to LSN %llu (checkpoint at %llu)",
+           (unsigned long long)wal_last_lsn(&wal), (unsigned long long)checkpoint_lsn);
+
+    // Checkpoint the restored state right away, so a restart without -s
+    // does not go back to an older checkpoint
+    if (snapshot_file && checkpoint() < 0) {
+        fprintf(stderr, "Unable to checkpoint %s\n", snapshot_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // Totals and columns start from the recovered balances and follow every
+    // durable batch of the log after
+    initialize_department_totals(wal_last_lsn(&wal));
+    if (account_columns_init(&account_columns, &account_table, wal_last_lsn(&wal)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    wal_set_listener(&wal, follow_log, NULL);
+
+    pthread_t checkpoint_tid;
+    if (pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(checkpoint_tid);
+    pthread_t heartbeat_tid;
+    if (pthread_create(&heartbeat_tid, NULL, heartbeat_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(heartbeat_tid);
+
+    // Bind to CENTRAL_PORT
+    int server_fd = event_loop_listen(CENTRAL_PORT);
+    if (server_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // An admin port of 0 turns the metrics endpoint off
+    if (admin_port > 0 && (metrics_add_command("/snapshot", snapshot_command) < 0
+                           || metrics_start_admin(admin_address, admin_port, write_central_metrics) < 0)) {
+        exit(EXIT_FAILURE);
+    }
+
+    LOG(LOG_INFO, "Central server listening on port %d with %d event loop threads", CENTRAL_PORT, thread_count);
+
+    // Serve clients (only returns on failure)
+    event_loop_run(server_fd, thread_count, handle_request);
+
+    close(server_fd);
+
+    return EXIT_FAILURE;
+}
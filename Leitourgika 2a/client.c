@@ -4,42 +4,207 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <time.h>
 
+// Requests generated from one seed; the output only depends on the seed, not
+// on how many threads share the chunks
+#define CHUNK_REQUESTS 65536
+
+// Query types in the order of the -m percentages
+#define MIX_TYPES 4
+
+// What load files to generate
+typedef struct {
+    int requestCount;          // Per department
+    int mix[MIX_TYPES];        // Percent of display, update, transfer, average
+    int accounts;              // In all departments, split evenly in number order
+    double zipfExponent;       // 0 = no Zipf skew
+    int hotPercent;            // Hot spot: hotPercent of accounts get hotShare
+    int hotShare;              // percent of the picks (0 = no hot spot)
+    int ownPercent;            // Picks from the load file's own department
+    int crossPercent;          // Transfers to an account of another department
+    uint64_t seed;
+    int threads;
+} Workload;
+
+// Zipf sampler for ranks 1..n by rejection-inversion (Hörmann and Derflinger),
+// which needs no table however many accounts there are
+typedef struct {
+    int n;
+    double exponent;
+    double hIntegralX1;
+    double hIntegralN;
+    double s;
+} ZipfSampler;
+
+// Random number generator state of one chunk (splitmix64)
+typedef struct {
+    uint64_t state;
+} Rng;
+
+Workload workload;
+ZipfSampler zipf;
+int accounts_per_department;
+int account_stride;            // Spreads hot ranks over the account numbers
+
+// One department's load file being generated
+typedef struct {
+    int departmentNumber;
+    Request *requests;         // Mapped output file
+    int chunk_count;
+    int next_chunk;            // Claimed by generator threads
+} LoadFile;
+
+// Function to get the next random 64-bit number
+uint64_t rng_next(Rng *rng) {
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Function to generate a random double in [0, 1)
+double rng_uniform(Rng *rng) {
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+// Function to generate a random int in [0, n)
+int rng_below(Rng *rng, int n) {
+    return (int)(rng_uniform(rng) * n);
+}
+
 // Function to generate a random float between min and max
-float random_float(float min, float max) {
-    float scale = rand() / (float) RAND_MAX;
-    return min + scale * (max - min);
+float random_float(Rng *rng, float min, float max) {
+    return min + (float)rng_uniform(rng) * (max - min);
+}
+
+// Functions behind the Zipf sampler: log1p(x) / x and expm1(x) / x, with
+// their series near 0
+double zipf_helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+
+double zipf_helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+}
+
+// Function to integrate the Zipf weight x^-exponent, and its inverse
+double zipf_h_integral(ZipfSampler *sampler, double x) {
+    double log_x = log(x);
+    return zipf_helper2((1.0 - sampler->exponent) * log_x) * log_x;
+}
+
+double zipf_h_integral_inverse(ZipfSampler *sampler, double x) {
+    double t = x * (1.0 - sampler->exponent);
+    if (t < -1.0) {
+        t = -1.0; // Rounding error; the limit of the inverse
+    }
+    return exp(zipf_helper1(t) * x);
+}
+
+// Function to get the Zipf weight of x
+double zipf_h(ZipfSampler *sampler, double x) {
+    return exp(-sampler->exponent * log(x));
+}
+
+// Function to prepare a Zipf sampler for ranks 1..n
+void zipf_init(ZipfSampler *sampler, int n, double exponent) {
+    sampler->n = n;
+    sampler->exponent = exponent;
+    sampler->hIntegralX1 = zipf_h_integral(sampler, 1.5) - 1.0;
+    sampler->hIntegralN = zipf_h_integral(sampler, n + 0.5);
+    sampler->s = 2.0 - zipf_h_integral_inverse(sampler, zipf_h_integral(sampler, 2.5) - zipf_h(sampler, 2.0));
+}
+
+// Function to draw a Zipf distributed rank (1 is the most frequent)
+int zipf_sample(ZipfSampler *sampler, Rng *rng) {
+    while (1) {
+        double u = sampler->hIntegralN + rng_uniform(rng) * (sampler->hIntegralX1 - sampler->hIntegralN);
+        double x = zipf_h_integral_inverse(sampler, u);
+        int k = (int)(x + 0.5);
+        if (k < 1) {
+            k = 1;
+        } else if (k > sampler->n) {
+            k = sampler->n;
+        }
+        if (k - x <= sampler->s || u >= zipf_h_integral(sampler, k + 0.5) - zipf_h(sampler, k)) {
+            return k;
+        }
+    }
+}
+
+// Function to pick an account of a department, with the configured skew
+int pick_account(Rng *rng, int departmentNumber) {
+    int rank; // 0 is the hottest
+    if (workload.zipfExponent > 0) {
+        rank = zipf_sample(&zipf, rng) - 1;
+    } else if (workload.hotShare > 0) {
+        int hot_count = (int)((int64_t)accounts_per_department * workload.hotPercent / 100);
+        if (hot_count < 1) {
+            hot_count = 1;
+        }
+        if (rng_below(rng, 100) < workload.hotShare || hot_count == accounts_per_department) {
+            rank = rng_below(rng, hot_count);
+        } else {
+            rank = hot_count + rng_below(rng, accounts_per_department - hot_count);
+        }
+    } else {
+        rank = rng_below(rng, accounts_per_department);
+    }
+
+    // Hot ranks land on scattered account numbers rather than the first ones
+    int index = (int)((int64_t)rank * account_stride % accounts_per_department);
+    return (departmentNumber - 1) * accounts_per_department + index + 1;
+}
+
+// Function to pick another department than departmentNumber
+int other_department(Rng *rng, int departmentNumber) {
+    int other = 1 + rng_below(rng, DEPARTMENT_COUNT - 1);
+    return other >= departmentNumber ? other + 1 : other;
+}
+
+// Function to pick the department of a request's account
+int pick_department(Rng *rng, int departmentNumber) {
+    if (rng_below(rng, 100) < workload.ownPercent) {
+        return departmentNumber;
+    }
+    return other_department(rng, departmentNumber);
 }
 
 // Function to generate a single request based on probabilities
-Request generate_request(unsigned char departmentNumber) {
+Request generate_request(Rng *rng, unsigned char departmentNumber) {
     Request request;
     memset(&request, 0, sizeof(Request));
     request.departmentNumber = departmentNumber;
 
-    int rand_percent = rand() % 100;
+    int rand_percent = rng_below(rng, 100);
 
-    if (rand_percent < 35) {
+    if (rand_percent < workload.mix[0]) {
         // Type 1: Display
         request.queryType = QUERY_DISPLAY;
-        // Random accountNumber between 1 and 1000
-        request.accountNumber1 = rand() % TOTAL_ACCOUNTS + 1;
-    } else if (rand_percent < 70) {
+        request.accountNumber1 = pick_account(rng, pick_department(rng, departmentNumber));
+    } else if (rand_percent < workload.mix[0] + workload.mix[1]) {
         // Type 2: Update
         request.queryType = QUERY_UPDATE;
-        request.accountNumber1 = rand() % TOTAL_ACCOUNTS + 1;
+        request.accountNumber1 = pick_account(rng, pick_department(rng, departmentNumber));
         // Random amount between -500.00 and +500.00
-        request.amount = random_float(-500.0, 500.0);
-    } else if (rand_percent < 95) {
+        request.amount = random_float(rng, -500.0, 500.0);
+    } else if (rand_percent < workload.mix[0] + workload.mix[1] + workload.mix[2]) {
         // Type 3: Transfer
         request.queryType = QUERY_TRANSFER;
-        request.accountNumber1 = rand() % TOTAL_ACCOUNTS + 1;
+        int from_department = pick_department(rng, departmentNumber);
+        int to_department = rng_below(rng, 100) < workload.crossPercent
+            ? other_department(rng, from_department) : from_department;
+        request.accountNumber1 = pick_account(rng, from_department);
         do {
-            request.accountNumber2 = rand() % TOTAL_ACCOUNTS + 1;
+            request.accountNumber2 = pick_account(rng, to_department);
         } while (request.accountNumber2 == request.accountNumber1);
-        request.amount = random_float(1.0, 1000.0);
+        request.amount = random_float(rng, 1.0, 1000.0);
     } else {
         // Type 4: Average
         request.queryType = QUERY_AVERAGE;
@@ -49,34 +214,171 @@ Request generate_request(unsigned char departmentNumber) {
     return request;
 }
 
+// Function to generate chunks of a load file until none are left
+void *generate_chunks(void *file_ptr) {
+    LoadFile *file = file_ptr;
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&file->next_chunk, 1, __ATOMIC_RELAXED)) < file->chunk_count) {
+        Rng rng = {workload.seed ^ ((uint64_t)file->departmentNumber << 48) ^ ((uint64_t)chunk * 0xD1B54A32D192ED03ull)};
+        int first = chunk * CHUNK_REQUESTS;
+        int last = first + CHUNK_REQUESTS < workload.requestCount ? first + CHUNK_REQUESTS : workload.requestCount;
+        for (int i = first; i < last; ++i) {
+            file->requests[i] = generate_request(&rng, file->departmentNumber);
+        }
+    }
+    return NULL;
+}
+
 // Function to write load file for a department
-void generate_load_file(int departmentNumber, int requestCount, const char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+void generate_load_file(int departmentNumber, const char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         perror("Unable to create load file");
         exit(EXIT_FAILURE);
     }
 
-    srand(time(NULL) + departmentNumber); // Seed differently for each department
+    // Threads write their chunks straight into the mapped file
+    size_t size = (size_t)workload.requestCount * sizeof(Request);
+    LoadFile file = {
+        .departmentNumber = departmentNumber,
+        .requests = NULL,
+        .chunk_count = (workload.requestCount + CHUNK_REQUESTS - 1) / CHUNK_REQUESTS,
+        .next_chunk = 0
+    };
+    if (size > 0) {
+        if (ftruncate(fd, size) < 0) {
+            perror("Unable to size load file");
+            exit(EXIT_FAILURE);
+        }
+        file.requests = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (file.requests == MAP_FAILED) {
+            perror("Unable to map load file");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t threads[workload.threads];
+        for (int i = 0; i < workload.threads; ++i) {
+            if (pthread_create(&threads[i], NULL, generate_chunks, &file) != 0) {
+                perror("pthread_create failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < workload.threads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
 
-    for (int i = 0; i < requestCount; ++i) {
-        Request req = generate_request(departmentNumber);
-        fwrite(&req, sizeof(Request), 1, file);
+        munmap(file.requests, size);
     }
+    close(fd);
+    printf("Load file '%s' created with %d requests.\n", filename, workload.requestCount);
+}
+
+// Function to pick a multiplier that is coprime with n, so that multiplying
+// ranks by it modulo n permutes them
+int coprime_stride(int n) {
+    int stride = (int)(n * 0.6180339887) | 1;
+    while (1) {
+        int a = stride, b = n;
+        while (b) {
+            int t = a % b;
+            a = b;
+            b = t;
+        }
+        if (a == 1) {
+            return stride % n ? stride % n : 1;
+        }
+        stride += 2;
+    }
+}
 
-    fclose(file);
-    printf("Load file '%s' created with %d requests.\n", filename, requestCount);
+// Function to print command line usage and exit
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n requests_per_department] [-m display,update,transfer,average] [-a accounts]\n"
+                    "          [-z zipf_exponent | -h hot_percent:hot_share] [-l own_department_percent]\n"
+                    "          [-x cross_department_transfer_percent] [-s seed] [-t threads]\n", program);
+    exit(EXIT_FAILURE);
 }
 
-int main() {
-    int requests_per_department = 300000;
-    char filename1[50], filename2[50];
+int main(int argc, char *argv[]) {
+    char filename[50];
+    int option;
+
+    workload = (Workload){
+        .requestCount = 300000,
+        .mix = {35, 35, 25, 5},
+        .accounts = TOTAL_ACCOUNTS,
+        .ownPercent = 100 / DEPARTMENT_COUNT, // Accounts of every department equally
+        .crossPercent = 100 - 100 / DEPARTMENT_COUNT,
+        .seed = (uint64_t)time(NULL),
+        .threads = (int)sysconf(_SC_NPROCESSORS_ONLN)
+    };
+
+    while ((option = getopt(argc, argv, "n:m:a:z:h:l:x:s:t:")) != -1) {
+        switch (option) {
+            case 'n':
+                workload.requestCount = atoi(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d,%d", &workload.mix[0], &workload.mix[1], &workload.mix[2], &workload.mix[3]) != MIX_TYPES
+                    || workload.mix[0] < 0 || workload.mix[1] < 0 || workload.mix[2] < 0 || workload.mix[3] < 0
+                    || workload.mix[0] + workload.mix[1] + workload.mix[2] + workload.mix[3] != 100) {
+                    fprintf(stderr, "Invalid mix. Give four percentages that add up to 100.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                workload.accounts = atoi(optarg);
+                break;
+            case 'z':
+                workload.zipfExponent = atof(optarg);
+                break;
+            case 'h':
+                if (sscanf(optarg, "%d:%d", &workload.hotPercent, &workload.hotShare) != 2
+                    || workload.hotPercent < 1 || workload.hotPercent > 100 || workload.hotShare < 0 || workload.hotShare > 100) {
+                    fprintf(stderr, "Invalid hot spot. Give hot_percent:hot_share, both percentages.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                workload.ownPercent = atoi(optarg);
+                break;
+            case 'x':
+                workload.crossPercent = atoi(optarg);
+                break;
+            case 's':
+                workload.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                workload.threads = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || workload.requestCount < 0 || workload.zipfExponent < 0
+        || workload.ownPercent < 0 || workload.ownPercent > 100 || workload.crossPercent < 0 || workload.crossPercent > 100) {
+        print_usage(argv[0]);
+    }
+    if (workload.accounts < 2 * DEPARTMENT_COUNT) {
+        fprintf(stderr, "Invalid account count. Must be at least %d.\n", 2 * DEPARTMENT_COUNT);
+        exit(EXIT_FAILURE);
+    }
+    if (workload.threads < 1) {
+        workload.threads = 1;
+    }
 
-    snprintf(filename1, sizeof(filename1), "load_department_%d.dat", 1);
-    snprintf(filename2, sizeof(filename2), "load_department_%d.dat", 2);
+    accounts_per_department = workload.accounts / DEPARTMENT_COUNT;
+    account_stride = coprime_stride(accounts_per_department);
+    if (workload.zipfExponent > 0) {
+        zipf_init(&zipf, accounts_per_department, workload.zipfExponent);
+    }
 
-    generate_load_file(1, requests_per_department, filename1);
-    generate_load_file(2, requests_per_department, filename2);
+    printf("Generating with seed %llu\n", (unsigned long long)workload.seed);
+    for (int departmentNumber = 1; departmentNumber <= DEPARTMENT_COUNT; ++departmentNumber) {
+        snprintf(filename, sizeof(filename), "load_department_%d.dat", departmentNumber);
+        generate_load_file(departmentNumber, filename);
+    }
 
     return 0;
 }
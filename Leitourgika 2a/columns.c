@@ -0,0 +1,414 @@
+// columns.c
+#include "columns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+// Balances the vector kernels convert to double exactly: |balance| < 2^51
+#define EXACT_DOUBLE_LIMIT (INT64_C(1) << 51)
+
+// 1.5 * 2^52: adding a small integer to its bits gives the double of that
+// integer plus this, without an int64 to double instruction (AVX-512 only)
+#define DOUBLE_MAGIC_BITS INT64_C(0x4338000000000000)
+#define DOUBLE_MAGIC 6755399441055744.0
+
+// A stats kernel: sum, count, minimum and maximum of the department's
+// balances, and the sum of their squared distances from mean
+typedef struct {
+    void (*totals)(const int64_t *balances, const unsigned char *departments, int count,
+                   unsigned char departmentNumber, DepartmentStats *stats);
+    double (*deviation)(const int64_t *balances, const unsigned char *departments, int count,
+                        unsigned char departmentNumber, double mean);
+    const char *name;
+} StatsKernel;
+
+// Function to add the scalar part of a scan, from index start on
+static void totals_scalar_from(const int64_t *balances, const unsigned char *departments, int count,
+                               unsigned char departmentNumber, int start, DepartmentStats *stats) {
+    for (int i = start; i < count; ++i) {
+        if (departments[i] != departmentNumber) {
+            continue;
+        }
+        int64_t balance = balances[i];
+        stats->sum += balance;
+        stats->count++;
+        if (balance < stats->minimum) {
+            stats->minimum = balance;
+        }
+        if (balance > stats->maximum) {
+            stats->maximum = balance;
+        }
+    }
+}
+
+static double deviation_scalar_from(const int64_t *balances, const unsigned char *departments, int count,
+                                    unsigned char departmentNumber, double mean, int start) {
+    double squares = 0;
+    for (int i = start; i < count; ++i) {
+        if (departments[i] == departmentNumber) {
+            double distance = (double)balances[i] - mean;
+            squares += distance * distance;
+        }
+    }
+    return squares;
+}
+
+// Function to scan one account at a time
+static void totals_scalar(const int64_t *balances, const unsigned char *departments, int count,
+                          unsigned char departmentNumber, DepartmentStats *stats) {
+    totals_scalar_from(balances, departments, count, departmentNumber, 0, stats);
+}
+
+static double deviation_scalar(const int64_t *balances, const unsigned char *departments, int count,
+                               unsigned char departmentNumber, double mean) {
+    return deviation_scalar_from(balances, departments, count, departmentNumber, mean, 0);
+}
+
+// Function to fold vector lanes into the totals
+static void add_lanes(const int64_t *sums, const int64_t *counts, const int64_t *minimums, const int64_t *maximums,
+                      int lanes, DepartmentStats *stats) {
+    for (int lane = 0; lane < lanes; ++lane) {
+        stats->sum += sums[lane];
+        stats->count += counts[lane];
+        if (minimums[lane] < stats->minimum) {
+            stats->minimum = minimums[lane];
+        }
+        if (maximums[lane] > stats->maximum) {
+            stats->maximum = maximums[lane];
+        }
+    }
+}
+
+// Function to scan four accounts per step. A lane of the department mask is
+// all ones for an account of the department, so it is both the filter and,
+// subtracted, the count.
+__attribute__((target("avx2")))
+static void totals_avx2(const int64_t *balances, const unsigned char *departments, int count,
+                        unsigned char departmentNumber, DepartmentStats *stats) {
+    __m256i wanted = _mm256_set1_epi64x(departmentNumber);
+    __m256i sums = _mm256_setzero_si256();
+    __m256i counts = _mm256_setzero_si256();
+    __m256i minimums = _mm256_set1_epi64x(INT64_MAX);
+    __m256i maximums = _mm256_set1_epi64x(INT64_MIN);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t packed;
+        memcpy(&packed, departments + i, sizeof(packed));
+        __m256i mask = _mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed)), wanted);
+        __m256i values = _mm256_loadu_si256((const __m256i *)(balances + i));
+
+        sums = _mm256_add_epi64(sums, _mm256_and_si256(values, mask));
+        counts = _mm256_sub_epi64(counts, mask);
+        minimums = _mm256_blendv_epi8(minimums, values, _mm256_and_si256(mask, _mm256_cmpgt_epi64(minimums, values)));
+        maximums = _mm256_blendv_epi8(maximums, values, _mm256_and_si256(mask, _mm256_cmpgt_epi64(values, maximums)));
+    }
+
+    int64_t lanes[4][4];
+    _mm256_storeu_si256((__m256i *)lanes[0], sums);
+    _mm256_storeu_si256((__m256i *)lanes[1], counts);
+    _mm256_storeu_si256((__m256i *)lanes[2], minimums);
+    _mm256_storeu_si256((__m256i *)lanes[3], maximums);
+    add_lanes(lanes[0], lanes[1], lanes[2], lanes[3], 4, stats);
+    totals_scalar_from(balances, departments, count, departmentNumber, i, stats);
+}
+
+__attribute__((target("avx2")))
+static double deviation_avx2(const int64_t *balances, const unsigned char *departments, int count,
+                             unsigned char departmentNumber, double mean) {
+    __m256i wanted = _mm256_set1_epi64x(departmentNumber);
+    __m256i magic_bits = _mm256_set1_epi64x(DOUBLE_MAGIC_BITS);
+    __m256d magic = _mm256_set1_pd(DOUBLE_MAGIC);
+    __m256d means = _mm256_set1_pd(mean);
+    __m256d squares = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int32_t packed;
+        memcpy(&packed, departments + i, sizeof(packed));
+        __m256i mask = _mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed)), wanted);
+        __m256i values = _mm256_loadu_si256((const __m256i *)(balances + i));
+
+        __m256d amounts = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(values, magic_bits)), magic);
+        __m256d distances = _mm256_sub_pd(amounts, means);
+        squares = _mm256_add_pd(squares, _mm256_and_pd(_mm256_mul_pd(distances, distances), _mm256_castsi256_pd(mask)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, squares);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+        + deviation_scalar_from(balances, departments, count, departmentNumber, mean, i);
+}
+
+// Function to scan two accounts per step (64-bit compares need SSE4.2)
+__attribute__((target("sse4.2")))
+static void totals_sse(const int64_t *balances, const unsigned char *departments, int count,
+                       unsigned char departmentNumber, DepartmentStats *stats) {
+    __m128i wanted = _mm_set1_epi64x(departmentNumber);
+    __m128i sums = _mm_setzero_si128();
+    __m128i counts = _mm_setzero_si128();
+    __m128i minimums = _mm_set1_epi64x(INT64_MAX);
+    __m128i maximums = _mm_set1_epi64x(INT64_MIN);
+
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint16_t packed;
+        memcpy(&packed, departments + i, sizeof(packed));
+        __m128i mask = _mm_cmpeq_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(packed)), wanted);
+        __m128i values = _mm_loadu_si128((const __m128i *)(balances + i));
+
+        sums = _mm_add_epi64(sums, _mm_and_si128(values, mask));
+        counts = _mm_sub_epi64(counts, mask);
+        minimums = _mm_blendv_epi8(minimums, values, _mm_and_si128(mask, _mm_cmpgt_epi64(minimums, values)));
+        maximums = _mm_blendv_epi8(maximums, values, _mm_and_si128(mask, _mm_cmpgt_epi64(values, maximums)));
+    }
+
+    int64_t lanes[4][2];
+    _mm_storeu_si128((__m128i *)lanes[0], sums);
+    _mm_storeu_si128((__m128i *)lanes[1], counts);
+    _mm_storeu_si128((__m128i *)lanes[2], minimums);
+    _mm_storeu_si128((__m128i *)lanes[3], maximums);
+    add_lanes(lanes[0], lanes[1], lanes[2], lanes[3], 2, stats);
+    totals_scalar_from(balances, departments, count, departmentNumber, i, stats);
+}
+
+__attribute__((target("sse4.2")))
+static double deviation_sse(const int64_t *balances, const unsigned char *departments, int count,
+                            unsigned char departmentNumber, double mean) {
+    __m128i wanted = _mm_set1_epi64x(departmentNumber);
+    __m128i magic_bits = _mm_set1_epi64x(DOUBLE_MAGIC_BITS);
+    __m128d magic = _mm_set1_pd(DOUBLE_MAGIC);
+    __m128d means = _mm_set1_pd(mean);
+    __m128d squares = _mm_setzero_pd();
+
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint16_t packed;
+        memcpy(&packed, departments + i, sizeof(packed));
+        __m128i mask = _mm_cmpeq_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(packed)), wanted);
+        __m128i values = _mm_loadu_si128((const __m128i *)(balances + i));
+
+        __m128d amounts = _mm_sub_pd(_mm_castsi128_pd(_mm_add_epi64(values, magic_bits)), magic);
+        __m128d distances = _mm_sub_pd(amounts, means);
+        squares = _mm_add_pd(squares, _mm_and_pd(_mm_mul_pd(distances, distances), _mm_castsi128_pd(mask)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, squares);
+    return lanes[0] + lanes[1] + deviation_scalar_from(balances, departments, count, departmentNumber, mean, i);
+}
+
+static const StatsKernel scalar_kernel = { totals_scalar, deviation_scalar, "scalar" };
+
+// Function to pick the widest kernel the CPU supports, once
+static const StatsKernel *select_kernel() {
+    static const StatsKernel avx2_kernel = { totals_avx2, deviation_avx2, "avx2" };
+    static const StatsKernel sse_kernel = { totals_sse, deviation_sse, "sse4.2" };
+    static const StatsKernel *selected;
+
+    if (!selected) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            selected = &avx2_kernel;
+        } else if (__builtin_cpu_supports("sse4.2")) {
+            selected = &sse_kernel;
+        } else {
+            selected = &scalar_kernel;
+        }
+    }
+    return selected;
+}
+
+// Function to allocate an empty version of the balance column
+static BalanceCopy *create_copy(int count) {
+    BalanceCopy *copy = calloc(1, sizeof(BalanceCopy));
+    if (!copy || !(copy->balances = malloc(count * sizeof(int64_t) + 1))) {
+        perror("Unable to allocate account columns");
+        free(copy);
+        return NULL;
+    }
+    atomic_init(&copy->readers, 0);
+    return copy;
+}
+
+// Function to append a change to a list, exiting if it cannot grow
+static void add_change(ColumnChanges *list, int position, int64_t delta) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        ColumnChange *changes = realloc(list->changes, capacity * sizeof(ColumnChange));
+        if (!changes) {
+            // The columns could no longer match the log
+            perror("Unable to grow account column changes");
+            exit(EXIT_FAILURE);
+        }
+        list->changes = changes;
+        list->capacity = capacity;
+    }
+    list->changes[list->count++] = (ColumnChange){ position, delta };
+}
+
+// Function to apply a list of changes to one version
+static void apply_changes(BalanceCopy *copy, const ColumnChanges *list) {
+    for (int i = 0; i < list->count; ++i) {
+        copy->balances[list->changes[i].position] += list->changes[i].delta;
+    }
+}
+
+// Function to copy the table into columns
+int account_columns_init(AccountColumns *columns, AccountTable *table, uint64_t lsn) {
+    memset(columns, 0, sizeof(AccountColumns));
+    columns->accountNumbers = malloc(table->count * sizeof(int32_t) + 1);
+    columns->departments = malloc(table->count + 1);
+    columns->positions = malloc(table->record_count * sizeof(int) + 1);
+    columns->copies[0] = create_copy(table->count);
+    if (!columns->accountNumbers || !columns->departments || !columns->positions || !columns->copies[0]) {
+        perror("Unable to allocate account columns");
+        return -1;
+    }
+
+    BalanceCopy *copy = columns->copies[0];
+    for (int i = 0; i < table->record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(table, i);
+        columns->positions[i] = slot ? columns->count : -1;
+        if (slot) {
+            columns->accountNumbers[columns->count] = slot->accountNumber;
+            columns->departments[columns->count] = slot->departmentNumber;
+            copy->balances[columns->count] = atomic_load(&slot->balance);
+            columns->count++;
+        }
+    }
+    copy->lsn = lsn;
+    atomic_init(&columns->current, 0);
+
+    select_kernel();
+    return 0;
+}
+
+// Function to collect one change of the group
+void account_columns_change(AccountColumns *columns, int index, int64_t delta) {
+    int position = columns->positions[index];
+    if (position >= 0) {
+        add_change(&columns->batch, position, delta);
+    }
+}
+
+// Function to find a version no scan is using to write the group to,
+// creating one if every existing version is held (returns -1 if none can be)
+static int writable_copy(AccountColumns *columns, int current) {
+    for (int i = 0; i < COLUMN_COPIES; ++i) {
+        BalanceCopy *copy = columns->copies[i];
+        if (i != current && copy && atomic_load(&copy->readers) == 0) {
+            return i;
+        }
+    }
+    for (int i = 0; i < COLUMN_COPIES; ++i) {
+        if (!columns->copies[i]) {
+            columns->copies[i] = create_copy(columns->count);
+            if (!columns->copies[i]) {
+                return -1;
+            }
+            columns->copies[i]->stale = 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to publish the changes collected since the last publish: the
+// version written is brought up to date first, and every other one records
+// the group as missed until it is written again
+void account_columns_publish(AccountColumns *columns, uint64_t lsn) {
+    int current = atomic_load(&columns->current);
+    int target = writable_copy(columns, current);
+    if (target < 0) {
+        // Every version is held by a scan: keep the group for the next publish
+        return;
+    }
+
+    BalanceCopy *copy = columns->copies[target];
+    if (copy->stale) {
+        memcpy(copy->balances, columns->copies[current]->balances, columns->count * sizeof(int64_t));
+        copy->stale = 0;
+    } else {
+        apply_changes(copy, &copy->missed);
+    }
+    copy->missed.count = 0;
+    apply_changes(copy, &columns->batch);
+    copy->lsn = lsn;
+
+    for (int i = 0; i < COLUMN_COPIES; ++i) {
+        BalanceCopy *other = columns->copies[i];
+        if (i == target || !other || other->stale) {
+            continue;
+        }
+        if (other->missed.count + columns->batch.count > columns->count) {
+            other->stale = 1;
+            other->missed.count = 0;
+            continue;
+        }
+        for (int j = 0; j < columns->batch.count; ++j) {
+            add_change(&other->missed, columns->batch.changes[j].position, columns->batch.changes[j].delta);
+        }
+    }
+    columns->batch.count = 0;
+
+    // Scans that start from here on see the group
+    atomic_store(&columns->current, target);
+}
+
+// Function to pin the published version for a scan
+static BalanceCopy *pin_copy(AccountColumns *columns) {
+    while (1) {
+        int current = atomic_load(&columns->current);
+        BalanceCopy *copy = columns->copies[current];
+        atomic_fetch_add(&copy->readers, 1);
+        // Still published once pinned, so the writer will leave it alone
+        if (atomic_load(&columns->current) == current) {
+            return copy;
+        }
+        atomic_fetch_sub(&copy->readers, 1);
+    }
+}
+
+// Function to run a kernel over one department
+static uint64_t compute_stats(AccountColumns *columns, const StatsKernel *kernel, unsigned char departmentNumber,
+                              DepartmentStats *stats) {
+    *stats = (DepartmentStats){ .minimum = INT64_MAX, .maximum = INT64_MIN };
+
+    BalanceCopy *copy = pin_copy(columns);
+    kernel->totals(copy->balances, columns->departments, columns->count, departmentNumber, stats);
+    if (stats->count > 0) {
+        // The vector kernels convert balances to double exactly only up to
+        // EXACT_DOUBLE_LIMIT; any department beyond it takes the scalar one
+        if (stats->minimum <= -EXACT_DOUBLE_LIMIT || stats->maximum >= EXACT_DOUBLE_LIMIT) {
+            kernel = &scalar_kernel;
+        }
+        double mean = (double)stats->sum / stats->count;
+        stats->variance = kernel->deviation(copy->balances, columns->departments, columns->count,
+                                            departmentNumber, mean) / stats->count;
+    }
+    uint64_t lsn = copy->lsn;
+    atomic_fetch_sub(&copy->readers, 1);
+
+    if (stats->count == 0) {
+        stats->minimum = 0;
+        stats->maximum = 0;
+    }
+    return lsn;
+}
+
+// Function to compute a department's statistics with the selected kernel
+uint64_t account_columns_stats(AccountColumns *columns, unsigned char departmentNumber, DepartmentStats *stats) {
+    return compute_stats(columns, select_kernel(), departmentNumber, stats);
+}
+
+// Function to compute them one account at a time
+uint64_t account_columns_stats_scalar(AccountColumns *columns, unsigned char departmentNumber, DepartmentStats *stats) {
+    return compute_stats(columns, &scalar_kernel, departmentNumber, stats);
+}
+
+// Function to name the selected kernel
+const char *account_columns_kernel() {
+    return select_kernel()->name;
+}
@@ -0,0 +1,83 @@
+// columns.h
+#ifndef COLUMNS_H
+#define COLUMNS_H
+
+#include "account_table.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Statistics of one department's balances
+typedef struct {
+    int count;
+    int64_t sum;         // Cents
+    int64_t minimum;     // Cents, 0 if there are no accounts
+    int64_t maximum;
+    double variance;     // Population variance, in cents squared
+} DepartmentStats;
+
+// Most versions of the balance column kept at once: the published one, the
+// one being written and one per scan still running on an older one
+#define COLUMN_COPIES 64
+
+// One balance change, at its account's column position
+typedef struct {
+    int position;
+    int64_t delta;              // Cents
+} ColumnChange;
+
+// Growable list of changes
+typedef struct {
+    ColumnChange *changes;
+    int count;
+    int capacity;
+} ColumnChanges;
+
+// One version of the balance column
+typedef struct {
+    int64_t *balances;          // Cents
+    uint64_t lsn;               // Last change included
+    _Atomic int readers;        // Scans running on this version
+    ColumnChanges missed;       // Changes published since it was last written
+    int stale;                  // Missed more changes than it has accounts: copy
+                                // the published version instead of catching up
+} BalanceCopy;
+
+// Every account's balance stored column by column, one dense array per field
+// in data file order, so a department scan streams through balances and
+// departments only and the stats kernels can work on several accounts per
+// instruction. Balances are multi-version: a single writer applies each
+// group of changes to a version no scan is using and then publishes it, and
+// a scan pins the published version for as long as it runs. Scans always
+// see whole groups, and the writer never waits for them.
+typedef struct {
+    int32_t *accountNumbers;
+    unsigned char *departments;
+    int count;
+    int *positions;             // Column of each data file record, -1 if skipped
+    ColumnChanges batch;        // Changes not published yet
+    BalanceCopy *copies[COLUMN_COPIES]; // Created as scans hold older ones
+    _Atomic int current;        // Copy scans start on
+} AccountColumns;
+
+// Copy every account of the table into columns, as of lsn (returns -1 on
+// error)
+int account_columns_init(AccountColumns *columns, AccountTable *table, uint64_t lsn);
+
+// Change the balance of the account loaded from data file record index, as
+// part of the next group published (writer only)
+void account_columns_change(AccountColumns *columns, int index, int64_t delta);
+
+// Let scans see every change since the last publish, as of lsn
+void account_columns_publish(AccountColumns *columns, uint64_t lsn);
+
+// Compute a department's statistics with the fastest kernel this CPU runs;
+// returns the log position they match
+uint64_t account_columns_stats(AccountColumns *columns, unsigned char departmentNumber, DepartmentStats *stats);
+
+// Compute them with the scalar kernel, to check the others against
+uint64_t account_columns_stats_scalar(AccountColumns *columns, unsigned char departmentNumber, DepartmentStats *stats);
+
+// Name of the kernel account_columns_stats uses ("avx2", "sse4.2" or "scalar")
+const char *account_columns_kernel();
+
+#endif // COLUMNS_H
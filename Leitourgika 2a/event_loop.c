@@ -0,0 +1,472 @@
+// event_loop.c
+#define _GNU_SOURCE // accept4
+#include "event_loop.h"
+#include "protocol.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+
+// Milliseconds connection_send_wait waits for the socket at a time
+#define SEND_WAIT_MS 100
+
+// Received bytes at which a connection is not read further until its
+// requests are handled; the rest waits in the socket
+#define INPUT_HIGH_WATER (1 << 20)
+
+struct Connection {
+    int fd;
+    int epoll_fd;
+    int refs;               // One for the loop, one per request still in progress
+    char *in;               // Bytes received but not yet parsed (loop thread only)
+    size_t in_len;
+    size_t in_cap;
+    pthread_mutex_t mutex;  // Guards everything below
+    int closed;
+    int want_write;         // EPOLLOUT is armed
+    int want_read;          // EPOLLIN is armed
+    int input_held;         // Received requests wait for the output to drain
+    char *out;              // Encoded responses not yet sent
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+};
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    RequestHandler handler;
+} LoopThread;
+
+// Function to count the output queued but not sent yet (caller holds mutex)
+static size_t unsent_output(const Connection *conn) {
+    return conn->out_len - conn->out_off;
+}
+
+// Function to grow a byte buffer to hold at least needed bytes
+static int reserve(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    char *grown = realloc(*buffer, new_capacity);
+    if (!grown) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Function to take a reference on a connection
+void connection_retain(Connection *conn) {
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Function to drop a reference, freeing the connection with the last one
+void connection_release(Connection *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    // The fd is closed only here, so a late reply can never hit a reused fd
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->mutex);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+// Function to send as much pending output as the socket takes (caller holds mutex)
+static int flush_output(Connection *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->out_off += sent;
+    }
+    if (conn->out_off == conn->out_len) {
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+    return 0;
+}
+
+// Function to arm EPOLLIN only while the pending output is below
+// OUTPUT_HIGH_WATER, so a peer that does not read its replies stops having
+// requests read, and EPOLLOUT while there is output pending or requests held
+// back, so the loop resumes them as soon as the output drains, whichever
+// thread drained it (caller holds mutex)
+static void update_interest(Connection *conn) {
+    int want_write = conn->out_len > 0 || conn->input_held;
+    int want_read = unsent_output(conn) < OUTPUT_HIGH_WATER;
+    if (want_write == conn->want_write && want_read == conn->want_read) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLRDHUP | (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == 0) {
+        conn->want_write = want_write;
+        conn->want_read = want_read;
+    }
+}
+
+// Function to check whether more output may be queued, closing the
+// connection for good if not (caller holds mutex)
+static int output_fits(Connection *conn, size_t length) {
+    if (unsent_output(conn) + length <= OUTPUT_LIMIT) {
+        return 1;
+    }
+    fprintf(stderr, "Closing connection with %zu bytes unsent\n", unsent_output(conn));
+    shutdown(conn->fd, SHUT_RDWR);
+    return 0;
+}
+
+// Function to queue a response on a connection
+void connection_reply(Connection *conn, const FrameHeader *message, const FramedResponse *responses, int count) {
+    size_t length = encoded_response_size(message, count);
+
+    pthread_mutex_lock(&conn->mutex);
+    if (conn->closed || !output_fits(conn, length)) {
+        pthread_mutex_unlock(&conn->mutex);
+        return;
+    }
+    if (reserve(&conn->out, &conn->out_cap, conn->out_len + length) < 0) {
+        perror("Unable to queue response");
+        shutdown(conn->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&conn->mutex);
+        return;
+    }
+    conn->out_len += encode_response(message, responses, count, conn->out + conn->out_len);
+
+    if (flush_output(conn) < 0) {
+        // Let the loop thread notice the error and close the connection
+        shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        update_interest(conn);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+// Function to queue an encoded frame on a connection (caller holds mutex,
+// which this releases)
+static int queue_frame(Connection *conn, const void *data, size_t length) {
+    if (conn->closed || !output_fits(conn, length)) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+    if (reserve(&conn->out, &conn->out_cap, conn->out_len + length) < 0) {
+        perror("Unable to queue frame");
+        shutdown(conn->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+    memcpy(conn->out + conn->out_len, data, length);
+    conn->out_len += length;
+
+    if (flush_output(conn) < 0) {
+        shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        update_interest(conn);
+    }
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+// Function to queue an encoded frame on a connection
+int connection_send(Connection *conn, const void *data, size_t length) {
+    pthread_mutex_lock(&conn->mutex);
+    return queue_frame(conn, data, length);
+}
+
+// Function to queue an encoded frame once the peer has caught up
+int connection_send_wait(Connection *conn, const void *data, size_t length) {
+    pthread_mutex_lock(&conn->mutex);
+    while (!conn->closed && unsent_output(conn) >= OUTPUT_HIGH_WATER) {
+        pthread_mutex_unlock(&conn->mutex);
+        struct pollfd writable = { .fd = conn->fd, .events = POLLOUT };
+        poll(&writable, 1, SEND_WAIT_MS);
+        pthread_mutex_lock(&conn->mutex);
+        // Send what the socket takes now rather than wait for the loop thread
+        if (flush_output(conn) < 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
+        }
+        update_interest(conn);
+    }
+    return queue_frame(conn, data, length);
+}
+
+// Function to stop serving a connection (loop thread only)
+static void close_connection(Connection *conn) {
+    pthread_mutex_lock(&conn->mutex);
+    conn->closed = 1;
+    pthread_mutex_unlock(&conn->mutex);
+
+    epoll_ctl(conn->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    shutdown(conn->fd, SHUT_RDWR);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    connection_release(conn);
+}
+
+// Function to accept every pending connection onto this loop
+static void accept_connections(LoopThread *loop) {
+    while (1) {
+        int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept failed");
+            }
+            return;
+        }
+
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            perror("Unable to allocate connection");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->epoll_fd = loop->epoll_fd;
+        conn->refs = 1;
+        conn->want_read = 1;
+        pthread_mutex_init(&conn->mutex, NULL);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl failed");
+            connection_release(conn);
+            continue;
+        }
+        metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    }
+}
+
+static int handle_input(LoopThread *loop, Connection *conn);
+
+// Function to read from a connection and hand every complete request to the
+// handler. Once the peer has hung up its input is read whatever its size, so
+// the hangup is seen.
+static int read_requests(LoopThread *loop, Connection *conn, int hangup) {
+    while (hangup || conn->in_len < INPUT_HIGH_WATER) {
+        if (reserve(&conn->in, &conn->in_cap, conn->in_len + READ_CHUNK) < 0) {
+            return -1;
+        }
+        ssize_t bytes = recv(conn->fd, conn->in + conn->in_len, READ_CHUNK, 0);
+        if (bytes == 0) {
+            return -1;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        conn->in_len += bytes;
+        if ((size_t)bytes < READ_CHUNK) {
+            break;
+        }
+    }
+    return handle_input(loop, conn);
+}
+
+// Function to check whether a connection's peer is reading its replies
+static int output_below_high_water(Connection *conn) {
+    pthread_mutex_lock(&conn->mutex);
+    int below = unsent_output(conn) < OUTPUT_HIGH_WATER;
+    pthread_mutex_unlock(&conn->mutex);
+    return below;
+}
+
+// Function to hand every complete request received to the handler. While the
+// peer lets replies pile up past OUTPUT_HIGH_WATER the rest wait in the
+// buffer, and the loop resumes them once the output drains.
+static int handle_input(LoopThread *loop, Connection *conn) {
+    size_t offset = 0;
+    int held = 0;
+    while (offset < conn->in_len) {
+        if (!output_below_high_water(conn)) {
+            held = 1;
+            break;
+        }
+        FrameHeader message;
+        FramedRequest requests[MAX_BATCH_REQUESTS];
+        int count;
+        int consumed = decode_request(conn->in + offset, conn->in_len - offset, &message, requests, &count);
+        if (consumed < 0) {
+            return -1;
+        }
+        if (consumed == 0) {
+            break;
+        }
+        offset += consumed;
+        metrics_add(METRIC_MESSAGES, 1);
+        if (message.flags & FRAME_BATCH) {
+            metrics_add(METRIC_BATCH_MESSAGES, 1);
+        }
+
+        connection_retain(conn);
+        loop->handler(conn, &message, requests, count);
+        connection_release(conn);
+    }
+
+    // Keep a partial message at the front of the buffer
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+
+    pthread_mutex_lock(&conn->mutex);
+    conn->input_held = held;
+    update_interest(conn);
+    pthread_mutex_unlock(&conn->mutex);
+    return 0;
+}
+
+// Function to run one event loop thread
+static void *loop_thread(void *loop_ptr) {
+    LoopThread *loop = loop_ptr;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            Connection *conn = events[i].data.ptr;
+            if (!conn) {
+                accept_connections(loop);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&conn->mutex);
+                int failed = flush_output(conn) < 0;
+                if (!failed) {
+                    update_interest(conn);
+                }
+                pthread_mutex_unlock(&conn->mutex);
+                // Requests held back while the output was high go on now
+                if (failed || (conn->in_len > 0 && handle_input(loop, conn) < 0)) {
+                    close_connection(conn);
+                    continue;
+                }
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (read_requests(loop, conn, (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) < 0) {
+                    close_connection(conn);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to open a non-blocking listening socket
+int event_loop_listen(int port) {
+    int server_fd;
+    struct sockaddr_in address;
+
+    // Create socket
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    // Allow an immediate restart while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen failed");
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Function to run the event loops on a listening socket
+int event_loop_run(int server_fd, int thread_count, RequestHandler handler) {
+    LoopThread *loops = calloc(thread_count, sizeof(LoopThread));
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    if (!loops || !threads) {
+        perror("Unable to allocate event loops");
+        return -1;
+    }
+
+    for (int i = 0; i < thread_count; ++i) {
+        loops[i].listen_fd = server_fd;
+        loops[i].handler = handler;
+        loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loops[i].epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            return -1;
+        }
+
+        // Every loop waits on the listening socket; EPOLLEXCLUSIVE wakes only one
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+
+        if (pthread_create(&threads[i], NULL, loop_thread, &loops[i]) != 0) {
+            perror("pthread_create failed");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+// event_loop.h
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "bank_system.h"
+#include "protocol.h"
+
+// Default number of threads running the event loop
+#define EVENT_LOOP_THREADS 4
+
+// Unsent output at which a connection's requests stop being read until the
+// peer catches up, and at which connection_send_wait waits
+#define OUTPUT_HIGH_WATER (1 << 20)
+
+// Unsent output at which a connection is closed: a peer this far behind on
+// frames it never asked for (invalidations, changes) is not reading them
+#define OUTPUT_LIMIT (64 << 20)
+
+typedef struct Connection Connection;
+
+// Called on a loop thread for every complete message: one request, or count
+// requests of a batch. The handler answers with one connection_reply holding
+// a response per request, either before returning or later from any thread
+// as long as it holds a reference taken with connection_retain.
+typedef void (*RequestHandler)(Connection *conn, const FrameHeader *message, const FramedRequest *requests, int count);
+
+// Open a non-blocking listening socket on port (returns -1 on error)
+int event_loop_listen(int port);
+
+// Accept connections and serve them from thread_count epoll loops
+// (only returns if the loops cannot be started)
+int event_loop_run(int server_fd, int thread_count, RequestHandler handler);
+
+// Queue the reply to a message and start sending it (thread safe)
+void connection_reply(Connection *conn, const FrameHeader *message, const FramedResponse *responses, int count);
+
+// Queue an already encoded frame the server sends unasked, such as an
+// invalidation (thread safe; returns -1 once the connection is closed, or
+// closes it and returns -1 if the frame would pass OUTPUT_LIMIT)
+int connection_send(Connection *conn, const void *data, size_t length);
+
+// Queue a frame like connection_send, first waiting while the unsent output
+// is above OUTPUT_HIGH_WATER; for threads that stream a lot of frames and
+// may block, never for loop threads
+int connection_send_wait(Connection *conn, const void *data, size_t length);
+
+// Keep a connection alive while a request on it is still being processed
+void connection_retain(Connection *conn);
+void connection_release(Connection *conn);
+
+#endif // EVENT_LOOP_H
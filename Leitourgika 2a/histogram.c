@@ -0,0 +1,104 @@
+// histogram.c
+#include "histogram.h"
+
+// Function to find the bucket a value falls in
+static int bucket_index(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    // Keep the HISTOGRAM_SUB_BUCKET_BITS + 1 highest bits of the value
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+}
+
+// Function to find the highest value that falls in a bucket
+static uint64_t bucket_highest_value(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = index - shift * HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Function to initialize an empty histogram
+void histogram_init(Histogram *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        atomic_init(&histogram->counts[i], 0);
+    }
+    atomic_init(&histogram->count, 0);
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->max, 0);
+}
+
+// Function to record one value
+void histogram_record(Histogram *histogram, uint64_t value) {
+    atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak(&histogram->max, &max, value)) {
+    }
+}
+
+// Function to add the values of one histogram to another
+void histogram_add(Histogram *into, Histogram *from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        uint64_t count = atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+        if (count) {
+            atomic_fetch_add_explicit(&into->counts[i], count, memory_order_relaxed);
+        }
+    }
+    atomic_fetch_add_explicit(&into->count, atomic_load_explicit(&from->count, memory_order_relaxed), memory_order_relaxed);
+    atomic_fetch_add_explicit(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed), memory_order_relaxed);
+
+    uint64_t value = atomic_load_explicit(&from->max, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&into->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak(&into->max, &max, value)) {
+    }
+}
+
+// Function to get the number of values recorded
+uint64_t histogram_count(Histogram *histogram) {
+    return atomic_load(&histogram->count);
+}
+
+// Function to find the value at a percentile
+uint64_t histogram_percentile(Histogram *histogram, double percentile) {
+    uint64_t count = histogram_count(histogram);
+    if (count == 0) {
+        return 0;
+    }
+
+    // Rank of the value, from 1 to count
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+
+    uint64_t seen = 0;
+    uint64_t max = histogram_max(histogram);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += atomic_load(&histogram->counts[i]);
+        if (seen >= rank) {
+            uint64_t value = bucket_highest_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+// Function to get the largest value recorded
+uint64_t histogram_max(Histogram *histogram) {
+    return atomic_load(&histogram->max);
+}
+
+// Function to get the mean of all values
+double histogram_mean(Histogram *histogram) {
+    uint64_t count = histogram_count(histogram);
+    return count ? (double)atomic_load(&histogram->sum) / count : 0.0;
+}
@@ -0,0 +1,43 @@
+// histogram.h
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Log-linear buckets, as in HDR histograms: each power of two is split into
+// HISTOGRAM_SUB_BUCKETS equal buckets, so a recorded value is known to within
+// about 3% whatever its magnitude
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Distribution of non-negative values, recorded from any thread
+typedef struct {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} Histogram;
+
+// Initialize an empty histogram
+void histogram_init(Histogram *histogram);
+
+// Record one value
+void histogram_record(Histogram *histogram, uint64_t value);
+
+// Add every value recorded in from to into
+void histogram_add(Histogram *into, Histogram *from);
+
+// Number of values recorded
+uint64_t histogram_count(Histogram *histogram);
+
+// Value at or below which percentile percent of the values fall (the highest
+// value of its bucket, capped at the maximum; 0 if empty)
+uint64_t histogram_percentile(Histogram *histogram, double percentile);
+
+// Largest value recorded and mean of all values
+uint64_t histogram_max(Histogram *histogram);
+double histogram_mean(Histogram *histogram);
+
+#endif // HISTOGRAM_H
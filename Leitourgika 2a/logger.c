@@ -0,0 +1,237 @@
+// logger.c
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+// Microseconds the flusher sleeps when every ring is empty
+#define LOG_FLUSH_INTERVAL_US 10000
+
+// One queued message, formatted by the thread that logged it
+typedef struct {
+    struct timespec time;
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+// Single-producer single-consumer ring owned by one thread. The owner only
+// advances head and the flusher only advances tail, so neither side locks.
+typedef struct LogRing {
+    LogEntry entries[LOG_RING_ENTRIES];
+    _Atomic unsigned long head;     // Next entry the owner writes
+    _Atomic unsigned long tail;     // Next entry the flusher reads
+    _Atomic unsigned long dropped;  // Messages lost because the ring was full
+    _Atomic int abandoned;          // Owner exited; another thread may adopt it
+    int id;                         // Shown in each line to tell threads apart
+    struct LogRing *next;
+} LogRing;
+
+_Atomic int log_level = LOG_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+// Every ring ever created; rings are only added, never removed
+static _Atomic(LogRing *) rings = NULL;
+static _Atomic int ring_count = 0;
+
+// Serializes the flusher thread with log_flush() callers (consumers only)
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread LogRing *current_ring = NULL;
+static pthread_key_t ring_key;
+
+// Function run when a thread with a ring exits
+static void release_ring(void *ring_ptr) {
+    LogRing *ring = ring_ptr;
+    atomic_store(&ring->abandoned, 1);
+}
+
+// Function to find or create the calling thread's ring
+static LogRing *thread_ring() {
+    if (current_ring) {
+        return current_ring;
+    }
+
+    // Adopt the ring of a thread that has exited before allocating a new one
+    for (LogRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        int expected = 1;
+        if (atomic_load(&ring->abandoned) && atomic_compare_exchange_strong(&ring->abandoned, &expected, 0)) {
+            current_ring = ring;
+            pthread_setspecific(ring_key, ring);
+            return ring;
+        }
+    }
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+    ring->id = atomic_fetch_add(&ring_count, 1);
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+
+    current_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+// Function to queue a message
+void log_write(int level, const char *format, ...) {
+    LogRing *ring = thread_ring();
+    if (!ring) {
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_ENTRIES) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogEntry *entry = &ring->entries[head % LOG_RING_ENTRIES];
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->message, sizeof(entry->message), format, args);
+    va_end(args);
+
+    // Publish the entry to the flusher
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Function to write out every queued message (caller holds drain_mutex);
+// returns the number of messages written
+static int drain_rings() {
+    static char buffer[64 * 1024];
+    size_t length = 0;
+    int written = 0;
+
+    for (LogRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            length += snprintf(buffer + length, sizeof(buffer) - length,
+                               "WARN  [T%02d] %lu log messages dropped\n", ring->id, dropped);
+        }
+
+        for (; tail != head; ++tail) {
+            // Keep room for one whole line
+            if (sizeof(buffer) - length < LOG_MESSAGE_SIZE + 64) {
+                fwrite(buffer, 1, length, stdout);
+                length = 0;
+            }
+
+            LogEntry *entry = &ring->entries[tail % LOG_RING_ENTRIES];
+            struct tm local;
+            localtime_r(&entry->time.tv_sec, &local);
+            length += strftime(buffer + length, sizeof(buffer) - length, "%H:%M:%S", &local);
+            length += snprintf(buffer + length, sizeof(buffer) - length, ".%06ld %-5s [T%02d] %s\n",
+                               entry->time.tv_nsec / 1000, level_names[entry->level], ring->id, entry->message);
+            written++;
+        }
+
+        // Hand the entries back to the owner
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    if (length > 0) {
+        fwrite(buffer, 1, length, stdout);
+    }
+    if (written > 0) {
+        fflush(stdout);
+    }
+    return written;
+}
+
+// Function run by the flusher thread
+static void *log_flusher(void *arg) {
+    (void)arg;
+    struct timespec pause = {0, LOG_FLUSH_INTERVAL_US * 1000};
+
+    while (1) {
+        pthread_mutex_lock(&drain_mutex);
+        int written = drain_rings();
+        pthread_mutex_unlock(&drain_mutex);
+
+        // Batch up messages while the rings are quiet
+        if (written == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Signal handlers to change the level without a restart (atomics only)
+static void raise_level(int signal_number) {
+    (void)signal_number;
+    int level = atomic_load(&log_level);
+    if (level < LOG_TRACE) {
+        atomic_store(&log_level, level + 1);
+    }
+}
+
+static void lower_level(int signal_number) {
+    (void)signal_number;
+    int level = atomic_load(&log_level);
+    if (level > LOG_ERROR) {
+        atomic_store(&log_level, level - 1);
+    }
+}
+
+// Function to start the logger
+int log_init(int level) {
+    log_set_level(level);
+
+    if (pthread_key_create(&ring_key, release_ring) != 0) {
+        perror("pthread_key_create failed");
+        return -1;
+    }
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, log_flusher, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(flusher);
+
+    signal(SIGUSR1, raise_level);
+    signal(SIGUSR2, lower_level);
+    atexit(log_flush);
+    return 0;
+}
+
+// Function to parse a level name or number
+int log_parse_level(const char *name) {
+    for (int i = LOG_ERROR; i <= LOG_TRACE; ++i) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    char *end;
+    long level = strtol(name, &end, 10);
+    if (*name == '\0' || *end != '\0' || level < LOG_ERROR || level > LOG_TRACE) {
+        return -1;
+    }
+    return (int)level;
+}
+
+// Function to change the level
+void log_set_level(int level) {
+    atomic_store(&log_level, level);
+}
+
+// Function to write out everything queued so far
+void log_flush() {
+    pthread_mutex_lock(&drain_mutex);
+    drain_rings();
+    pthread_mutex_unlock(&drain_mutex);
+}
@@ -0,0 +1,48 @@
+// logger.h
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdatomic.h>
+
+// Log levels, from always shown to most verbose
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4     // Every account lock and unlock
+
+// Messages longer than this are truncated
+#define LOG_MESSAGE_SIZE 128
+
+// Messages each thread can have waiting for the flusher before new ones are dropped
+#define LOG_RING_ENTRIES 1024
+
+// Most verbose level currently written; may be changed at any time
+extern _Atomic int log_level;
+
+// Log a message if level is enabled. A disabled message costs one relaxed
+// load and a branch: its arguments are not even evaluated.
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+// Start the flusher thread; SIGUSR1 / SIGUSR2 raise / lower the level at
+// run time (returns -1 on error)
+int log_init(int level);
+
+// Parse a level name ("error" ... "trace") or number (returns -1 if invalid)
+int log_parse_level(const char *name);
+
+// Change the level
+void log_set_level(int level);
+
+// Queue a message on the calling thread's ring without taking any lock
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Write out everything queued so far
+void log_flush();
+
+#endif // LOGGER_H
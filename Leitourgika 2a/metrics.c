@@ -0,0 +1,437 @@
+// metrics.c
+#define _GNU_SOURCE // open_memstream
+#include "metrics.h"
+#include "bank_system.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Percentiles each latency summary shows
+#define METRICS_QUANTILES 4
+static const double quantiles[METRICS_QUANTILES] = {0.5, 0.9, 0.99, 0.999};
+
+static const char *query_kind_names[METRICS_QUERY_KINDS] = {"other", "display", "update", "transfer", "average", "subscribe", "replicate",
+                                                            "multi_transfer", "stats"};
+
+static const char *server_name = "";
+static int lock_count;
+
+// Every thread's shard; shards are never freed, so the counts of threads
+// that exited stay in the totals
+static MetricsShard *shards;
+static int shard_count;
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread MetricsShard *thread_shard;
+
+static MetricsWriter admin_writer;
+static int admin_fd = -1;
+
+// Paths answered by a command rather than the metrics
+static struct {
+    const char *path;
+    AdminCommand command;
+} admin_commands[METRICS_MAX_COMMANDS];
+static int admin_command_count;
+
+// Function to prepare the metrics of a server
+int metrics_init(const char *name, int locks) {
+    server_name = name;
+    lock_count = locks;
+    // Create the main thread's shard now, so an allocation failure shows up here
+    return metrics_shard() ? 0 : -1;
+}
+
+// Function to get the calling thread's shard, creating it on first use
+MetricsShard *metrics_shard() {
+    if (thread_shard) {
+        return thread_shard;
+    }
+
+    MetricsShard *shard = calloc(1, sizeof(MetricsShard));
+    if (shard && lock_count > 0) {
+        shard->lock_waits = calloc(lock_count, sizeof(uint64_t));
+        shard->lock_wait_ns = calloc(lock_count, sizeof(uint64_t));
+    }
+    if (!shard || (lock_count > 0 && (!shard->lock_waits || !shard->lock_wait_ns))) {
+        // Without memory for a shard, count nothing rather than fail requests
+        static MetricsShard discarded;
+        perror("Unable to allocate metrics");
+        return &discarded;
+    }
+    for (int kind = 0; kind < METRICS_QUERY_KINDS; ++kind) {
+        histogram_init(&shard->latencies[kind]);
+    }
+
+    pthread_mutex_lock(&shard_mutex);
+    shard->next = shards;
+    shards = shard;
+    shard_count++;
+    pthread_mutex_unlock(&shard_mutex);
+
+    thread_shard = shard;
+    return shard;
+}
+
+// Function to add to a counter only the calling thread writes
+static void shard_add(_Atomic uint64_t *slot, uint64_t value) {
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Function to count one answered request and its latency
+void metrics_record_request(int queryType, int status, int error, uint64_t latency_ns) {
+    MetricsShard *shard = metrics_shard();
+    int kind = queryType >= QUERY_DISPLAY && queryType < QUERY_DISPLAY + METRICS_QUERY_KINDS - 1 ? queryType : 0;
+
+    if (status == STATUS_SUCCESS) {
+        shard_add(&shard->requests[kind][0], 1);
+    } else {
+        shard_add(&shard->requests[kind][1], 1);
+        shard_add(&shard->errors[error >= 0 && error < METRICS_ERROR_CODES ? error : METRICS_ERROR_CODES - 1], 1);
+    }
+    histogram_record(&shard->latencies[kind], latency_ns);
+}
+
+// Function to count one lock acquisition and its wait
+void metrics_record_lock(int lock, uint64_t wait_ns) {
+    MetricsShard *shard = metrics_shard();
+    shard_add(&shard->counters[METRIC_LOCK_ACQUIRES], 1);
+    if (wait_ns == 0) {
+        return;
+    }
+    shard_add(&shard->counters[METRIC_LOCK_WAITS], 1);
+    shard_add(&shard->counters[METRIC_LOCK_WAIT_NS], wait_ns);
+    if (lock >= 0 && lock < lock_count && shard->lock_waits) {
+        shard_add(&shard->lock_waits[lock], 1);
+        shard_add(&shard->lock_wait_ns[lock], wait_ns);
+    }
+}
+
+// Function to read a monotonic clock in nanoseconds
+uint64_t metrics_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Function to write the header of one metric
+static void write_metric_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Function to write one counter or gauge without labels
+static void write_value(FILE *out, const char *name, const char *type, const char *help, double value) {
+    write_metric_header(out, name, type, help);
+    fprintf(out, "%s %.17g\n", name, value);
+}
+
+// Function to write the stripes waited on longest
+static void write_top_locks(FILE *out, const uint64_t *waits, const uint64_t *wait_ns) {
+    int top[METRICS_TOP_LOCKS];
+    int top_count = 0;
+
+    // Insertion into a short list kept sorted, longest total wait first
+    for (int lock = 0; lock < lock_count; ++lock) {
+        if (wait_ns[lock] == 0) {
+            continue;
+        }
+        int position;
+        if (top_count < METRICS_TOP_LOCKS) {
+            position = top_count++;
+        } else if (wait_ns[lock] > wait_ns[top[METRICS_TOP_LOCKS - 1]]) {
+            position = METRICS_TOP_LOCKS - 1;
+        } else {
+            continue;
+        }
+        while (position > 0 && wait_ns[top[position - 1]] < wait_ns[lock]) {
+            top[position] = top[position - 1];
+            position--;
+        }
+        top[position] = lock;
+    }
+
+    write_metric_header(out, "bank_lock_stripe_wait_seconds_total", "counter",
+                        "Time spent waiting for the account lock stripes waited on longest");
+    for (int i = 0; i < top_count; ++i) {
+        fprintf(out, "bank_lock_stripe_wait_seconds_total{stripe=\"%d\"} %.9f\n", top[i], wait_ns[top[i]] / 1e9);
+    }
+    write_metric_header(out, "bank_lock_stripe_waits_total", "counter",
+                        "Contended acquisitions of the account lock stripes waited on longest");
+    for (int i = 0; i < top_count; ++i) {
+        fprintf(out, "bank_lock_stripe_waits_total{stripe=\"%d\"} %llu\n", top[i], (unsigned long long)waits[top[i]]);
+    }
+}
+
+// Function to write a snapshot of every thread's metrics
+void metrics_write(FILE *out) {
+    uint64_t counters[METRIC_COUNTERS] = {0};
+    uint64_t requests[METRICS_QUERY_KINDS][2] = {{0}};
+    uint64_t errors[METRICS_ERROR_CODES] = {0};
+    Histogram *latencies = malloc(METRICS_QUERY_KINDS * sizeof(Histogram));
+    uint64_t *lock_waits = calloc(lock_count + 1, sizeof(uint64_t));
+    uint64_t *lock_wait_ns = calloc(lock_count + 1, sizeof(uint64_t));
+    if (!latencies || !lock_waits || !lock_wait_ns) {
+        free(latencies);
+        free(lock_waits);
+        free(lock_wait_ns);
+        fprintf(out, "# Out of memory\n");
+        return;
+    }
+    for (int kind = 0; kind < METRICS_QUERY_KINDS; ++kind) {
+        histogram_init(&latencies[kind]);
+    }
+
+    // Shards are only added at the head, so the list can be walked from a
+    // copy of the head while threads keep recording
+    pthread_mutex_lock(&shard_mutex);
+    MetricsShard *head = shards;
+    int threads = shard_count;
+    pthread_mutex_unlock(&shard_mutex);
+
+    for (MetricsShard *shard = head; shard; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTERS; ++i) {
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int kind = 0; kind < METRICS_QUERY_KINDS; ++kind) {
+            requests[kind][0] += atomic_load_explicit(&shard->requests[kind][0], memory_order_relaxed);
+            requests[kind][1] += atomic_load_explicit(&shard->requests[kind][1], memory_order_relaxed);
+            histogram_add(&latencies[kind], &shard->latencies[kind]);
+        }
+        for (int i = 0; i < METRICS_ERROR_CODES; ++i) {
+            errors[i] += atomic_load_explicit(&shard->errors[i], memory_order_relaxed);
+        }
+        for (int lock = 0; lock < lock_count && shard->lock_waits; ++lock) {
+            lock_waits[lock] += atomic_load_explicit(&shard->lock_waits[lock], memory_order_relaxed);
+            lock_wait_ns[lock] += atomic_load_explicit(&shard->lock_wait_ns[lock], memory_order_relaxed);
+        }
+    }
+
+    write_metric_header(out, "bank_server_info", "gauge", "Kind of server");
+    fprintf(out, "bank_server_info{server=\"%s\"} 1\n", server_name);
+
+    write_metric_header(out, "bank_requests_total", "counter", "Requests answered by query type and result");
+    for (int kind = 0; kind < METRICS_QUERY_KINDS; ++kind) {
+        for (int result = 0; result < 2; ++result) {
+            if (requests[kind][result]) {
+                fprintf(out, "bank_requests_total{query=\"%s\",result=\"%s\"} %llu\n", query_kind_names[kind],
+                        result ? "error" : "success", (unsigned long long)requests[kind][result]);
+            }
+        }
+    }
+
+    write_metric_header(out, "bank_request_errors_total", "counter", "Failed requests by ERROR_* code");
+    for (int i = 0; i < METRICS_ERROR_CODES; ++i) {
+        if (errors[i]) {
+            fprintf(out, "bank_request_errors_total{code=\"%d\"} %llu\n", i, (unsigned long long)errors[i]);
+        }
+    }
+
+    write_metric_header(out, "bank_request_latency_seconds", "summary", "Time from receiving a request to queueing its reply");
+    for (int kind = 0; kind < METRICS_QUERY_KINDS; ++kind) {
+        Histogram *histogram = &latencies[kind];
+        uint64_t count = histogram_count(histogram);
+        if (count == 0) {
+            continue;
+        }
+        for (int q = 0; q < METRICS_QUANTILES; ++q) {
+            fprintf(out, "bank_request_latency_seconds{query=\"%s\",quantile=\"%g\"} %.9f\n", query_kind_names[kind],
+                    quantiles[q], histogram_percentile(histogram, quantiles[q] * 100.0) / 1e9);
+        }
+        fprintf(out, "bank_request_latency_seconds_sum{query=\"%s\"} %.9f\n", query_kind_names[kind],
+                histogram_mean(histogram) * count / 1e9);
+        fprintf(out, "bank_request_latency_seconds_count{query=\"%s\"} %llu\n", query_kind_names[kind], (unsigned long long)count);
+    }
+
+    write_value(out, "bank_messages_total", "counter", "Messages received, each one request or a batch",
+                counters[METRIC_MESSAGES]);
+    write_value(out, "bank_batch_messages_total", "counter", "Batch messages received",
+                counters[METRIC_BATCH_MESSAGES]);
+    write_value(out, "bank_connections_opened_total", "counter", "Client connections accepted",
+                counters[METRIC_CONNECTIONS_OPENED]);
+    write_value(out, "bank_connections_open", "gauge", "Client connections currently open",
+                (double)(counters[METRIC_CONNECTIONS_OPENED] - counters[METRIC_CONNECTIONS_CLOSED]));
+    write_value(out, "bank_forwards_total", "counter", "Groups of requests forwarded to central",
+                counters[METRIC_FORWARDS]);
+    write_value(out, "bank_forwarded_requests_total", "counter", "Requests forwarded to central",
+                counters[METRIC_FORWARDED_REQUESTS]);
+    write_value(out, "bank_forward_retries_total", "counter", "Forward attempts repeated on another connection",
+                counters[METRIC_FORWARD_RETRIES]);
+    write_value(out, "bank_forward_failures_total", "counter", "Forwarded requests central never answered",
+                counters[METRIC_FORWARD_FAILURES]);
+    write_value(out, "bank_central_messages_total", "counter", "Messages written to central for forwards",
+                counters[METRIC_CENTRAL_MESSAGES]);
+    write_value(out, "bank_version_conflicts_total", "counter", "Updates and transfers rejected because an account had changed",
+                counters[METRIC_VERSION_CONFLICTS]);
+
+    if (lock_count > 0) {
+        write_value(out, "bank_lock_acquires_total", "counter", "Account lock acquisitions",
+                    counters[METRIC_LOCK_ACQUIRES]);
+        write_value(out, "bank_lock_waits_total", "counter", "Account lock acquisitions that had to wait",
+                    counters[METRIC_LOCK_WAITS]);
+        write_value(out, "bank_lock_wait_seconds_total", "counter", "Time spent waiting for account locks",
+                    counters[METRIC_LOCK_WAIT_NS] / 1e9);
+        write_top_locks(out, lock_waits, lock_wait_ns);
+    }
+
+    write_value(out, "bank_metric_threads", "gauge", "Threads that have recorded metrics", threads);
+
+    free(latencies);
+    free(lock_waits);
+    free(lock_wait_ns);
+}
+
+// Function to register an admin command
+int metrics_add_command(const char *path, AdminCommand command) {
+    if (admin_command_count == METRICS_MAX_COMMANDS) {
+        return -1;
+    }
+    admin_commands[admin_command_count].path = path;
+    admin_commands[admin_command_count].command = command;
+    admin_command_count++;
+    return 0;
+}
+
+// Function to find the command for the path of an HTTP request line
+static AdminCommand find_command(const char *request) {
+    // "METHOD /path[?query] HTTP/1.x"
+    const char *path = strchr(request, ' ');
+    if (!path) {
+        return NULL;
+    }
+    path++;
+    size_t length = strcspn(path, " ?\r\n");
+    for (int i = 0; i < admin_command_count; ++i) {
+        if (strlen(admin_commands[i].path) == length && strncmp(admin_commands[i].path, path, length) == 0) {
+            return admin_commands[i].command;
+        }
+    }
+    return NULL;
+}
+
+// Function to answer one admin request with a snapshot or a command's reply
+static void serve_admin_request(int fd) {
+    // Only the request line matters, but read the whole request (for at
+    // most a second) so closing does not reset the connection
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[4096];
+    size_t length = 0;
+    request[0] = '\0';
+    while (length < sizeof(request) - 1) {
+        ssize_t bytes = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        length += bytes;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+
+    char *body = NULL;
+    size_t body_length = 0;
+    FILE *out = open_memstream(&body, &body_length);
+    if (!out) {
+        return;
+    }
+    // Commands change state, so a plain GET (a crawler, a misdirected
+    // scraper) only ever reads the metrics
+    AdminCommand command = find_command(request);
+    const char *method = command ? "POST " : "GET ";
+    const char *status = "200 OK";
+    if (strncmp(request, method, strlen(method)) != 0) {
+        status = "405 Method Not Allowed";
+        fprintf(out, "Only %.*s is allowed here\n", (int)strlen(method) - 1, method);
+    } else if (command) {
+        if (command(out) < 0) {
+            status = "500 Internal Server Error";
+        }
+    } else {
+        metrics_write(out);
+        if (admin_writer) {
+            admin_writer(out);
+        }
+    }
+    fclose(out);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %s\r\nAllow: %.*s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                 status, (int)strlen(method) - 1, method, body_length);
+    if (send(fd, header, header_length, MSG_NOSIGNAL) == header_length) {
+        size_t sent = 0;
+        while (sent < body_length) {
+            ssize_t bytes = send(fd, body + sent, body_length - sent, MSG_NOSIGNAL);
+            if (bytes <= 0) {
+                break;
+            }
+            sent += bytes;
+        }
+    }
+    free(body);
+}
+
+// Function to serve admin connections one at a time
+static void *admin_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("Admin accept failed");
+            continue;
+        }
+        serve_admin_request(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Function to open the admin port and start serving snapshots
+int metrics_start_admin(const char *address_text, int port, MetricsWriter writer) {
+    struct sockaddr_in address;
+
+    admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd < 0) {
+        perror("Admin socket failed");
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, address_text, &address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid admin address %s\n", address_text);
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+
+    if (bind(admin_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(admin_fd, 16) < 0) {
+        perror("Admin bind failed");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+
+    admin_writer = writer;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, NULL) != 0) {
+        perror("pthread_create failed");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    LOG(LOG_INFO, "Metrics served on admin port %s:%d", address_text, port);
+    return 0;
+}
@@ -0,0 +1,100 @@
+// metrics.h
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "histogram.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Admin (metrics) port of a server: its service port plus this offset
+#define ADMIN_PORT_OFFSET 500
+
+// Address the admin port listens on unless told otherwise: it is not
+// authenticated, so only local clients reach it by default
+#define ADMIN_ADDRESS "127.0.0.1"
+
+// Requests are counted per QUERY_* type; kind 0 holds any other type
+#define METRICS_QUERY_KINDS 9
+
+// Number of ERROR_* codes counted on their own, ERROR_NONE (0) up to
+// ERROR_REQUEST_BUSY (18); any higher code shares the last slot
+#define METRICS_ERROR_CODES 19
+
+// Lock stripes listed by name in a snapshot, the ones waited on longest
+#define METRICS_TOP_LOCKS 10
+
+// Plain counters every thread keeps
+#define METRIC_MESSAGES 0           // Messages received (one request or a batch)
+#define METRIC_BATCH_MESSAGES 1
+#define METRIC_CONNECTIONS_OPENED 2
+#define METRIC_CONNECTIONS_CLOSED 3
+#define METRIC_FORWARDS 4           // Groups of requests forwarded to central
+#define METRIC_FORWARDED_REQUESTS 5
+#define METRIC_FORWARD_RETRIES 6    // Attempts after the first on another connection
+#define METRIC_FORWARD_FAILURES 7   // Forwarded requests central never answered
+#define METRIC_CENTRAL_MESSAGES 8   // Frames written to central for those forwards
+#define METRIC_LOCK_ACQUIRES 9
+#define METRIC_LOCK_WAITS 10        // Acquisitions that found the lock held
+#define METRIC_LOCK_WAIT_NS 11
+#define METRIC_VERSION_CONFLICTS 12 // Updates and transfers rejected for a changed account
+#define METRIC_COUNTERS 13
+
+// Counters and latencies of one thread. Only the owning thread writes them,
+// so recording never contends with other threads; a snapshot sums every
+// thread's shard with relaxed loads.
+typedef struct MetricsShard {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic uint64_t requests[METRICS_QUERY_KINDS][2];   // [kind][0 = success, 1 = error]
+    _Atomic uint64_t errors[METRICS_ERROR_CODES];
+    Histogram latencies[METRICS_QUERY_KINDS];            // Nanoseconds from receipt to reply
+    _Atomic uint64_t *lock_waits;                        // Per lock, lock_count of each
+    _Atomic uint64_t *lock_wait_ns;
+    struct MetricsShard *next;
+} MetricsShard;
+
+// Server specific lines appended to every snapshot
+typedef void (*MetricsWriter)(FILE *out);
+
+// Action run for an admin request to its path instead of the snapshot; it
+// writes its reply text to out (returns -1 if the action failed)
+typedef int (*AdminCommand)(FILE *out);
+
+// Most admin commands a server can register
+#define METRICS_MAX_COMMANDS 8
+
+// Prepare the metrics of a server named name ("central", "branch") with
+// lock_count instrumented locks (returns -1 on error)
+int metrics_init(const char *name, int lock_count);
+
+// The calling thread's shard, created on first use
+MetricsShard *metrics_shard();
+
+// Add value to one of the calling thread's counters
+static inline void metrics_add(int counter, uint64_t value) {
+    _Atomic uint64_t *slot = &metrics_shard()->counters[counter];
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Count one answered request and how long it took to answer
+void metrics_record_request(int queryType, int status, int error, uint64_t latency_ns);
+
+// Count one acquisition of lock, which waited wait_ns first (0 = uncontended)
+void metrics_record_lock(int lock, uint64_t wait_ns);
+
+// Write a Prometheus text format snapshot of every thread's metrics
+void metrics_write(FILE *out);
+
+// Serve snapshots over HTTP on address:port from a background thread, with
+// writer's lines appended (returns -1 if the port cannot be opened)
+int metrics_start_admin(const char *address, int port, MetricsWriter writer);
+
+// Run command for POST requests to path, such as "/snapshot"; GET requests to
+// any other path get the metrics, and every other request is refused
+// (returns -1 if too many commands are registered)
+int metrics_add_command(const char *path, AdminCommand command);
+
+// Read a monotonic clock in nanoseconds
+uint64_t metrics_now_ns();
+
+#endif // METRICS_H
@@ -0,0 +1,36 @@
+// ownership.c
+#include "ownership.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Function to allocate an empty map
+int ownership_init(OwnershipMap *map, int capacity) {
+    int word_count = (capacity + 63) / 64;
+    map->words = malloc(word_count * sizeof(*map->words));
+    if (!map->words) {
+        perror("Unable to allocate ownership map");
+        return -1;
+    }
+    for (int i = 0; i < word_count; ++i) {
+        atomic_init(&map->words[i], 0);
+    }
+    map->capacity = capacity;
+    return 0;
+}
+
+// Function to record that the branch holds an account
+void ownership_add(OwnershipMap *map, int accountNumber) {
+    if (accountNumber < 0 || accountNumber >= map->capacity) {
+        return;
+    }
+    atomic_fetch_or(&map->words[accountNumber / 64], (uint64_t)1 << (accountNumber % 64));
+}
+
+// Function to check whether the branch holds an account
+int ownership_owns(OwnershipMap *map, int accountNumber) {
+    if (accountNumber < 0 || accountNumber >= map->capacity) {
+        return 0;
+    }
+    uint64_t word = atomic_load_explicit(&map->words[accountNumber / 64], memory_order_acquire);
+    return (word >> (accountNumber % 64)) & 1;
+}
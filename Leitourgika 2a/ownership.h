@@ -0,0 +1,26 @@
+// ownership.h
+#ifndef OWNERSHIP_H
+#define OWNERSHIP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Which accounts a branch holds in branch_accounts.dat, one bit per account
+// number, so routing never has to scan the file. Bits are only ever set, with
+// atomic operations, so lookups need no lock.
+typedef struct {
+    _Atomic uint64_t *words;
+    int capacity;           // Account numbers 0 .. capacity - 1 fit
+} OwnershipMap;
+
+// Allocate an empty map for account numbers below capacity (returns -1 on error)
+int ownership_init(OwnershipMap *map, int capacity);
+
+// Record that the branch holds an account (numbers that do not fit are not
+// recorded, so the branch leaves them to central)
+void ownership_add(OwnershipMap *map, int accountNumber);
+
+// Check whether the branch holds an account
+int ownership_owns(OwnershipMap *map, int accountNumber);
+
+#endif // OWNERSHIP_H
@@ -1,111 +1,611 @@
 // process_load.c
 #include "bank_system.h"
+#include "protocol.h"
+#include "histogram.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 
-// Function to handle each request
-void *handle_request(void *arg) {
-    Request *request = (Request *)arg;
-    Response response;
-    memset(&response, 0, sizeof(Response));
+// Identity used to frame this process's requests
+uint32_t load_client_id;
 
-    int sockfd;
-    struct sockaddr_in servaddr;
+// Requests sent per message (1 = one framed Request per message)
+int batch_size = 1;
 
-    // Determine the server to connect to
-    int departmentNumber = request->departmentNumber;
+// Persistent connections kept open to each server, and messages each one
+// keeps in flight
+#define DEFAULT_CONNECTIONS 4
+#define MAX_CONNECTIONS 64
+#define DEFAULT_DEPTH 8
+#define MAX_DEPTH 256
+int connections_per_server = DEFAULT_CONNECTIONS;
+int depth = DEFAULT_DEPTH;
+
+// Latencies are recorded per query type (the last kind is any other type)
+// and per result
+#define QUERY_KINDS 5
+#define RESULT_SUCCESS 0
+#define RESULT_ERROR 1
+
+const char *query_kind_names[QUERY_KINDS] = {"display", "update", "transfer", "average", "other"};
+const char *result_names[2] = {"success", "error"};
+
+// Nanoseconds from sending each request's message to reading its reply
+Histogram latencies[QUERY_KINDS][2];
+
+// Requests that got no response at all
+uint64_t failed_requests;
+
+// Servers a load file can address: central, then branches 1 and 2
+#define SERVER_COUNT 3
+
+// Consecutive requests of the load file for the same server, sent as one
+// message. Request i of the file is sent with request id i + 1.
+typedef struct {
+    int first;
+    int count;
+} LoadMessage;
+
+// Messages for one server in file order; next is the first one not yet sent
+typedef struct {
     int port;
+    LoadMessage *messages;
+    int count;
+    int next;
+    int live_connections;
+} ServerQueue;
+
+// A message sent on a connection and not yet answered
+typedef struct {
+    uint64_t requestId;      // Id of its first request, which its reply carries
+    LoadMessage *message;
+    uint64_t sent_at;
+} InFlight;
+
+// A persistent non-blocking connection to one server
+typedef struct {
+    int fd;
+    ServerQueue *server;
+    char *out;               // Encoded messages not yet written
+    size_t out_len;
+    size_t out_off;
+    char in[2 * MAX_RESPONSE_MESSAGE_SIZE];
+    size_t in_len;
+    InFlight *in_flight;
+    int in_flight_count;
+    int want_write;          // EPOLLOUT is armed
+} LoadConnection;
+
+// The whole load file and the messages still unanswered
+Request *load_requests;
+int load_request_count;
+ServerQueue servers[SERVER_COUNT];
+int outstanding_messages;
+
+// Function to determine the server a request goes to
+int request_port(const Request *request) {
+    int departmentNumber = request->departmentNumber;
     if (departmentNumber == 1 || departmentNumber == 2) {
-        port = BRANCH_PORT_BASE + departmentNumber;
-    } else {
-        // For queries that don't target a specific department (e.g., transfers), connect to central
-        port = CENTRAL_PORT;
+        return BRANCH_PORT_BASE + departmentNumber;
     }
+    // For queries that don't target a specific department (e.g., transfers), connect to central
+    return CENTRAL_PORT;
+}
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+// Function to map a server port to its queue
+ServerQueue *request_server(const Request *request) {
+    int port = request_port(request);
+    return &servers[port == CENTRAL_PORT ? 0 : port - BRANCH_PORT_BASE];
+}
+
+// Function to map a query type to its latency histograms
+int query_kind(int queryType) {
+    return queryType >= QUERY_DISPLAY && queryType <= QUERY_AVERAGE ? queryType - QUERY_DISPLAY : QUERY_KINDS - 1;
+}
+
+// Function to read a monotonic clock in nanoseconds
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Function to read the load file and split it into messages per server
+void read_load_file(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Unable to open load file");
+        exit(EXIT_FAILURE);
+    }
+    if (fseek(file, 0, SEEK_END) != 0) {
+        perror("Unable to read load file");
+        exit(EXIT_FAILURE);
+    }
+    long size = ftell(file);
+    rewind(file);
+
+    load_request_count = size / sizeof(Request);
+    load_requests = malloc((load_request_count ? load_request_count : 1) * sizeof(Request));
+    if (!load_requests) {
+        perror("Unable to allocate load requests");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(load_requests, sizeof(Request), load_request_count, file) != (size_t)load_request_count) {
+        perror("Unable to read load file");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    servers[0].port = CENTRAL_PORT;
+    servers[1].port = BRANCH_PORT_BASE + 1;
+    servers[2].port = BRANCH_PORT_BASE + 2;
+    for (int s = 0; s < SERVER_COUNT; ++s) {
+        // No server gets more messages than the file has requests
+        servers[s].messages = malloc((load_request_count ? load_request_count : 1) * sizeof(LoadMessage));
+        if (!servers[s].messages) {
+            perror("Unable to allocate load messages");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A message ends once it is full or the next request goes to another server
+    LoadMessage *message = NULL;
+    ServerQueue *previous = NULL;
+    for (int i = 0; i < load_request_count; ++i) {
+        ServerQueue *server = request_server(&load_requests[i]);
+        if (!message || server != previous || message->count == batch_size) {
+            message = &server->messages[server->count++];
+            message->first = i;
+            message->count = 0;
+            outstanding_messages++;
+        }
+        message->count++;
+        previous = server;
+    }
+}
+
+// Function to count requests that will never get a response
+void fail_message(const LoadMessage *message) {
+    failed_requests += message->count;
+    outstanding_messages--;
+}
+
+// Function to fail the messages of a server no connection is left for
+void fail_server(ServerQueue *server) {
+    while (server->next < server->count) {
+        fail_message(&server->messages[server->next++]);
+    }
+}
+
+// Function to open a non-blocking connection to a server (returns -1 on error)
+int open_connection(LoadConnection *conn, ServerQueue *server, int epoll_fd) {
+    struct sockaddr_in servaddr;
+    memset(conn, 0, sizeof(LoadConnection));
+    conn->fd = -1;
+    conn->server = server;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
         perror("Socket creation failed");
-        pthread_exit(NULL);
+        return -1;
     }
 
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
+    servaddr.sin_port = htons(server->port);
     servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
-    // Connect to server
+    // Connect while still blocking, so a refused connection shows up here
     if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
         perror("Connection failed");
         close(sockfd);
-        pthread_exit(NULL);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    conn->out = malloc(depth * MAX_REQUEST_MESSAGE_SIZE);
+    conn->in_flight = malloc(depth * sizeof(InFlight));
+    if (!conn->out || !conn->in_flight) {
+        perror("Unable to allocate connection buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event) < 0) {
+        perror("epoll_ctl failed");
+        close(sockfd);
+        return -1;
+    }
+    conn->fd = sockfd;
+    server->live_connections++;
+    return 0;
+}
+
+// Function to close a broken connection and fail what it had in flight
+void close_connection(LoadConnection *conn) {
+    if (conn->fd < 0) {
+        return;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    for (int i = 0; i < conn->in_flight_count; ++i) {
+        fail_message(conn->in_flight[i].message);
+    }
+    conn->in_flight_count = 0;
+    if (--conn->server->live_connections == 0) {
+        fail_server(conn->server);
     }
+}
+
+// Function to queue the server's next messages until depth are in flight
+void fill_connection(LoadConnection *conn) {
+    ServerQueue *server = conn->server;
 
-    // Send request
-    send(sockfd, request, sizeof(Request), 0);
+    // Drop what was written so new messages fit behind the rest
+    memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+    conn->out_len -= conn->out_off;
+    conn->out_off = 0;
 
-    // Receive response
-    recv(sockfd, &response, sizeof(Response), 0);
+    while (conn->in_flight_count < depth && server->next < server->count) {
+        LoadMessage *message = &server->messages[server->next++];
+        uint64_t firstId = (uint64_t)message->first + 1;
+        const Request *requests = &load_requests[message->first];
+        char *buffer = conn->out + conn->out_len;
 
-    // Optional: Print response
-    // printf("Response: %s\n", response.message);
+        // Compact replies: nothing here reads the text, so the servers skip it
+        if (message->count == 1) {
+            conn->out_len += encode_request(load_client_id, firstId, FRAME_COMPACT, requests, buffer);
+        } else {
+            FramedRequest framed[MAX_BATCH_REQUESTS];
+            for (int i = 0; i < message->count; ++i) {
+                framed[i].header = (FrameHeader){
+                    .magic = FRAME_MAGIC,
+                    .length = sizeof(Request),
+                    .clientId = load_client_id,
+                    .flags = 0,
+                    .requestId = firstId + i
+                };
+                framed[i].request = requests[i];
+            }
+            conn->out_len += encode_batch(framed, message->count, FRAME_COMPACT, buffer);
+        }
 
-    close(sockfd);
-    pthread_exit(NULL);
+        conn->in_flight[conn->in_flight_count++] = (InFlight){
+            .requestId = firstId,
+            .message = message,
+            .sent_at = monotonic_ns()
+        };
+    }
 }
 
-// Function to read load file and process requests
+// Function to write queued output until the socket is full (returns -1 on error)
+int flush_connection(LoadConnection *conn, int epoll_fd) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("send failed");
+            return -1;
+        }
+        conn->out_off += sent;
+    }
+
+    // Only wait for the socket to drain while output is left over
+    int want_write = conn->out_off < conn->out_len;
+    if (want_write != conn->want_write) {
+        struct epoll_event event = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = conn};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->want_write = want_write;
+    }
+    return 0;
+}
+
+// Function to record the latencies of one reply and retire its message
+// (returns -1 if it answers nothing in flight)
+int complete_message(LoadConnection *conn, const FramedResponse *responses, int count) {
+    uint64_t latency_end = monotonic_ns();
+    uint64_t requestId = responses[0].header.requestId;
+
+    int index = 0;
+    while (index < conn->in_flight_count && conn->in_flight[index].requestId != requestId) {
+        index++;
+    }
+    if (index == conn->in_flight_count) {
+        fprintf(stderr, "Response id %llu does not match any request in flight\n", (unsigned long long)requestId);
+        return -1;
+    }
+    InFlight in_flight = conn->in_flight[index];
+    conn->in_flight[index] = conn->in_flight[--conn->in_flight_count];
+
+    LoadMessage *message = in_flight.message;
+    outstanding_messages--;
+    if (count != message->count) {
+        fprintf(stderr, "Got %d responses for a batch of %d starting at request %llu\n",
+                count, message->count, (unsigned long long)requestId);
+        failed_requests += message->count;
+        return 0;
+    }
+
+    // Every request of a batch waits for the whole reply
+    uint64_t latency = latency_end - in_flight.sent_at;
+    for (int i = 0; i < count; ++i) {
+        if (responses[i].header.requestId != requestId + i) {
+            fprintf(stderr, "Response id %llu does not match request %llu\n",
+                    (unsigned long long)responses[i].header.requestId, (unsigned long long)(requestId + i));
+        }
+        int kind = query_kind(load_requests[message->first + i].queryType);
+        int outcome = responses[i].response.status == STATUS_SUCCESS ? RESULT_SUCCESS : RESULT_ERROR;
+        histogram_record(&latencies[kind][outcome], latency);
+    }
+    return 0;
+}
+
+// Function to read and complete every reply the socket has (returns -1 on error)
+int read_connection(LoadConnection *conn) {
+    FramedResponse responses[MAX_BATCH_REQUESTS];
+
+    while (1) {
+        ssize_t received = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if (received == 0) {
+            fprintf(stderr, "Server on port %d closed the connection\n", conn->server->port);
+            return -1;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("recv failed");
+            return -1;
+        }
+        conn->in_len += received;
+
+        size_t offset = 0;
+        int count;
+        int consumed;
+        while ((consumed = decode_responses(conn->in + offset, conn->in_len - offset,
+                                            responses, MAX_BATCH_REQUESTS, &count)) > 0) {
+            if (complete_message(conn, responses, count) < 0) {
+                return -1;
+            }
+            offset += consumed;
+        }
+        if (consumed < 0) {
+            fprintf(stderr, "Malformed response frame\n");
+            return -1;
+        }
+        memmove(conn->in, conn->in + offset, conn->in_len - offset);
+        conn->in_len -= offset;
+    }
+}
+
+// Function to replay the load file over persistent pipelined connections
 void process_load_file(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Unable to open load file");
+    read_load_file(filename);
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
         exit(EXIT_FAILURE);
     }
 
-    Request request;
-    pthread_t threads[100];
-    int thread_count = 0;
+    // Connect only to the servers the file addresses
+    LoadConnection *connections = calloc(SERVER_COUNT * connections_per_server, sizeof(LoadConnection));
+    if (!connections) {
+        perror("Unable to allocate connections");
+        exit(EXIT_FAILURE);
+    }
+    int connection_count = 0;
+    for (int s = 0; s < SERVER_COUNT; ++s) {
+        if (servers[s].count == 0) {
+            continue;
+        }
+        for (int i = 0; i < connections_per_server; ++i) {
+            if (open_connection(&connections[connection_count], &servers[s], epoll_fd) == 0) {
+                connection_count++;
+            }
+        }
+        if (servers[s].live_connections == 0) {
+            fail_server(&servers[s]);
+        }
+    }
 
-    while (fread(&request, sizeof(Request), 1, file)) {
-        Request *req = malloc(sizeof(Request));
-        memcpy(req, &request, sizeof(Request));
+    for (int i = 0; i < connection_count; ++i) {
+        fill_connection(&connections[i]);
+        if (flush_connection(&connections[i], epoll_fd) < 0) {
+            close_connection(&connections[i]);
+        }
+    }
 
-        if (pthread_create(&threads[thread_count], NULL, handle_request, (void *)req) != 0) {
-            perror("pthread_create failed");
-            free(req);
-            continue;
+    // Each reply frees a slot that the next message takes right away, so
+    // every connection keeps depth messages in flight until its server's
+    // queue runs dry
+    struct epoll_event events[MAX_CONNECTIONS * SERVER_COUNT];
+    while (outstanding_messages > 0) {
+        int ready = epoll_wait(epoll_fd, events, MAX_CONNECTIONS * SERVER_COUNT, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            LoadConnection *conn = events[i].data.ptr;
+            if (conn->fd < 0) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && read_connection(conn) < 0) {
+                close_connection(conn);
+                continue;
+            }
+            fill_connection(conn);
+            if (flush_connection(conn, epoll_fd) < 0) {
+                close_connection(conn);
+            }
         }
+    }
 
-        thread_count++;
+    for (int i = 0; i < connection_count; ++i) {
+        if (connections[i].fd >= 0) {
+            close(connections[i].fd);
+        }
+        free(connections[i].out);
+        free(connections[i].in_flight);
+    }
+    free(connections);
+    for (int s = 0; s < SERVER_COUNT; ++s) {
+        free(servers[s].messages);
+    }
+    free(load_requests);
+    close(epoll_fd);
+    printf("Processed load file '%s'\n", filename);
+}
 
-        if (thread_count == 100) {
-            for (int i = 0; i < thread_count; ++i) {
-                pthread_join(threads[i], NULL);
+// Percentiles every report shows
+#define PERCENTILE_COUNT 4
+const double report_percentiles[PERCENTILE_COUNT] = {50.0, 90.0, 99.0, 99.9};
+const char *percentile_names[PERCENTILE_COUNT] = {"p50", "p90", "p99", "p99.9"};
+
+// Function to print the latency and throughput of every query type and result
+void print_report(double elapsed) {
+    uint64_t total = 0, errors = 0;
+
+    printf("%-9s %-8s %8s %10s %10s %10s %10s %10s %10s\n",
+           "query", "result", "count", "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int kind = 0; kind < QUERY_KINDS; ++kind) {
+        for (int outcome = 0; outcome < 2; ++outcome) {
+            Histogram *histogram = &latencies[kind][outcome];
+            uint64_t count = histogram_count(histogram);
+            if (count == 0) {
+                continue;
+            }
+            total += count;
+            if (outcome == RESULT_ERROR) {
+                errors += count;
+            }
+
+            printf("%-9s %-8s %8llu %10.0f", query_kind_names[kind], result_names[outcome],
+                   (unsigned long long)count, count / elapsed);
+            for (int p = 0; p < PERCENTILE_COUNT; ++p) {
+                printf(" %10.1f", histogram_percentile(histogram, report_percentiles[p]) / 1000.0);
             }
-            thread_count = 0;
+            printf(" %10.1f\n", histogram_max(histogram) / 1000.0);
         }
     }
 
-    // Join remaining threads
-    for (int i = 0; i < thread_count; ++i) {
-        pthread_join(threads[i], NULL);
+    printf("%llu requests in %.3f s (%.0f requests/s), %llu errors, %llu without response\n",
+           (unsigned long long)total, elapsed, total / elapsed, (unsigned long long)errors,
+           (unsigned long long)failed_requests);
+}
+
+// Function to write the same report as JSON (returns -1 on error)
+int write_json_report(const char *path, const char *load_file, int departmentNumber, double elapsed) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Unable to open JSON report");
+        return -1;
     }
 
-    fclose(file);
-    printf("Processed load file '%s'\n", filename);
+    uint64_t total = 0;
+    for (int kind = 0; kind < QUERY_KINDS; ++kind) {
+        total += histogram_count(&latencies[kind][RESULT_SUCCESS]) + histogram_count(&latencies[kind][RESULT_ERROR]);
+    }
+
+    fprintf(file, "{\n  \"load_file\": \"%s\",\n  \"department\": %d,\n  \"batch_size\": %d,\n",
+            load_file, departmentNumber, batch_size);
+    fprintf(file, "  \"connections_per_server\": %d,\n  \"depth\": %d,\n", connections_per_server, depth);
+    fprintf(file, "  \"elapsed_seconds\": %.6f,\n  \"requests\": %llu,\n  \"requests_per_second\": %.1f,\n",
+            elapsed, (unsigned long long)total, total / elapsed);
+    fprintf(file, "  \"without_response\": %llu,\n  \"latency_unit\": \"us\",\n  \"queries\": [",
+            (unsigned long long)failed_requests);
+
+    int first = 1;
+    for (int kind = 0; kind < QUERY_KINDS; ++kind) {
+        for (int outcome = 0; outcome < 2; ++outcome) {
+            Histogram *histogram = &latencies[kind][outcome];
+            uint64_t count = histogram_count(histogram);
+            if (count == 0) {
+                continue;
+            }
+            fprintf(file, "%s\n    {\"query\": \"%s\", \"result\": \"%s\", \"count\": %llu, \"requests_per_second\": %.1f",
+                    first ? "" : ",", query_kind_names[kind], result_names[outcome], (unsigned long long)count, count / elapsed);
+            for (int p = 0; p < PERCENTILE_COUNT; ++p) {
+                fprintf(file, ", \"%s\": %.1f", percentile_names[p], histogram_percentile(histogram, report_percentiles[p]) / 1000.0);
+            }
+            fprintf(file, ", \"max\": %.1f, \"mean\": %.1f}", histogram_max(histogram) / 1000.0, histogram_mean(histogram) / 1000.0);
+            first = 0;
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    if (fclose(file) != 0) {
+        perror("Unable to write JSON report");
+        return -1;
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <department_number> <load_file>\n", argv[0]);
+    const char *json_path = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "b:c:d:j:")) != -1) {
+        switch (option) {
+            case 'b':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > MAX_BATCH_REQUESTS) {
+                    fprintf(stderr, "Invalid batch size. Must be 1 to %d.\n", MAX_BATCH_REQUESTS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                connections_per_server = atoi(optarg);
+                if (connections_per_server < 1 || connections_per_server > MAX_CONNECTIONS) {
+                    fprintf(stderr, "Invalid connection count. Must be 1 to %d.\n", MAX_CONNECTIONS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                if (depth < 1 || depth > MAX_DEPTH) {
+                    fprintf(stderr, "Invalid depth. Must be 1 to %d.\n", MAX_DEPTH);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b batch_size] [-c connections] [-d depth] [-j report.json] <department_number> <load_file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-b batch_size] [-c connections] [-d depth] [-j report.json] <department_number> <load_file>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int departmentNumber = atoi(argv[1]);
-    const char *load_file = argv[2];
+    int departmentNumber = atoi(argv[optind]);
+    const char *load_file = argv[optind + 1];
 
     // Validate department number
     if (departmentNumber != 1 && departmentNumber != 2) {
@@ -113,7 +613,20 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    for (int kind = 0; kind < QUERY_KINDS; ++kind) {
+        histogram_init(&latencies[kind][RESULT_SUCCESS]);
+        histogram_init(&latencies[kind][RESULT_ERROR]);
+    }
+
+    load_client_id = generate_client_id();
+    uint64_t started = monotonic_ns();
     process_load_file(load_file);
+    double elapsed = (monotonic_ns() - started) / 1e9;
+
+    print_report(elapsed);
+    if (json_path && write_json_report(json_path, load_file, departmentNumber, elapsed) < 0) {
+        return EXIT_FAILURE;
+    }
 
     return 0;
 }
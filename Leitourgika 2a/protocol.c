@@ -0,0 +1,727 @@
+// protocol.c
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+
+// Function to send a whole buffer
+int send_all(int sock, const void *buffer, size_t length) {
+    const char *data = buffer;
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Function to receive a whole buffer (0 if the peer closed before sending anything)
+int recv_all(int sock, void *buffer, size_t length) {
+    char *data = buffer;
+    size_t received = 0;
+    while (received < length) {
+        ssize_t bytes = recv(sock, data + received, length - received, 0);
+        if (bytes == 0) {
+            return received == 0 ? 0 : -1;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        received += bytes;
+    }
+    return 1;
+}
+
+// Function to get the payload size of one request frame
+static size_t request_payload_size(int versioned) {
+    return sizeof(Request) + (versioned ? sizeof(RequestVersions) : 0);
+}
+
+// Function to decode one framed Request, checking it is a single one with
+// no flags beyond allowed_flags; versioned says whether versions follow it
+// when the frame itself does not carry FRAME_VERSIONED
+static int decode_frame(const char *data, size_t length, uint32_t allowed_flags, int versioned, FramedRequest *request) {
+    FrameHeader *header = &request->header;
+    if (length < sizeof(FrameHeader)) {
+        return 0;
+    }
+    memcpy(header, data, sizeof(FrameHeader));
+    size_t fixed = request_payload_size(versioned || (header->flags & FRAME_VERSIONED));
+    size_t legs = header->length > fixed ? (header->length - fixed) / sizeof(TransferLeg) : 0;
+    int valid_length = (header->flags & FRAME_LEGS)
+        ? header->length > fixed && (header->length - fixed) % sizeof(TransferLeg) == 0 && legs <= MAX_TRANSFER_LEGS
+        : header->length == fixed;
+    if (header->magic != FRAME_MAGIC || (header->flags & ~allowed_flags) != 0 || !valid_length) {
+        fprintf(stderr, "Unexpected frame (magic %08x, flags %u, length %u)\n", header->magic, header->flags, header->length);
+        return -1;
+    }
+    if (length < sizeof(FrameHeader) + header->length) {
+        return 0;
+    }
+    memcpy(&request->request, data + sizeof(FrameHeader), sizeof(Request));
+    // Legs belong to a multi-transfer, and a multi-transfer needs them
+    if ((request->request.queryType == QUERY_MULTI_TRANSFER) != ((header->flags & FRAME_LEGS) != 0)) {
+        fprintf(stderr, "Unexpected frame (query %d, flags %u)\n", request->request.queryType, header->flags);
+        return -1;
+    }
+    memset(&request->versions, 0, sizeof(RequestVersions));
+    if (fixed > sizeof(Request)) {
+        memcpy(&request->versions, data + sizeof(FrameHeader) + sizeof(Request), sizeof(RequestVersions));
+    }
+    request->legs = legs ? data + sizeof(FrameHeader) + fixed : NULL;
+    request->legCount = legs;
+    return sizeof(FrameHeader) + header->length;
+}
+
+// Function to decode one plain Request, frame or batch from a buffer
+int decode_request(const char *data, size_t length, FrameHeader *message, FramedRequest *requests, int *count) {
+    uint32_t first;
+    if (length < sizeof(first)) {
+        return 0;
+    }
+    memcpy(&first, data, sizeof(first));
+
+    if (first != FRAME_MAGIC) {
+        // Plain Request: the first field is its queryType
+        if (length < sizeof(Request)) {
+            return 0;
+        }
+        memset(message, 0, sizeof(FrameHeader));
+        requests[0].header = *message;
+        memcpy(&requests[0].request, data, sizeof(Request));
+        if (requests[0].request.queryType == QUERY_MULTI_TRANSFER) {
+            fprintf(stderr, "Unexpected plain multi-transfer request\n");
+            return -1;
+        }
+        memset(&requests[0].versions, 0, sizeof(RequestVersions));
+        requests[0].legs = NULL;
+        requests[0].legCount = 0;
+        *count = 1;
+        return sizeof(Request);
+    }
+
+    if (length < sizeof(FrameHeader)) {
+        return 0;
+    }
+    memcpy(message, data, sizeof(FrameHeader));
+    if (!(message->flags & FRAME_BATCH)) {
+        *count = 1;
+        return decode_frame(data, length, FRAME_COMPACT | FRAME_VERSIONED | FRAME_LEGS, 0, &requests[0]);
+    }
+
+    // Batch: the payload is a whole number of single frames
+    int versioned = (message->flags & FRAME_VERSIONED) != 0;
+    const size_t frame_size = sizeof(FrameHeader) + request_payload_size(versioned);
+    if ((message->flags & ~(FRAME_BATCH | FRAME_COMPACT | FRAME_VERSIONED)) != 0 || message->length == 0
+        || message->length % frame_size != 0
+        || message->length / frame_size > MAX_BATCH_REQUESTS) {
+        fprintf(stderr, "Unexpected batch frame (flags %u, length %u)\n", message->flags, message->length);
+        return -1;
+    }
+    if (length < sizeof(FrameHeader) + message->length) {
+        return 0;
+    }
+
+    *count = message->length / frame_size;
+    const char *frame = data + sizeof(FrameHeader);
+    for (int i = 0; i < *count; ++i, frame += frame_size) {
+        if (decode_frame(frame, frame_size, 0, versioned, &requests[i]) <= 0) {
+            return -1;
+        }
+    }
+    return sizeof(FrameHeader) + message->length;
+}
+
+// Function to get the size of the reply to a message
+size_t encoded_response_size(const FrameHeader *message, int count) {
+    if (message->magic != FRAME_MAGIC) {
+        return sizeof(Response);
+    }
+    size_t response_size = (message->flags & FRAME_COMPACT) ? sizeof(CompactResponse) : sizeof(Response);
+    if (!(message->flags & FRAME_BATCH)) {
+        return sizeof(FrameHeader) + response_size;
+    }
+    return sizeof(FrameHeader) + count * (sizeof(FrameHeader) + response_size);
+}
+
+// Function to encode one response frame, compact or as text
+static size_t encode_frame(const FrameHeader *header, const CompactResponse *compact, int as_compact, char *buffer) {
+    FrameHeader reply = *header;
+    reply.flags = as_compact ? FRAME_COMPACT : 0;
+    if (as_compact) {
+        reply.length = sizeof(CompactResponse);
+        memcpy(buffer + sizeof(FrameHeader), compact, sizeof(CompactResponse));
+    } else {
+        Response response;
+        format_response(compact, &response);
+        reply.length = sizeof(Response);
+        memcpy(buffer + sizeof(FrameHeader), &response, sizeof(Response));
+    }
+    memcpy(buffer, &reply, sizeof(FrameHeader));
+    return sizeof(FrameHeader) + reply.length;
+}
+
+// Function to encode a reply in the format the message used
+size_t encode_response(const FrameHeader *message, const FramedResponse *responses, int count, char *buffer) {
+    if (message->magic != FRAME_MAGIC) {
+        // Plain Requests always get the text Response
+        Response response;
+        format_response(&responses[0].response, &response);
+        memcpy(buffer, &response, sizeof(Response));
+        return sizeof(Response);
+    }
+
+    int as_compact = (message->flags & FRAME_COMPACT) != 0;
+    if (!(message->flags & FRAME_BATCH)) {
+        return encode_frame(message, &responses[0].response, as_compact, buffer);
+    }
+
+    FrameHeader reply = *message;
+    reply.flags &= FRAME_BATCH | FRAME_COMPACT;
+    reply.length = encoded_response_size(message, count) - sizeof(FrameHeader);
+    memcpy(buffer, &reply, sizeof(FrameHeader));
+    size_t length = sizeof(FrameHeader);
+    for (int i = 0; i < count; ++i) {
+        length += encode_frame(&responses[i].header, &responses[i].response, as_compact, buffer + length);
+    }
+    return length;
+}
+
+// Function to render a compact response as text
+void format_response(const CompactResponse *compact, Response *response) {
+    char *message = response->message;
+    size_t size = sizeof(response->message);
+    double amount = cents_to_amount(compact->amount);
+
+    memset(response, 0, sizeof(Response));
+    response->status = compact->status;
+
+    switch (compact->error) {
+        case ERROR_NONE:
+            switch (compact->queryType) {
+                case QUERY_DISPLAY:
+                    snprintf(message, size, "Account %d balance: %.2f", compact->accountNumber1, amount);
+                    break;
+                case QUERY_UPDATE:
+                    snprintf(message, size, "Account %d updated%s. New balance: %.2f", compact->accountNumber1,
+                             (compact->flags & RESULT_LOCAL) ? " locally" : "", amount);
+                    break;
+                case QUERY_TRANSFER:
+                    snprintf(message, size, "Transferred %.2f from account %d to account %d%s.", amount,
+                             compact->accountNumber1, compact->accountNumber2, (compact->flags & RESULT_LOCAL) ? " locally" : "");
+                    break;
+                case QUERY_AVERAGE: {
+                    time_t when = compact->timestamp;
+                    struct tm local;
+                    char timestamp[64];
+                    localtime_r(&when, &local);
+                    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+                    snprintf(message, size, "Average amount for department %d: %.2f\nTimestamp: %s", compact->accountNumber1, amount, timestamp);
+                    break;
+                }
+                case QUERY_SUBSCRIBE:
+                    snprintf(message, size, "Subscribed to balance changes.");
+                    break;
+                case QUERY_REPLICATE:
+                    snprintf(message, size, "Replicating department %d from LSN %llu.", compact->accountNumber1,
+                             (unsigned long long)compact->lsn);
+                    break;
+                case QUERY_MULTI_TRANSFER:
+                    snprintf(message, size, "Transferred %.2f in %d legs.", amount, compact->accountNumber2);
+                    break;
+                case QUERY_STATS:
+                    snprintf(message, size, "Department %d: %d accounts, total %.2f, mean %.2f, min %.2f, max %.2f, "
+                             "std dev %.2f", compact->accountNumber1, compact->accountNumber2, amount,
+                             amount / compact->accountNumber2, cents_to_amount(compact->minimum),
+                             cents_to_amount(compact->maximum), sqrt(compact->variance) / CENTS_PER_UNIT);
+                    break;
+            }
+            break;
+        case ERROR_ACCOUNT_NOT_FOUND:
+            snprintf(message, size, "Account %d not found.", compact->accountNumber1);
+            break;
+        case ERROR_ACCOUNTS_NOT_FOUND:
+            snprintf(message, size, "One or both accounts not found.");
+            break;
+        case ERROR_SAME_ACCOUNT:
+            snprintf(message, size, "Cannot transfer to the same account.");
+            break;
+        case ERROR_INSUFFICIENT_FUNDS:
+            snprintf(message, size, "Insufficient funds in account %d.", compact->accountNumber1);
+            break;
+        case ERROR_NO_ACCOUNTS:
+            snprintf(message, size, "No accounts found for department %d.", compact->accountNumber1);
+            break;
+        case ERROR_INVALID_QUERY:
+            snprintf(message, size, "Invalid query type.");
+            break;
+        case ERROR_CENTRAL_UNAVAILABLE:
+            snprintf(message, size, "Central server connection failed.");
+            break;
+        case ERROR_CENTRAL_FAILED:
+            if (compact->queryType == QUERY_TRANSFER) {
+                snprintf(message, size, "Central server failed to transfer %.2f from account %d to account %d.", amount,
+                         compact->accountNumber1, compact->accountNumber2);
+            } else {
+                snprintf(message, size, "Central server failed to update account %d.", compact->accountNumber1);
+            }
+            break;
+        case ERROR_DUPLICATE_REQUEST:
+            snprintf(message, size, "Duplicate request id in batch.");
+            break;
+        case ERROR_OUT_OF_MEMORY:
+            snprintf(message, size, "Branch server out of memory.");
+            break;
+        case ERROR_TOO_MANY_SUBSCRIBERS:
+            snprintf(message, size, "Too many subscribers.");
+            break;
+        case ERROR_TOO_MANY_REPLICAS:
+            snprintf(message, size, "Too many replicas.");
+            break;
+        case ERROR_VERSION_CONFLICT:
+            snprintf(message, size, "Account changed concurrently, please retry.");
+            break;
+        case ERROR_INVALID_LEGS:
+            snprintf(message, size, "Invalid transfer legs (at account %d).", compact->accountNumber1);
+            break;
+        case ERROR_VERSIONED_LEGS:
+            snprintf(message, size, "Multi-transfers do not take versions.");
+            break;
+        case ERROR_REQUEST_BUSY:
+            snprintf(message, size, "Too many requests in progress, please retry.");
+            break;
+        default:
+            snprintf(message, size, "Error %d.", compact->error);
+    }
+}
+
+// Function to encode a framed request
+size_t encode_request(uint32_t clientId, uint64_t requestId, uint32_t flags, const Request *request, char *buffer) {
+    FrameHeader header = {
+        .magic = FRAME_MAGIC,
+        .length = sizeof(Request),
+        .clientId = clientId,
+        .flags = flags,
+        .requestId = requestId
+    };
+    memcpy(buffer, &header, sizeof(FrameHeader));
+    memcpy(buffer + sizeof(FrameHeader), request, sizeof(Request));
+    return sizeof(FrameHeader) + sizeof(Request);
+}
+
+// Function to encode a framed request with the ids in its header
+size_t encode_framed_request(const FramedRequest *request, uint32_t flags, char *buffer) {
+    size_t length = encode_request(request->header.clientId, request->header.requestId, flags, &request->request, buffer);
+    if (flags & FRAME_VERSIONED) {
+        FrameHeader *header = (FrameHeader *)buffer;
+        header->length += sizeof(RequestVersions);
+        memcpy(buffer + length, &request->versions, sizeof(RequestVersions));
+        length += sizeof(RequestVersions);
+    }
+    return length;
+}
+
+// Function to send a framed request with the ids in its header
+int write_framed_request(int sock, const FramedRequest *request, uint32_t flags) {
+    char buffer[sizeof(FrameHeader) + sizeof(Request) + sizeof(RequestVersions)];
+    return send_all(sock, buffer, encode_framed_request(request, flags, buffer));
+}
+
+// Function to encode a multi-transfer request
+size_t encode_multi_transfer(uint32_t clientId, uint64_t requestId, uint32_t flags, const TransferLeg *legs, int count,
+                             char *buffer) {
+    Request request = { .queryType = QUERY_MULTI_TRANSFER };
+    size_t length = encode_request(clientId, requestId, (flags & FRAME_COMPACT) | FRAME_LEGS, &request, buffer);
+    FrameHeader *header = (FrameHeader *)buffer;
+    header->length += count * sizeof(TransferLeg);
+    memcpy(buffer + length, legs, count * sizeof(TransferLeg));
+    return length + count * sizeof(TransferLeg);
+}
+
+// Function to send a multi-transfer request
+int write_multi_transfer(int sock, uint32_t clientId, uint64_t requestId, uint32_t flags, const TransferLeg *legs,
+                         int count) {
+    char buffer[MAX_MULTI_TRANSFER_SIZE];
+    if (count < 1 || count > MAX_TRANSFER_LEGS) {
+        return -1;
+    }
+    return send_all(sock, buffer, encode_multi_transfer(clientId, requestId, flags, legs, count, buffer));
+}
+
+// Function to send a framed request
+int write_request(int sock, uint32_t clientId, uint64_t requestId, uint32_t flags, const Request *request) {
+    char buffer[sizeof(FrameHeader) + sizeof(Request)];
+    return send_all(sock, buffer, encode_request(clientId, requestId, flags, request, buffer));
+}
+
+// Function to read a framed text response
+int read_response(int sock, FrameHeader *header, Response *response) {
+    int result = recv_all(sock, header, sizeof(FrameHeader));
+    if (result <= 0) {
+        return result;
+    }
+    if (header->magic != FRAME_MAGIC || header->flags != 0 || header->length != sizeof(Response)) {
+        fprintf(stderr, "Malformed response frame\n");
+        return -1;
+    }
+    return recv_all(sock, response, sizeof(Response)) == 1 ? 1 : -1;
+}
+
+// Function to encode a batch of framed requests as one message
+size_t encode_batch(const FramedRequest *requests, int count, uint32_t flags, char *buffer) {
+    int versioned = (flags & FRAME_VERSIONED) != 0;
+    const size_t frame_size = sizeof(FrameHeader) + request_payload_size(versioned);
+
+    FrameHeader message = requests[0].header;
+    message.length = count * frame_size;
+    message.flags = FRAME_BATCH | flags;
+    memcpy(buffer, &message, sizeof(FrameHeader));
+
+    char *frame = buffer + sizeof(FrameHeader);
+    for (int i = 0; i < count; ++i, frame += frame_size) {
+        FrameHeader header = requests[i].header;
+        header.magic = FRAME_MAGIC;
+        header.length = request_payload_size(versioned);
+        header.flags = 0;
+        memcpy(frame, &header, sizeof(FrameHeader));
+        memcpy(frame + sizeof(FrameHeader), &requests[i].request, sizeof(Request));
+        if (versioned) {
+            memcpy(frame + sizeof(FrameHeader) + sizeof(Request), &requests[i].versions, sizeof(RequestVersions));
+        }
+    }
+    return frame - buffer;
+}
+
+// Function to send a batch of framed requests in one write
+int write_batch(int sock, const FramedRequest *requests, int count, uint32_t flags) {
+    char buffer[MAX_REQUEST_MESSAGE_SIZE];
+    if (count < 1 || count > MAX_BATCH_REQUESTS) {
+        return -1;
+    }
+    return send_all(sock, buffer, encode_batch(requests, count, flags, buffer));
+}
+
+// Function to read one compact response frame
+static int read_compact_frame(int sock, FramedResponse *response) {
+    int result = recv_all(sock, &response->header, sizeof(FrameHeader));
+    if (result <= 0) {
+        return result;
+    }
+    if (response->header.magic != FRAME_MAGIC || response->header.flags != FRAME_COMPACT
+        || response->header.length != sizeof(CompactResponse)) {
+        fprintf(stderr, "Malformed response frame\n");
+        return -1;
+    }
+    return recv_all(sock, &response->response, sizeof(CompactResponse)) == 1 ? 1 : -1;
+}
+
+// Function to read a single or batch compact reply
+int read_responses(int sock, FramedResponse *responses, int capacity) {
+    FrameHeader message;
+    int result = recv_all(sock, &message, sizeof(FrameHeader));
+    if (result <= 0) {
+        return result;
+    }
+    if (message.magic != FRAME_MAGIC || !(message.flags & FRAME_COMPACT) || capacity < 1) {
+        fprintf(stderr, "Malformed response frame\n");
+        return -1;
+    }
+    if (!(message.flags & FRAME_BATCH)) {
+        if (message.flags != FRAME_COMPACT || message.length != sizeof(CompactResponse)) {
+            fprintf(stderr, "Malformed response frame\n");
+            return -1;
+        }
+        responses[0].header = message;
+        return recv_all(sock, &responses[0].response, sizeof(CompactResponse)) == 1 ? 1 : -1;
+    }
+
+    const size_t frame_size = sizeof(FrameHeader) + sizeof(CompactResponse);
+    if (message.length % frame_size != 0 || message.length / frame_size > (size_t)capacity) {
+        fprintf(stderr, "Malformed batch response frame\n");
+        return -1;
+    }
+    int count = message.length / frame_size;
+    for (int i = 0; i < count; ++i) {
+        if (read_compact_frame(sock, &responses[i]) != 1) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Function to decode one single or batch compact reply from a buffer
+int decode_responses(const char *data, size_t length, FramedResponse *responses, int capacity, int *count) {
+    const size_t frame_size = sizeof(FrameHeader) + sizeof(CompactResponse);
+    FrameHeader message;
+
+    if (length < sizeof(FrameHeader)) {
+        return 0;
+    }
+    memcpy(&message, data, sizeof(FrameHeader));
+    if (message.magic != FRAME_MAGIC || !(message.flags & FRAME_COMPACT)
+        || message.length > (size_t)capacity * frame_size) {
+        return -1;
+    }
+    if (length < sizeof(FrameHeader) + message.length) {
+        return 0;
+    }
+
+    if (!(message.flags & FRAME_BATCH)) {
+        if (message.flags != FRAME_COMPACT || message.length != sizeof(CompactResponse)) {
+            return -1;
+        }
+        responses[0].header = message;
+        memcpy(&responses[0].response, data + sizeof(FrameHeader), sizeof(CompactResponse));
+        *count = 1;
+        return sizeof(FrameHeader) + message.length;
+    }
+
+    if (message.length == 0 || message.length % frame_size != 0) {
+        return -1;
+    }
+    *count = message.length / frame_size;
+    const char *frame = data + sizeof(FrameHeader);
+    for (int i = 0; i < *count; ++i, frame += frame_size) {
+        memcpy(&responses[i].header, frame, sizeof(FrameHeader));
+        if (responses[i].header.magic != FRAME_MAGIC || responses[i].header.flags != FRAME_COMPACT
+            || responses[i].header.length != sizeof(CompactResponse)) {
+            return -1;
+        }
+        memcpy(&responses[i].response, frame + sizeof(FrameHeader), sizeof(CompactResponse));
+    }
+    return sizeof(FrameHeader) + message.length;
+}
+
+// Function to encode an invalidation frame for changed accounts
+size_t encode_invalidation(const int32_t *accounts, int count, char *buffer) {
+    FrameHeader header = {
+        .magic = FRAME_MAGIC,
+        .length = count * sizeof(int32_t),
+        .clientId = 0,
+        .flags = FRAME_INVALIDATE,
+        .requestId = (uint64_t)current_time_us()
+    };
+    memcpy(buffer, &header, sizeof(FrameHeader));
+    memcpy(buffer + sizeof(FrameHeader), accounts, header.length);
+    return sizeof(FrameHeader) + header.length;
+}
+
+// Function to read one invalidation frame
+int read_invalidation(int sock, int32_t *accounts, int capacity, int *count, int64_t *sent_at) {
+    FrameHeader header;
+    int result = recv_all(sock, &header, sizeof(FrameHeader));
+    if (result <= 0) {
+        return result;
+    }
+    if (header.magic != FRAME_MAGIC || header.flags != FRAME_INVALIDATE
+        || header.length % sizeof(int32_t) != 0 || header.length / sizeof(int32_t) > (size_t)capacity) {
+        fprintf(stderr, "Malformed invalidation frame\n");
+        return -1;
+    }
+    if (header.length > 0 && recv_all(sock, accounts, header.length) != 1) {
+        return -1;
+    }
+    *count = header.length / sizeof(int32_t);
+    *sent_at = (int64_t)header.requestId;
+    return 1;
+}
+
+// Function to encode a change frame for a replica
+size_t encode_changes(const ChangeBatch *batch, const ChangeRecord *records, char *buffer) {
+    FrameHeader header = {
+        .magic = FRAME_MAGIC,
+        .length = sizeof(ChangeBatch) + batch->count * sizeof(ChangeRecord),
+        .clientId = 0,
+        .flags = FRAME_CHANGES,
+        .requestId = (uint64_t)current_time_us()
+    };
+    memcpy(buffer, &header, sizeof(FrameHeader));
+    memcpy(buffer + sizeof(FrameHeader), batch, sizeof(ChangeBatch));
+    memcpy(buffer + sizeof(FrameHeader) + sizeof(ChangeBatch), records, batch->count * sizeof(ChangeRecord));
+    return sizeof(FrameHeader) + header.length;
+}
+
+// Function to read one change frame
+int read_changes(int sock, ChangeBatch *batch, ChangeRecord *records, int capacity, int64_t *sent_at) {
+    FrameHeader header;
+    int result = recv_all(sock, &header, sizeof(FrameHeader));
+    if (result <= 0) {
+        return result;
+    }
+    if (header.magic != FRAME_MAGIC || header.flags != FRAME_CHANGES || header.length < sizeof(ChangeBatch)
+        || recv_all(sock, batch, sizeof(ChangeBatch)) != 1) {
+        fprintf(stderr, "Malformed change frame\n");
+        return -1;
+    }
+    if (batch->count > (uint32_t)capacity
+        || header.length != sizeof(ChangeBatch) + batch->count * sizeof(ChangeRecord)) {
+        fprintf(stderr, "Malformed change frame\n");
+        return -1;
+    }
+    if (batch->count > 0 && recv_all(sock, records, batch->count * sizeof(ChangeRecord)) != 1) {
+        return -1;
+    }
+    *sent_at = (int64_t)header.requestId;
+    return 1;
+}
+
+// Function to generate a client id
+uint32_t generate_client_id() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint32_t id = (uint32_t)getpid() * 2654435761u ^ (uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec;
+    return id ? id : 1;
+}
+
+// Function to check whether an earlier request of a batch has the same id
+int batch_repeats_request(const FramedRequest *requests, int index) {
+    const FrameHeader *header = &requests[index].header;
+    if (header->magic != FRAME_MAGIC || header->clientId == 0) {
+        return 0;
+    }
+    for (int i = 0; i < index; ++i) {
+        if (requests[i].header.clientId == header->clientId && requests[i].header.requestId == header->requestId) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to initialize the duplicate detection cache
+void request_cache_init(RequestCache *cache) {
+    memset(cache->entries, 0, sizeof(cache->entries));
+    memset(cache->finished, 0, sizeof(cache->finished));
+    for (int i = 0; i < REQUEST_CACHE_STRIPES; ++i) {
+        pthread_mutex_init(&cache->mutex[i], NULL);
+        pthread_cond_init(&cache->cond[i], NULL);
+    }
+}
+
+// Function to find the first entry of a request's set
+static RequestCacheEntry *request_cache_set(RequestCache *cache, const FrameHeader *header, unsigned *stripe) {
+    uint64_t key = header->requestId * 0x9E3779B97F4A7C15ull ^ header->clientId;
+    unsigned set = (unsigned)(key ^ (key >> 29)) % (REQUEST_CACHE_SIZE / REQUEST_CACHE_WAYS);
+    *stripe = set % REQUEST_CACHE_STRIPES;
+    return &cache->entries[set * REQUEST_CACHE_WAYS];
+}
+
+// Function to find a request's entry in its set (caller holds the stripe)
+static RequestCacheEntry *request_cache_find(RequestCacheEntry *set, const FrameHeader *header) {
+    for (int i = 0; i < REQUEST_CACHE_WAYS; ++i) {
+        if (set[i].state != 0 && set[i].clientId == header->clientId && set[i].requestId == header->requestId) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to claim a request, or fetch the response of an earlier identical one
+int request_cache_begin(RequestCache *cache, const FrameHeader *header, CompactResponse *response, int wait) {
+    if (header->magic != FRAME_MAGIC || header->clientId == 0) {
+        return REQUEST_CACHE_UNTRACKED;
+    }
+
+    unsigned stripe;
+    RequestCacheEntry *set = request_cache_set(cache, header, &stripe);
+    RequestCacheEntry *entry;
+
+    pthread_mutex_lock(&cache->mutex[stripe]);
+    while ((entry = request_cache_find(set, header)) && entry->state == 1) {
+        // A retry raced with the original: wait for its response
+        if (!wait) {
+            pthread_mutex_unlock(&cache->mutex[stripe]);
+            return REQUEST_CACHE_IN_PROGRESS;
+        }
+        pthread_cond_wait(&cache->cond[stripe], &cache->mutex[stripe]);
+    }
+    if (entry) {
+        memcpy(response, &entry->response, sizeof(CompactResponse));
+        pthread_mutex_unlock(&cache->mutex[stripe]);
+        return REQUEST_CACHE_HIT;
+    }
+
+    // An empty entry, else the one done longest ago; never one in progress
+    for (int i = 0; i < REQUEST_CACHE_WAYS; ++i) {
+        if (set[i].state == 0) {
+            entry = &set[i];
+            break;
+        }
+        if (set[i].state == 2 && (!entry || set[i].finished < entry->finished)) {
+            entry = &set[i];
+        }
+    }
+    if (!entry) {
+        pthread_mutex_unlock(&cache->mutex[stripe]);
+        return REQUEST_CACHE_FULL;
+    }
+
+    entry->clientId = header->clientId;
+    entry->requestId = header->requestId;
+    entry->state = 1;
+    entry->waiters = NULL;
+    pthread_mutex_unlock(&cache->mutex[stripe]);
+    return REQUEST_CACHE_NEW;
+}
+
+// Function to queue a retried request for its original's response
+int request_cache_wait(RequestCache *cache, const FrameHeader *header, RequestCacheWaiter *waiter) {
+    unsigned stripe;
+    RequestCacheEntry *set = request_cache_set(cache, header, &stripe);
+    int result = REQUEST_CACHE_HIT;
+
+    pthread_mutex_lock(&cache->mutex[stripe]);
+    RequestCacheEntry *entry = request_cache_find(set, header);
+    if (!entry) {
+        // The response was already pushed out of the cache by other requests
+        waiter->response->status = STATUS_ERROR;
+        waiter->response->error = ERROR_DUPLICATE_REQUEST;
+    } else if (entry->state == 2) {
+        memcpy(waiter->response, &entry->response, sizeof(CompactResponse));
+    } else {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        result = REQUEST_CACHE_IN_PROGRESS;
+    }
+    pthread_mutex_unlock(&cache->mutex[stripe]);
+    return result;
+}
+
+// Function to record the response of a claimed request
+void request_cache_finish(RequestCache *cache, const FrameHeader *header, const CompactResponse *response) {
+    unsigned stripe;
+    RequestCacheEntry *set = request_cache_set(cache, header, &stripe);
+    RequestCacheWaiter *waiters = NULL;
+
+    pthread_mutex_lock(&cache->mutex[stripe]);
+    RequestCacheEntry *entry = request_cache_find(set, header);
+    if (entry && entry->state == 1) {
+        memcpy(&entry->response, response, sizeof(CompactResponse));
+        entry->state = 2;
+        entry->finished = ++cache->finished[stripe];
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+        pthread_cond_broadcast(&cache->cond[stripe]);
+    }
+    pthread_mutex_unlock(&cache->mutex[stripe]);
+
+    // Outside the lock, since a callback may finish requests of its own
+    while (waiters) {
+        RequestCacheWaiter *next = waiters->next;
+        memcpy(waiters->response, response, sizeof(CompactResponse));
+        waiters->callback(waiters->arg);
+        waiters = next;
+    }
+}
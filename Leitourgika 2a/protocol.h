@@ -0,0 +1,155 @@
+// protocol.h
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "bank_system.h"
+#include <stddef.h>
+
+// Number of recent responses kept for duplicate detection, in sets of
+// REQUEST_CACHE_WAYS entries a request may use any of
+#define REQUEST_CACHE_SIZE 16384
+#define REQUEST_CACHE_WAYS 8
+#define REQUEST_CACHE_STRIPES 64
+
+// Results of request_cache_begin
+#define REQUEST_CACHE_NEW 0       // Caller must process the request and call request_cache_finish
+#define REQUEST_CACHE_HIT 1       // Response was copied from an earlier identical request
+#define REQUEST_CACHE_UNTRACKED 2 // Not tracked (plain Request, which has no id), just process it
+#define REQUEST_CACHE_IN_PROGRESS 3 // An identical request is still running (only if not waiting for it)
+#define REQUEST_CACHE_FULL 4      // Every entry of its set is in progress: refuse it, it cannot be tracked
+
+// A retried request waiting for its original's response: request_cache_finish
+// copies the response into response, then calls callback(arg)
+typedef struct RequestCacheWaiter {
+    CompactResponse *response;
+    void (*callback)(void *arg);
+    void *arg;
+    struct RequestCacheWaiter *next;
+} RequestCacheWaiter;
+
+typedef struct {
+    uint32_t clientId;
+    uint64_t requestId;
+    int state;           // 0 = empty, 1 = in progress, 2 = done
+    uint64_t finished;   // Order it was done in within its stripe, oldest replaced first
+    CompactResponse response;
+    RequestCacheWaiter *waiters;   // While in progress
+} RequestCacheEntry;
+
+// Recent responses by (clientId, requestId) so retried requests are not
+// applied twice. An entry in progress is never replaced.
+typedef struct {
+    RequestCacheEntry entries[REQUEST_CACHE_SIZE];
+    pthread_mutex_t mutex[REQUEST_CACHE_STRIPES];
+    pthread_cond_t cond[REQUEST_CACHE_STRIPES];
+    uint64_t finished[REQUEST_CACHE_STRIPES];
+} RequestCache;
+
+// One request or response of a message, with the header that identifies it
+typedef struct {
+    FrameHeader header;
+    Request request;
+    RequestVersions versions;   // Zero unless the message had FRAME_VERSIONED
+    const void *legs;           // legCount TransferLegs of a FRAME_LEGS frame, in the
+    int legCount;               // receive buffer (unaligned: copy each out to use it)
+} FramedRequest;
+
+typedef struct {
+    FrameHeader header;
+    CompactResponse response;
+} FramedResponse;
+
+// Largest request message (a full batch) and compact reply to it
+#define MAX_REQUEST_MESSAGE_SIZE (sizeof(FrameHeader) + MAX_BATCH_REQUESTS * (sizeof(FrameHeader) + sizeof(Request) + sizeof(RequestVersions)))
+#define MAX_RESPONSE_MESSAGE_SIZE (sizeof(FrameHeader) + MAX_BATCH_REQUESTS * (sizeof(FrameHeader) + sizeof(CompactResponse)))
+
+// Largest multi-transfer request
+#define MAX_MULTI_TRANSFER_SIZE (sizeof(FrameHeader) + sizeof(Request) + MAX_TRANSFER_LEGS * sizeof(TransferLeg))
+
+// Send or receive exactly length bytes (recv_all returns 0 on a clean close before any byte)
+int send_all(int sock, const void *buffer, size_t length);
+int recv_all(int sock, void *buffer, size_t length);
+
+// Decode one message (a plain Request, a frame or a batch) from the front of
+// a buffer into at most MAX_BATCH_REQUESTS requests. message is the outer
+// header, which is also requests[0].header unless FRAME_BATCH is set; a plain
+// Request gets a header with magic 0. Returns the bytes consumed, 0 if the
+// buffer does not hold a whole message yet, or -1 if it is malformed.
+int decode_request(const char *data, size_t length, FrameHeader *message, FramedRequest *requests, int *count);
+
+// Size of the reply to a message with count requests
+size_t encoded_response_size(const FrameHeader *message, int count);
+
+// Encode a reply in the same format the message arrived in, returning its size
+size_t encode_response(const FrameHeader *message, const FramedResponse *responses, int count, char *buffer);
+
+// Render a compact response as the text Response
+void format_response(const CompactResponse *compact, Response *response);
+
+// Client side of the framed protocol; flags may hold FRAME_COMPACT, and for
+// the *_framed_request and batch functions FRAME_VERSIONED, which sends each
+// request's versions. The encode_* functions build the same messages in a
+// buffer and return their size.
+size_t encode_request(uint32_t clientId, uint64_t requestId, uint32_t flags, const Request *request, char *buffer);
+size_t encode_framed_request(const FramedRequest *request, uint32_t flags, char *buffer);
+size_t encode_batch(const FramedRequest *requests, int count, uint32_t flags, char *buffer);
+int write_request(int sock, uint32_t clientId, uint64_t requestId, uint32_t flags, const Request *request);
+int write_framed_request(int sock, const FramedRequest *request, uint32_t flags);
+
+// Send a QUERY_MULTI_TRANSFER of 1 to MAX_TRANSFER_LEGS legs, to central;
+// flags may hold FRAME_COMPACT
+size_t encode_multi_transfer(uint32_t clientId, uint64_t requestId, uint32_t flags, const TransferLeg *legs, int count,
+                             char *buffer);
+int write_multi_transfer(int sock, uint32_t clientId, uint64_t requestId, uint32_t flags, const TransferLeg *legs,
+                         int count);
+int read_response(int sock, FrameHeader *header, Response *response);
+
+// Send requests (each with its own requestId) as one batch frame
+int write_batch(int sock, const FramedRequest *requests, int count, uint32_t flags);
+
+// Read one single or batch reply to a FRAME_COMPACT request; returns the
+// number of responses, 0 on a clean close, or -1 on error
+int read_responses(int sock, FramedResponse *responses, int capacity);
+
+// Decode one reply to a FRAME_COMPACT request from the front of a buffer, for
+// non-blocking clients. Returns the bytes consumed, 0 if the buffer does not
+// hold the whole reply yet, or -1 if it is malformed.
+int decode_responses(const char *data, size_t length, FramedResponse *responses, int capacity, int *count);
+
+// Encode a FRAME_INVALIDATE frame for up to MAX_INVALIDATION_ACCOUNTS
+// accounts, returning its size
+size_t encode_invalidation(const int32_t *accounts, int count, char *buffer);
+
+// Read one FRAME_INVALIDATE frame and its number of accounts (0 for a
+// heartbeat); returns 1, 0 on a clean close, or -1 on error
+int read_invalidation(int sock, int32_t *accounts, int capacity, int *count, int64_t *sent_at);
+
+// Encode a FRAME_CHANGES frame for batch and its records, returning its size
+size_t encode_changes(const ChangeBatch *batch, const ChangeRecord *records, char *buffer);
+
+// Read one FRAME_CHANGES frame of up to capacity records; returns 1, 0 on a
+// clean close, or -1 on error
+int read_changes(int sock, ChangeBatch *batch, ChangeRecord *records, int capacity, int64_t *sent_at);
+
+// Pick a client id that is unlikely to collide with other processes
+uint32_t generate_client_id();
+
+// Check whether an earlier request of a batch has the same id as requests[index]
+int batch_repeats_request(const FramedRequest *requests, int index);
+
+void request_cache_init(RequestCache *cache);
+
+// Claim a request or fetch the response of an earlier identical one. If that
+// one is still in progress, block until it finishes if wait is set, else
+// return REQUEST_CACHE_IN_PROGRESS.
+int request_cache_begin(RequestCache *cache, const FrameHeader *header, CompactResponse *response, int wait);
+
+// Have waiter answered when the request that made request_cache_begin return
+// REQUEST_CACHE_IN_PROGRESS finishes. Returns REQUEST_CACHE_IN_PROGRESS if
+// the waiter was added, or REQUEST_CACHE_HIT with waiter->response filled in
+// if the request finished meanwhile (its callback is then not called).
+int request_cache_wait(RequestCache *cache, const FrameHeader *header, RequestCacheWaiter *waiter);
+
+void request_cache_finish(RequestCache *cache, const FrameHeader *header, const CompactResponse *response);
+
+#endif // PROTOCOL_H
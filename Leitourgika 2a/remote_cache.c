@@ -0,0 +1,158 @@
+// remote_cache.c
+#include "remote_cache.h"
+#include "bank_system.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Function to find the slot an account maps to
+static RemoteCacheSlot *cache_slot(RemoteCache *cache, int accountNumber) {
+    return &cache->slots[(unsigned)accountNumber % cache->capacity];
+}
+
+// Function to raise a maximum to value
+static void record_max(_Atomic int64_t *maximum, int64_t value) {
+    int64_t current = atomic_load(maximum);
+    while (value > current && !atomic_compare_exchange_weak(maximum, &current, value)) {
+    }
+}
+
+// Function to allocate an empty, disabled cache
+int remote_cache_init(RemoteCache *cache, int capacity) {
+    atomic_init(&cache->enabled, 0);
+    cache->capacity = 0;
+    cache->slots = NULL;
+    if (capacity == 0) {
+        return 0;
+    }
+
+    cache->slots = calloc(capacity, sizeof(RemoteCacheSlot));
+    if (!cache->slots) {
+        perror("Unable to allocate remote cache");
+        return -1;
+    }
+    cache->capacity = capacity;
+    for (int i = 0; i < capacity; ++i) {
+        pthread_mutex_init(&cache->slots[i].mutex, NULL);
+    }
+    return 0;
+}
+
+// Function to read the generation a fetch must still match when it is stored
+unsigned remote_cache_generation(RemoteCache *cache, int accountNumber) {
+    if (cache->capacity == 0) {
+        return 0;
+    }
+    RemoteCacheSlot *slot = cache_slot(cache, accountNumber);
+    pthread_mutex_lock(&slot->mutex);
+    unsigned generation = slot->generation;
+    pthread_mutex_unlock(&slot->mutex);
+    return generation;
+}
+
+// Function to look up a cached balance
+int remote_cache_lookup(RemoteCache *cache, int accountNumber, int64_t *balance) {
+    if (!atomic_load(&cache->enabled)) {
+        return 0;
+    }
+
+    RemoteCacheSlot *slot = cache_slot(cache, accountNumber);
+    pthread_mutex_lock(&slot->mutex);
+    int hit = slot->accountNumber == accountNumber;
+    int64_t fetched_at = slot->fetched_at;
+    if (hit) {
+        *balance = slot->balance;
+    }
+    pthread_mutex_unlock(&slot->mutex);
+
+    if (!hit) {
+        atomic_fetch_add(&cache->stats.misses, 1);
+        return 0;
+    }
+    int64_t age = current_time_us() - fetched_at;
+    atomic_fetch_add(&cache->stats.hits, 1);
+    atomic_fetch_add(&cache->stats.hit_age_total, age);
+    record_max(&cache->stats.hit_age_max, age);
+    return 1;
+}
+
+// Function to store a fetched balance
+void remote_cache_insert(RemoteCache *cache, int accountNumber, int64_t balance, unsigned generation, int64_t fetched_at) {
+    if (!atomic_load(&cache->enabled)) {
+        return;
+    }
+
+    RemoteCacheSlot *slot = cache_slot(cache, accountNumber);
+    pthread_mutex_lock(&slot->mutex);
+    if (slot->generation != generation) {
+        // Changed while the fetch was in flight, so balance may be old
+        pthread_mutex_unlock(&slot->mutex);
+        atomic_fetch_add(&cache->stats.raced, 1);
+        return;
+    }
+    if (slot->accountNumber != 0 && slot->accountNumber != accountNumber) {
+        atomic_fetch_add(&cache->stats.evictions, 1);
+    }
+    slot->accountNumber = accountNumber;
+    slot->balance = balance;
+    slot->fetched_at = fetched_at;
+    pthread_mutex_unlock(&slot->mutex);
+    atomic_fetch_add(&cache->stats.inserts, 1);
+}
+
+// Function to drop an account's cached balance
+void remote_cache_invalidate(RemoteCache *cache, int accountNumber) {
+    if (cache->capacity == 0) {
+        return;
+    }
+    RemoteCacheSlot *slot = cache_slot(cache, accountNumber);
+    pthread_mutex_lock(&slot->mutex);
+    slot->generation++;
+    if (slot->accountNumber == accountNumber) {
+        slot->accountNumber = 0;
+    }
+    pthread_mutex_unlock(&slot->mutex);
+    atomic_fetch_add(&cache->stats.invalidations, 1);
+}
+
+// Function to record the delivery time of one invalidation frame
+void remote_cache_record_lag(RemoteCache *cache, int64_t lag) {
+    atomic_fetch_add(&cache->stats.lag_count, 1);
+    atomic_fetch_add(&cache->stats.lag_total, lag);
+    record_max(&cache->stats.lag_max, lag);
+}
+
+// Function to empty the cache and switch it on or off
+void remote_cache_set_enabled(RemoteCache *cache, int enabled) {
+    atomic_store(&cache->enabled, 0);
+    // Bumping every generation also discards fetches that were in flight
+    for (int i = 0; i < cache->capacity; ++i) {
+        RemoteCacheSlot *slot = &cache->slots[i];
+        pthread_mutex_lock(&slot->mutex);
+        slot->generation++;
+        slot->accountNumber = 0;
+        pthread_mutex_unlock(&slot->mutex);
+    }
+    atomic_store(&cache->enabled, enabled && cache->capacity > 0);
+}
+
+// Function to log the hit rate and staleness counters
+void remote_cache_report(RemoteCache *cache) {
+    RemoteCacheStats *stats = &cache->stats;
+    uint64_t hits = atomic_load(&stats->hits);
+    uint64_t lookups = hits + atomic_load(&stats->misses);
+    uint64_t lag_count = atomic_load(&stats->lag_count);
+
+    // Three lines, since each log message is at most LOG_MESSAGE_SIZE bytes
+    LOG(LOG_INFO, "Remote cache: %llu/%llu hits (%.1f%%), %llu stored, %llu raced, %llu evicted%s",
+        (unsigned long long)hits, (unsigned long long)lookups, lookups ? 100.0 * hits / lookups : 0.0,
+        (unsigned long long)atomic_load(&stats->inserts), (unsigned long long)atomic_load(&stats->raced),
+        (unsigned long long)atomic_load(&stats->evictions), atomic_load(&cache->enabled) ? "" : " (disabled)");
+    LOG(LOG_INFO, "Remote cache: %llu invalidated, hit age avg %lld us max %lld us",
+        (unsigned long long)atomic_load(&stats->invalidations),
+        hits ? (long long)(atomic_load(&stats->hit_age_total) / (int64_t)hits) : 0LL,
+        (long long)atomic_load(&stats->hit_age_max));
+    LOG(LOG_INFO, "Remote cache: invalidation lag avg %lld us max %lld us",
+        lag_count ? (long long)(atomic_load(&stats->lag_total) / (int64_t)lag_count) : 0LL,
+        (long long)atomic_load(&stats->lag_max));
+}
@@ -0,0 +1,73 @@
+// remote_cache.h
+#ifndef REMOTE_CACHE_H
+#define REMOTE_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Default number of remote balances a branch keeps
+#define REMOTE_CACHE_SLOTS 256
+
+// One cached balance. The generation counts invalidations of every account
+// that maps to the slot, so a balance fetched before an invalidation arrived
+// is never stored after it.
+typedef struct {
+    pthread_mutex_t mutex;
+    int accountNumber;       // 0 = empty
+    int64_t balance;         // Cents
+    int64_t fetched_at;      // current_time_us when the fetch was sent
+    unsigned generation;
+} RemoteCacheSlot;
+
+// Hit rate and staleness counters since startup
+typedef struct {
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t inserts;
+    _Atomic uint64_t raced;          // Fetches invalidated before they could be stored
+    _Atomic uint64_t evictions;
+    _Atomic uint64_t invalidations;
+    _Atomic int64_t hit_age_total;   // Microseconds since fetch, summed over hits
+    _Atomic int64_t hit_age_max;
+    _Atomic uint64_t lag_count;      // Invalidation frames received
+    _Atomic int64_t lag_total;       // Microseconds from central sending them to here
+    _Atomic int64_t lag_max;
+} RemoteCacheStats;
+
+// Direct-mapped cache of balances of accounts the branch does not own. It is
+// only used while invalidations from central arrive (enabled), since without
+// them a cached balance could stay stale forever.
+typedef struct {
+    RemoteCacheSlot *slots;
+    int capacity;
+    _Atomic int enabled;
+    RemoteCacheStats stats;
+} RemoteCache;
+
+// Allocate a disabled cache of capacity slots; a cache of 0 slots is never
+// enabled (returns -1 on error)
+int remote_cache_init(RemoteCache *cache, int capacity);
+
+// Generation to pass to remote_cache_insert, read before sending the fetch
+unsigned remote_cache_generation(RemoteCache *cache, int accountNumber);
+
+// Look up a balance in cents (returns 1 on a hit)
+int remote_cache_lookup(RemoteCache *cache, int accountNumber, int64_t *balance);
+
+// Store a fetched balance unless the account was invalidated since generation
+void remote_cache_insert(RemoteCache *cache, int accountNumber, int64_t balance, unsigned generation, int64_t fetched_at);
+
+// Drop an account's balance because it changed
+void remote_cache_invalidate(RemoteCache *cache, int accountNumber);
+
+// Record how long an invalidation frame took to arrive
+void remote_cache_record_lag(RemoteCache *cache, int64_t lag);
+
+// Empty the cache and start or stop using it
+void remote_cache_set_enabled(RemoteCache *cache, int enabled);
+
+// Log the hit rate and staleness counters
+void remote_cache_report(RemoteCache *cache);
+
+#endif // REMOTE_CACHE_H
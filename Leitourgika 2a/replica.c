@@ -0,0 +1,186 @@
+// replica.c
+#include "replica.h"
+#include "logger.h"
+#include <stdio.h>
+#include <errno.h>
+
+// Function to raise a maximum to value
+static void record_max(_Atomic int64_t *maximum, int64_t value) {
+    int64_t current = atomic_load(maximum);
+    while (value > current && !atomic_compare_exchange_weak(maximum, &current, value)) {
+    }
+}
+
+// Function to load the department's accounts into an offline replica
+int replica_init(Replica *replica, const char *filename, unsigned char department, int max_account) {
+    if (account_table_load(&replica->table, filename, max_account) < 0) {
+        return -1;
+    }
+    replica->department = department;
+    atomic_init(&replica->state, REPLICA_OFFLINE);
+    atomic_init(&replica->applied_lsn, 0);
+    pthread_mutex_init(&replica->mutex, NULL);
+    pthread_cond_init(&replica->applied_cond, NULL);
+
+    aggregate_snapshot_init(&replica->totals);
+    aggregate_snapshot_begin(&replica->totals);
+    for (int i = 0; i < replica->table.record_count; ++i) {
+        AccountSlot *slot = account_table_record_slot(&replica->table, i);
+        if (slot) {
+            aggregate_add_account(&replica->totals.departments[department], atomic_load(&slot->balance));
+        }
+    }
+    aggregate_snapshot_publish(&replica->totals, 0);
+    return 0;
+}
+
+// Function to read a balance from the replica
+int replica_balance(Replica *replica, int accountNumber, int64_t *balance) {
+    if (atomic_load(&replica->state) != REPLICA_STREAMING) {
+        return 0;
+    }
+    AccountSlot *slot = account_table_find(&replica->table, accountNumber);
+    if (!slot) {
+        return 0;
+    }
+    *balance = atomic_load(&slot->balance);
+    return 1;
+}
+
+// Function to read an account's version from the replica
+uint64_t replica_version(Replica *replica, int accountNumber) {
+    if (atomic_load(&replica->state) != REPLICA_STREAMING) {
+        return 0;
+    }
+    AccountSlot *slot = account_table_find(&replica->table, accountNumber);
+    return slot ? atomic_load(&slot->version) : 0;
+}
+
+// Function to read the department's total from the replica, without waiting
+// for a frame being applied
+int replica_totals(Replica *replica, int64_t *sum, uint64_t *lsn) {
+    if (atomic_load(&replica->state) != REPLICA_STREAMING) {
+        return -1;
+    }
+    DepartmentAggregate totals;
+    *lsn = aggregate_snapshot_read(&replica->totals, replica->department, &totals);
+    return aggregate_read(&totals, sum);
+}
+
+// Function to wait for the replica to reach a log position
+int replica_wait(Replica *replica, uint64_t lsn) {
+    if (atomic_load(&replica->state) == REPLICA_STREAMING && atomic_load(&replica->applied_lsn) >= lsn) {
+        return 1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPLICA_WAIT_MS / 1000;
+    deadline.tv_nsec += (REPLICA_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    atomic_fetch_add(&replica->stats.waits, 1);
+    pthread_mutex_lock(&replica->mutex);
+    // A sync in progress ends at or past lsn, or the stream brings it after
+    while (atomic_load(&replica->state) != REPLICA_OFFLINE
+           && (atomic_load(&replica->state) != REPLICA_STREAMING || atomic_load(&replica->applied_lsn) < lsn)) {
+        if (pthread_cond_timedwait(&replica->applied_cond, &replica->mutex, &deadline) == ETIMEDOUT) {
+            atomic_fetch_add(&replica->stats.wait_timeouts, 1);
+            break;
+        }
+    }
+    int caught_up = atomic_load(&replica->state) == REPLICA_STREAMING && atomic_load(&replica->applied_lsn) >= lsn;
+    pthread_mutex_unlock(&replica->mutex);
+    return caught_up;
+}
+
+// Function to start a session: the sync frames overwrite every balance
+void replica_start_sync(Replica *replica) {
+    pthread_mutex_lock(&replica->mutex);
+    atomic_store(&replica->state, REPLICA_SYNCING);
+    pthread_cond_broadcast(&replica->applied_cond);
+    pthread_mutex_unlock(&replica->mutex);
+}
+
+// Function to apply one change frame
+int replica_apply(Replica *replica, const ChangeBatch *batch, const ChangeRecord *records, int64_t sent_at) {
+    int sync = (batch->flags & CHANGE_SYNC) != 0;
+    if (sync != (atomic_load(&replica->state) == REPLICA_SYNCING)) {
+        return -1;
+    }
+
+    // A frame holds whole log batches, so its changes are published together
+    DepartmentAggregate *totals = &replica->totals.departments[replica->department];
+    pthread_mutex_lock(&replica->mutex);
+    aggregate_snapshot_begin(&replica->totals);
+    for (uint32_t i = 0; i < batch->count; ++i) {
+        AccountSlot *slot = account_table_find(&replica->table, records[i].accountNumber);
+        if (!slot) {
+            atomic_fetch_add(&replica->stats.unknown, 1);
+            continue;
+        }
+        if (sync) {
+            int64_t old_balance = atomic_exchange(&slot->balance, records[i].amount);
+            aggregate_change(totals, records[i].amount - old_balance);
+        } else {
+            atomic_fetch_add(&slot->balance, records[i].amount);
+            aggregate_change(totals, records[i].amount);
+        }
+        atomic_store(&slot->version, records[i].version);
+    }
+    aggregate_snapshot_publish(&replica->totals, batch->lsn);
+    atomic_store(&replica->applied_lsn, batch->lsn);
+    if (batch->flags & CHANGE_SYNC_DONE) {
+        atomic_store(&replica->state, REPLICA_STREAMING);
+        atomic_fetch_add(&replica->stats.syncs, 1);
+    }
+    pthread_cond_broadcast(&replica->applied_cond);
+    pthread_mutex_unlock(&replica->mutex);
+
+    ReplicaStats *stats = &replica->stats;
+    int64_t now = current_time_us();
+    atomic_fetch_add(&stats->frames, 1);
+    if (!sync) {
+        atomic_fetch_add(&stats->changes, batch->count);
+    }
+    atomic_store(&stats->head_lsn, batch->head_lsn);
+    atomic_store(&stats->last_frame_at, now);
+    atomic_store(&stats->delay_last, now - sent_at);
+    atomic_fetch_add(&stats->delay_total, now - sent_at);
+    record_max(&stats->delay_max, now - sent_at);
+    return 0;
+}
+
+// Function to stop answering reads from the replica
+void replica_set_offline(Replica *replica) {
+    pthread_mutex_lock(&replica->mutex);
+    atomic_store(&replica->state, REPLICA_OFFLINE);
+    pthread_cond_broadcast(&replica->applied_cond);
+    pthread_mutex_unlock(&replica->mutex);
+}
+
+// Function to log the lag and delivery counters
+void replica_report(Replica *replica) {
+    static const char *state_names[] = {"offline", "syncing", "streaming"};
+    ReplicaStats *stats = &replica->stats;
+    uint64_t applied = atomic_load(&replica->applied_lsn);
+    uint64_t head = atomic_load(&stats->head_lsn);
+    uint64_t frames = atomic_load(&stats->frames);
+    int64_t last_frame_at = atomic_load(&stats->last_frame_at);
+
+    // Three lines, since each log message is at most LOG_MESSAGE_SIZE bytes
+    LOG(LOG_INFO, "Replica: %s at LSN %llu, %llu behind central, last frame %lld ms ago",
+        state_names[atomic_load(&replica->state)], (unsigned long long)applied,
+        (unsigned long long)(head > applied ? head - applied : 0),
+        last_frame_at ? (long long)((current_time_us() - last_frame_at) / 1000) : -1LL);
+    LOG(LOG_INFO, "Replica: %llu frames, %llu changes, %llu syncs, %llu unknown, delay avg %lld us max %lld us",
+        (unsigned long long)frames, (unsigned long long)atomic_load(&stats->changes),
+        (unsigned long long)atomic_load(&stats->syncs), (unsigned long long)atomic_load(&stats->unknown),
+        frames ? (long long)(atomic_load(&stats->delay_total) / (int64_t)frames) : 0LL,
+        (long long)atomic_load(&stats->delay_max));
+    LOG(LOG_INFO, "Replica: %llu mutations waited for their change, %llu timed out",
+        (unsigned long long)atomic_load(&stats->waits), (unsigned long long)atomic_load(&stats->wait_timeouts));
+}
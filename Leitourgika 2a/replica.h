@@ -0,0 +1,84 @@
+// replica.h
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include "bank_system.h"
+#include "account_table.h"
+#include "aggregate.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Longest a mutation waits for its own change to reach the replica
+#define REPLICA_WAIT_MS 2000
+
+// Replication state
+#define REPLICA_OFFLINE 0    // Not connected: balances may be stale
+#define REPLICA_SYNCING 1    // Receiving the sync of every balance
+#define REPLICA_STREAMING 2  // Applying central's changes as they happen
+
+// Delivery and lag counters since startup
+typedef struct {
+    _Atomic uint64_t frames;         // Change frames applied
+    _Atomic uint64_t changes;        // Deltas applied
+    _Atomic uint64_t syncs;          // Completed syncs
+    _Atomic uint64_t unknown;        // Changes to accounts the replica does not hold
+    _Atomic uint64_t waits;          // Mutations that waited for their own change
+    _Atomic uint64_t wait_timeouts;
+    _Atomic uint64_t head_lsn;       // Central's last logged position, as of the last frame
+    _Atomic int64_t last_frame_at;   // current_time_us when the last frame arrived
+    _Atomic int64_t delay_last;      // Microseconds from central sending a frame to here
+    _Atomic int64_t delay_total;
+    _Atomic int64_t delay_max;
+} ReplicaStats;
+
+// This department's balances, kept in step with central by applying its
+// ordered change stream on a background thread. Reads use it only while the
+// stream is up (REPLICA_STREAMING), so a balance never lags behind a change
+// this branch already acknowledged by more than a bounded wait.
+typedef struct {
+    AccountTable table;
+    AggregateSnapshot totals;        // Published once per applied frame
+    unsigned char department;
+    _Atomic int state;               // REPLICA_*
+    _Atomic uint64_t applied_lsn;    // Central log position the balances match
+    pthread_mutex_t mutex;           // Held while applying a frame
+    pthread_cond_t applied_cond;     // Signalled after every frame and state change
+    ReplicaStats stats;
+} Replica;
+
+// Load the department's accounts from filename, offline until the first sync
+// (returns -1 on error)
+int replica_init(Replica *replica, const char *filename, unsigned char department, int max_account);
+
+// Read a balance in cents while streaming (returns 1 if it was answered)
+int replica_balance(Replica *replica, int accountNumber, int64_t *balance);
+
+// Read the central log position of an account's last change while streaming,
+// the version central checks an optimistic mutation against (0 = unknown)
+uint64_t replica_version(Replica *replica, int accountNumber);
+
+// Read the department's total in cents while streaming, as of the central
+// log position stored in lsn; returns the number of accounts, or -1 if the
+// replica cannot answer
+int replica_totals(Replica *replica, int64_t *sum, uint64_t *lsn);
+
+// Wait until the replica has applied central's log up to lsn; returns 1 once
+// it has, 0 if it is not streaming or the wait timed out
+int replica_wait(Replica *replica, uint64_t lsn);
+
+// Start a session after central accepted QUERY_REPLICATE: its sync frames
+// come next
+void replica_start_sync(Replica *replica);
+
+// Apply one FRAME_CHANGES frame sent at sent_at (returns -1 if the frame does
+// not follow the session's order)
+int replica_apply(Replica *replica, const ChangeBatch *batch, const ChangeRecord *records, int64_t sent_at);
+
+// Stop answering reads after the stream dropped
+void replica_set_offline(Replica *replica);
+
+// Log the lag and delivery counters
+void replica_report(Replica *replica);
+
+#endif // REPLICA_H
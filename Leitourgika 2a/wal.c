@@ -0,0 +1,420 @@
+// wal.c
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define WAL_READ_RECORDS 4096
+
+// Function to checksum a record (FNV-1a over everything before the checksum)
+static uint32_t record_checksum(const WalRecord *record) {
+    const unsigned char *bytes = (const unsigned char *)record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(WalRecord, checksum); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to build the file name of a segment
+static void segment_name(const Wal *wal, unsigned segment, char *name, size_t size) {
+    snprintf(name, size, "%s.%06u", wal->prefix, segment);
+}
+
+// Function to make created, renamed or deleted files in the directory durable
+static void sync_directory() {
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+static int compare_segments(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to list existing segment numbers in ascending order
+static unsigned *list_segments(const Wal *wal, int *count) {
+    *count = 0;
+    DIR *dir = opendir(".");
+    if (!dir) {
+        perror("Unable to list log segments");
+        return NULL;
+    }
+
+    size_t prefix_length = strlen(wal->prefix);
+    unsigned *segments = NULL;
+    int capacity = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, wal->prefix, prefix_length) != 0 || name[prefix_length] != '.') {
+            continue;
+        }
+        char *end;
+        unsigned long number = strtoul(name + prefix_length + 1, &end, 10);
+        if (*end != '\0' || end == name + prefix_length + 1) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned *grown = realloc(segments, capacity * sizeof(unsigned));
+            if (!grown) {
+                break;
+            }
+            segments = grown;
+        }
+        segments[(*count)++] = (unsigned)number;
+    }
+    closedir(dir);
+
+    qsort(segments, *count, sizeof(unsigned), compare_segments);
+    return segments;
+}
+
+// Function to replay one segment, returning -1 on a gap and 1 on a torn tail
+static int replay_segment(Wal *wal, unsigned segment, uint64_t *last_lsn,
+                          WalReplayFunction replay, void *arg) {
+    char name[96];
+    segment_name(wal, segment, name, sizeof(name));
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        perror("Unable to open log segment");
+        return -1;
+    }
+
+    WalRecord *records = malloc(WAL_READ_RECORDS * sizeof(WalRecord));
+    off_t offset = 0;
+    int result = 0;
+    ssize_t bytes;
+
+    while (result == 0 && (bytes = pread(fd, records, WAL_READ_RECORDS * sizeof(WalRecord), offset)) > 0) {
+        size_t count = bytes / sizeof(WalRecord);
+        for (size_t i = 0; i < count; ++i) {
+            if (records[i].checksum != record_checksum(&records[i])) {
+                result = 1;
+                break;
+            }
+            offset += sizeof(WalRecord);
+
+            // Already part of the checkpoint
+            if (records[i].lsn <= *last_lsn) {
+                continue;
+            }
+            if (records[i].lsn != *last_lsn + 1) {
+                fprintf(stderr, "Log segment %s jumps from LSN %llu to %llu\n", name,
+                        (unsigned long long)*last_lsn, (unsigned long long)records[i].lsn);
+                result = -1;
+                break;
+            }
+            replay(&records[i], arg);
+            *last_lsn = records[i].lsn;
+        }
+        if ((size_t)bytes % sizeof(WalRecord) != 0 && result == 0 && count < WAL_READ_RECORDS) {
+            result = 1;
+        }
+    }
+
+    if (result == 1) {
+        // A crash cut the last write short: drop the partial record for good
+        fprintf(stderr, "Truncating torn record at offset %ld of %s\n", (long)offset, name);
+        if (ftruncate(fd, offset) < 0 || fsync(fd) < 0) {
+            perror("Unable to truncate log segment");
+            result = -1;
+        }
+    }
+
+    free(records);
+    close(fd);
+    return result;
+}
+
+// Function to open a segment for appending
+static int open_segment(Wal *wal, unsigned segment) {
+    char name[96];
+    segment_name(wal, segment, name, sizeof(name));
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Unable to create log segment");
+        return -1;
+    }
+    sync_directory();
+    return fd;
+}
+
+// Function to write a whole buffer to the log, exiting if the disk fails
+static void write_log(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Acknowledged mutations can no longer be made durable
+            perror("Write-ahead log write failed");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Function to write and sync one batch, rotating segments where requested
+static void flush_batch(Wal *wal, WalBatch *batch) {
+    size_t split = batch->rotate_offset < batch->length ? batch->rotate_offset : batch->length;
+    write_log(wal->fd, batch->buffer, split);
+
+    if (batch->rotate_offset != SIZE_MAX) {
+        if (fdatasync(wal->fd) < 0) {
+            perror("Write-ahead log sync failed");
+            exit(EXIT_FAILURE);
+        }
+        close(wal->fd);
+        wal->segment = batch->rotate_segment;
+        wal->fd = open_segment(wal, wal->segment);
+        if (wal->fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    write_log(wal->fd, batch->buffer + split, batch->length - split);
+    if (fdatasync(wal->fd) < 0) {
+        perror("Write-ahead log sync failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function run by the flusher thread: every pass writes everything appended
+// since the previous pass and syncs it once
+static void *wal_flusher(void *wal_ptr) {
+    Wal *wal = wal_ptr;
+
+    pthread_mutex_lock(&wal->mutex);
+    while (1) {
+        WalBatch *batch = &wal->batches[wal->active];
+        while (batch->length == 0 && batch->rotate_offset == SIZE_MAX) {
+            pthread_cond_wait(&wal->flush_cond, &wal->mutex);
+        }
+
+        // New appends go to the other batch while this one is written
+        wal->active ^= 1;
+        pthread_mutex_unlock(&wal->mutex);
+
+        flush_batch(wal, batch);
+
+        pthread_mutex_lock(&wal->mutex);
+        // Appends go to the other batch until the next pass, so its records
+        // stay readable after the reset below
+        const WalRecord *records = (const WalRecord *)batch->buffer;
+        int record_count = batch->length / sizeof(WalRecord);
+        if (batch->length > 0) {
+            wal->durable_lsn = batch->last_lsn;
+        }
+        batch->length = 0;
+        batch->rotate_offset = SIZE_MAX;
+        pthread_cond_broadcast(&wal->durable_cond);
+
+        // Collect the callbacks whose records are now durable
+        WalWaiter *ready = NULL;
+        WalWaiter **link = &wal->waiters;
+        while (*link) {
+            WalWaiter *waiter = *link;
+            if (waiter->lsn <= wal->durable_lsn) {
+                *link = waiter->next;
+                waiter->next = ready;
+                ready = waiter;
+            } else {
+                link = &waiter->next;
+            }
+        }
+
+        pthread_mutex_unlock(&wal->mutex);
+        if (wal->listener && record_count > 0) {
+            wal->listener(records, record_count, wal->listener_arg);
+        }
+        while (ready) {
+            WalWaiter *next = ready->next;
+            ready->callback(ready->arg);
+            free(ready);
+            ready = next;
+        }
+        pthread_mutex_lock(&wal->mutex);
+    }
+    return NULL;
+}
+
+// Function to replay the log and start appending to it
+int wal_open(Wal *wal, const char *prefix, uint64_t base_lsn, WalReplayFunction replay, void *arg) {
+    memset(wal, 0, sizeof(Wal));
+    snprintf(wal->prefix, sizeof(wal->prefix), "%s", prefix);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->flush_cond, NULL);
+    pthread_cond_init(&wal->durable_cond, NULL);
+    wal->batches[0].rotate_offset = SIZE_MAX;
+    wal->batches[1].rotate_offset = SIZE_MAX;
+
+    int count;
+    unsigned *segments = list_segments(wal, &count);
+    uint64_t last_lsn = base_lsn;
+
+    for (int i = 0; i < count; ++i) {
+        int result = replay_segment(wal, segments[i], &last_lsn, replay, arg);
+        if (result < 0) {
+            free(segments);
+            return -1;
+        }
+        if (result == 1 && i != count - 1) {
+            fprintf(stderr, "Log segment %u is damaged before the end of the log\n", segments[i]);
+            free(segments);
+            return -1;
+        }
+    }
+
+    // Never append to an old segment: start a fresh one
+    wal->segment = count > 0 ? segments[count - 1] + 1 : 1;
+    wal->next_segment = wal->segment + 1;
+    free(segments);
+
+    wal->fd = open_segment(wal, wal->segment);
+    if (wal->fd < 0) {
+        return -1;
+    }
+
+    wal->next_lsn = last_lsn + 1;
+    wal->durable_lsn = last_lsn;
+
+    if (pthread_create(&wal->flusher, NULL, wal_flusher, wal) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(wal->flusher);
+    return 0;
+}
+
+// Function to append a record
+uint64_t wal_append(Wal *wal, WalRecord *record) {
+    return wal_append_records(wal, record, 1);
+}
+
+// Function to append records as one unit
+uint64_t wal_append_records(Wal *wal, WalRecord *records, int count) {
+    size_t length = count * sizeof(WalRecord);
+    pthread_mutex_lock(&wal->mutex);
+    WalBatch *batch = &wal->batches[wal->active];
+
+    if (batch->length + length > batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity : 64 * sizeof(WalRecord);
+        while (batch->length + length > capacity) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(batch->buffer, capacity);
+        if (!buffer) {
+            perror("Unable to grow write-ahead log buffer");
+            exit(EXIT_FAILURE);
+        }
+        batch->buffer = buffer;
+        batch->capacity = capacity;
+    }
+
+    int was_empty = batch->length == 0;
+    for (int i = 0; i < count; ++i) {
+        records[i].lsn = wal->next_lsn++;
+        records[i].checksum = record_checksum(&records[i]);
+    }
+    memcpy(batch->buffer + batch->length, records, length);
+    batch->length += length;
+    batch->last_lsn = records[count - 1].lsn;
+
+    // The flusher only sleeps while the active batch is empty
+    if (was_empty) {
+        pthread_cond_signal(&wal->flush_cond);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return records[count - 1].lsn;
+}
+
+// Function to run a callback once a record is durable
+void wal_on_durable(Wal *wal, uint64_t lsn, WalCallback callback, void *arg) {
+    pthread_mutex_lock(&wal->mutex);
+    if (lsn <= wal->durable_lsn) {
+        pthread_mutex_unlock(&wal->mutex);
+        callback(arg);
+        return;
+    }
+
+    WalWaiter *waiter = malloc(sizeof(WalWaiter));
+    if (!waiter) {
+        // Fall back to waiting here
+        pthread_mutex_unlock(&wal->mutex);
+        wal_wait_durable(wal, lsn);
+        callback(arg);
+        return;
+    }
+    waiter->lsn = lsn;
+    waiter->callback = callback;
+    waiter->arg = arg;
+    waiter->next = wal->waiters;
+    wal->waiters = waiter;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// Function to set the listener told about every durable batch
+void wal_set_listener(Wal *wal, WalBatchFunction listener, void *arg) {
+    pthread_mutex_lock(&wal->mutex);
+    wal->listener = listener;
+    wal->listener_arg = arg;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// Function to wait until a record is durable
+void wal_wait_durable(Wal *wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->durable_lsn < lsn) {
+        pthread_cond_wait(&wal->durable_cond, &wal->mutex);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+// Function to get the LSN of the last appended record
+uint64_t wal_last_lsn(Wal *wal) {
+    pthread_mutex_lock(&wal->mutex);
+    uint64_t lsn = wal->next_lsn - 1;
+    pthread_mutex_unlock(&wal->mutex);
+    return lsn;
+}
+
+// Function to start a new segment after the last appended record
+unsigned wal_rotate(Wal *wal) {
+    pthread_mutex_lock(&wal->mutex);
+    WalBatch *batch = &wal->batches[wal->active];
+    if (batch->rotate_offset == SIZE_MAX) {
+        batch->rotate_offset = batch->length;
+        batch->rotate_segment = wal->next_segment++;
+        pthread_cond_signal(&wal->flush_cond);
+    }
+    unsigned segment = batch->rotate_segment;
+    pthread_mutex_unlock(&wal->mutex);
+    return segment;
+}
+
+// Function to delete checkpointed segments
+void wal_remove_segments_before(Wal *wal, unsigned segment) {
+    int count;
+    unsigned *segments = list_segments(wal, &count);
+    for (int i = 0; i < count && segments[i] < segment; ++i) {
+        char name[96];
+        segment_name(wal, segments[i], name, sizeof(name));
+        if (unlink(name) < 0) {
+            perror("Unable to remove log segment");
+        }
+    }
+    free(segments);
+    sync_directory();
+}
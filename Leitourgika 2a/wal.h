@@ -0,0 +1,103 @@
+// wal.h
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Mutation types recorded in the log
+#define WAL_UPDATE 1
+#define WAL_TRANSFER 2
+#define WAL_MULTI_TRANSFER 3 // Net change of the first account of a multi-transfer
+#define WAL_LEG 4            // Net change of each later one
+
+// One logged mutation. Amounts are deltas in cents, so replaying the records
+// after a checkpoint rebuilds exactly the balances that were served, whatever
+// order concurrent changes to one account were logged in.
+typedef struct {
+    uint64_t lsn;            // Log sequence number, consecutive from 1
+    int64_t amount;          // Cents
+    int32_t type;            // WAL_*
+    int32_t accountNumber1;  // Updated account, or transfer source
+    int32_t accountNumber2;  // Transfer destination, or in a multi-transfer the
+                             // number of its records after this one
+    uint32_t checksum;       // Over every field above
+} WalRecord;
+
+typedef void (*WalCallback)(void *arg);
+typedef void (*WalReplayFunction)(const WalRecord *record, void *arg);
+typedef void (*WalBatchFunction)(const WalRecord *records, int count, void *arg);
+
+// Callback to run once the log is durable up to lsn
+typedef struct WalWaiter {
+    uint64_t lsn;
+    WalCallback callback;
+    void *arg;
+    struct WalWaiter *next;
+} WalWaiter;
+
+// Records appended while the previous batch is being written and synced
+typedef struct {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t rotate_offset;    // Start a new segment here (SIZE_MAX = no rotation)
+    unsigned rotate_segment; // Number of that new segment
+    uint64_t last_lsn;
+} WalBatch;
+
+// Append-only log split into segment files <prefix>.<number>. A single
+// flusher thread writes whole batches and syncs them once (group commit).
+typedef struct {
+    char prefix[64];
+    int fd;                  // Segment currently written by the flusher
+    unsigned segment;        // Number of that segment
+    unsigned next_segment;   // Number the next rotation will create
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    WalBatch batches[2];
+    int active;              // Batch that appends go to
+    WalWaiter *waiters;
+    WalBatchFunction listener;   // Told about every batch once it is durable
+    void *listener_arg;
+    pthread_mutex_t mutex;
+    pthread_cond_t flush_cond;
+    pthread_cond_t durable_cond;
+    pthread_t flusher;
+} Wal;
+
+// Replay every record after base_lsn, then open a new segment and start the
+// flusher (returns -1 if the log is unusable)
+int wal_open(Wal *wal, const char *prefix, uint64_t base_lsn, WalReplayFunction replay, void *arg);
+
+// Append a record and return its LSN; it is durable once the flusher syncs it
+uint64_t wal_append(Wal *wal, WalRecord *record);
+
+// Append count records with consecutive LSNs and return the last one. They
+// are written in the same batch and segment, so they become durable, reach
+// the listener and are kept by a checkpoint together.
+uint64_t wal_append_records(Wal *wal, WalRecord *records, int count);
+
+// Run callback(arg) on the flusher thread once lsn is durable (or right away)
+void wal_on_durable(Wal *wal, uint64_t lsn, WalCallback callback, void *arg);
+
+// Run listener(records, count, arg) on the flusher thread with the records of
+// every batch once they are durable, in log order. Set it before the first
+// append; the records are only valid during the call.
+void wal_set_listener(Wal *wal, WalBatchFunction listener, void *arg);
+
+// Block until lsn is durable
+void wal_wait_durable(Wal *wal, uint64_t lsn);
+
+// LSN of the last appended record
+uint64_t wal_last_lsn(Wal *wal);
+
+// End the current segment after the last appended record, so everything
+// appended later lands in a new segment. Returns that segment's number.
+unsigned wal_rotate(Wal *wal);
+
+// Delete segments numbered below segment (their records are checkpointed)
+void wal_remove_segments_before(Wal *wal, unsigned segment);
+
+#endif // WAL_H
@@ -0,0 +1,171 @@
+// work_pool.c
+#include "work_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    WorkPool *pool;
+    int index;
+} WorkerStart;
+
+// Deque index of the calling worker, -1 on other threads
+static __thread int current_worker = -1;
+static __thread WorkPool *current_pool = NULL;
+
+// Function to append an item at the tail of a deque
+static int deque_push(WorkDeque *deque, WorkItem item) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == deque->capacity) {
+        size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+        WorkItem *items = malloc(new_capacity * sizeof(WorkItem));
+        if (!items) {
+            pthread_mutex_unlock(&deque->mutex);
+            return -1;
+        }
+        for (size_t i = 0; i < deque->count; ++i) {
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity = new_capacity;
+        deque->head = 0;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = item;
+    deque->count++;
+    pthread_mutex_unlock(&deque->mutex);
+    return 0;
+}
+
+// Function for the owner to take the newest item from the tail
+static int deque_pop(WorkDeque *deque, WorkItem *item) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->mutex);
+        return 0;
+    }
+    deque->count--;
+    *item = deque->items[(deque->head + deque->count) % deque->capacity];
+    pthread_mutex_unlock(&deque->mutex);
+    return 1;
+}
+
+// Function for a thief to take the oldest item from the head
+static int deque_steal(WorkDeque *deque, WorkItem *item) {
+    // Skip empty deques without touching their lock
+    if (__atomic_load_n(&deque->count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->mutex);
+        return 0;
+    }
+    *item = deque->items[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+    pthread_mutex_unlock(&deque->mutex);
+    return 1;
+}
+
+// Function to find work: own deque first, then steal from the others
+static int take_work(WorkPool *pool, int index, WorkItem *item) {
+    if (deque_pop(&pool->deques[index], item)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->worker_count; ++i) {
+        if (deque_steal(&pool->deques[(index + i) % pool->worker_count], item)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function run by each worker thread
+static void *worker_thread(void *start_ptr) {
+    WorkerStart start = *(WorkerStart *)start_ptr;
+    free(start_ptr);
+    WorkPool *pool = start.pool;
+    current_worker = start.index;
+    current_pool = pool;
+
+    while (1) {
+        WorkItem item;
+        if (take_work(pool, start.index, &item)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            item.function(item.arg);
+            continue;
+        }
+
+        // Sleep until something is queued. idle is raised before queued is
+        // checked, and submitters raise queued before checking idle, so a
+        // submission can never slip past a worker going to sleep.
+        pthread_mutex_lock(&pool->idle_mutex);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+    return NULL;
+}
+
+// Function to start the pool
+int work_pool_init(WorkPool *pool, int worker_count) {
+    memset(pool, 0, sizeof(WorkPool));
+    pool->worker_count = worker_count;
+    pool->deques = calloc(worker_count, sizeof(WorkDeque));
+    pool->threads = calloc(worker_count, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        perror("Unable to allocate work pool");
+        return -1;
+    }
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    }
+
+    for (int i = 0; i < worker_count; ++i) {
+        WorkerStart *start = malloc(sizeof(WorkerStart));
+        if (!start) {
+            perror("Unable to allocate worker");
+            return -1;
+        }
+        start->pool = pool;
+        start->index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_thread, start) != 0) {
+            perror("pthread_create failed");
+            free(start);
+            return -1;
+        }
+        pthread_detach(pool->threads[i]);
+    }
+    return 0;
+}
+
+// Function to queue work on the pool
+void work_pool_submit(WorkPool *pool, WorkFunction function, void *arg) {
+    WorkItem item = {function, arg};
+
+    // Workers keep their own follow-up work local; other threads spread it out
+    int index = current_pool == pool
+        ? current_worker
+        : (int)(__atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED) % pool->worker_count);
+
+    if (deque_push(&pool->deques[index], item) < 0) {
+        // Out of memory: run it here rather than drop it
+        perror("Unable to queue work");
+        function(arg);
+        return;
+    }
+
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+}
@@ -0,0 +1,46 @@
+// work_pool.h
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Default number of worker threads
+#define WORK_POOL_THREADS 16
+
+typedef void (*WorkFunction)(void *arg);
+
+typedef struct {
+    WorkFunction function;
+    void *arg;
+} WorkItem;
+
+// Double-ended queue owned by one worker: the owner pushes and pops at the
+// tail, idle workers steal the oldest items from the head
+typedef struct {
+    WorkItem *items;     // Ring buffer
+    size_t capacity;
+    size_t head;
+    size_t count;
+    pthread_mutex_t mutex;
+} WorkDeque;
+
+// Fixed-size pool of workers with per-worker deques and work stealing
+typedef struct {
+    int worker_count;
+    WorkDeque *deques;
+    pthread_t *threads;
+    unsigned next_deque;       // Round robin target for submissions from other threads
+    long queued;               // Items waiting in all deques
+    int idle;                  // Workers asleep or about to sleep
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+} WorkPool;
+
+// Start worker_count workers (returns -1 on error)
+int work_pool_init(WorkPool *pool, int worker_count);
+
+// Queue function(arg) to run on a worker
+void work_pool_submit(WorkPool *pool, WorkFunction function, void *arg);
+
+#endif // WORK_POOL_H